@@ -0,0 +1,115 @@
+// Copyright (c) 2015 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "consensus/merkle.h"
+
+#include "crypto/sha256.h"
+
+#include <string.h>
+
+/*     WARNING! If you're reading this because you're learning about crypto
+       and/or designing a new system that will use merkle trees, keep in mind
+       that the following merkle tree algorithm has a serious flaw related to
+       duplicate txids, resulting in a vulnerability (CVE-2012-2459).
+
+       The reason is that if the number of hashes in the list at a given time
+       is odd, the last one is duplicated before computing the next level (which
+       is unusual in Merkle trees). This results in certain sequences of
+       transactions leading to the same merkle root. For example, these two
+       trees:
+
+                    A               A
+                  /  \            /   \
+                B     C         B       C
+               / \    |        / \     / \
+              D   E   F       D   E   F   F
+             / \ / \ / \     / \ / \ / \ / \
+             1 2 3 4 5 6     1 2 3 4 5 6 5 6
+
+       for transaction lists [1,2,3,4,5,6] and [1,2,3,4,5,6,5,6] (where 5 and
+       6 are repeated) result in the same root hash A (because the hash of both
+       of (F) and (F,F) is C).
+
+       The vulnerability results from being able to send a block with such a
+       transaction list, with the same merkle root, and the same block hash as
+       the original without duplication, resulting in failed validation. If the
+       receiving node proceeds to mark that block as permanently invalid
+       however, it will fail to accept further unmodified (and thus potentially
+       valid) versions of the same block. We defend against this by detecting
+       the case where we would hash two identical hashes at the end of the list
+       together, and treating that identically to the block having an invalid
+       merkle root. Assuming no double-SHA256 collisions, this will detect all
+       known ways of changing the transactions without affecting the merkle
+       root.
+*/
+
+static_assert(sizeof(uint256) == 32, "merkle levels are hashed as contiguous 64-byte pairs");
+
+/**
+ * Hash the nSize nodes at in pairwise into the (nSize + 1) / 2 nodes at out.
+ * out may be equal to in: every pair is read before its hash is written.
+ */
+static void HashMerkleLevel(uint256* out, const uint256* in, size_t nSize, bool& mutated)
+{
+    size_t nPairs = nSize / 2;
+    if (nSize % 2 == 0 && in[nSize - 2] == in[nSize - 1]) {
+        // Two identical hashes at the end of the list at a particular level.
+        mutated = true;
+    }
+    SHA256D64(out[0].begin(), in[0].begin(), nPairs);
+    if (nSize % 2 == 1) {
+        // Odd node out: hash it with itself.
+        unsigned char pair[64];
+        memcpy(pair, in[nSize - 1].begin(), 32);
+        memcpy(pair + 32, in[nSize - 1].begin(), 32);
+        SHA256D64(out[nPairs].begin(), pair, 1);
+    }
+}
+
+std::vector<size_t> MerkleTreeLevelSizes(size_t nLeaves)
+{
+    std::vector<size_t> vSizes;
+    if (nLeaves == 0)
+        return vSizes;
+    vSizes.push_back(nLeaves);
+    for (size_t nSize = nLeaves; nSize > 1; ) {
+        nSize = (nSize + 1) / 2;
+        vSizes.push_back(nSize);
+    }
+    return vSizes;
+}
+
+uint256 ComputeMerkleTree(std::vector<uint256>& vTree, bool* fMutated)
+{
+    bool mutated = false;
+    std::vector<size_t> vSizes = MerkleTreeLevelSizes(vTree.size());
+    size_t nTotal = 0;
+    for (size_t i = 0; i < vSizes.size(); i++)
+        nTotal += vSizes[i];
+    vTree.resize(nTotal);
+
+    size_t j = 0;
+    for (size_t level = 0; level + 1 < vSizes.size(); level++) {
+        HashMerkleLevel(&vTree[j + vSizes[level]], &vTree[j], vSizes[level], mutated);
+        j += vSizes[level];
+    }
+    if (fMutated) {
+        *fMutated = mutated;
+    }
+    return (vTree.empty() ? uint256() : vTree.back());
+}
+
+uint256 ComputeMerkleRoot(std::vector<uint256> vLeaves, bool* fMutated)
+{
+    bool mutated = false;
+    size_t nSize = vLeaves.size();
+    while (nSize > 1) {
+        HashMerkleLevel(&vLeaves[0], &vLeaves[0], nSize, mutated);
+        nSize = (nSize + 1) / 2;
+    }
+    if (fMutated) {
+        *fMutated = mutated;
+    }
+    return (vLeaves.empty() ? uint256() : vLeaves[0]);
+}
@@ -0,0 +1,34 @@
+// Copyright (c) 2015 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_CONSENSUS_MERKLE_H
+#define BITCOIN_CONSENSUS_MERKLE_H
+
+#include "uint256.h"
+
+#include <stddef.h>
+#include <vector>
+
+/**
+ * Build a merkle tree in place. On entry vTree holds the leaves; each
+ * following level is appended after the previous one, ending with the root.
+ * Every level is hashed in a single call to SHA256D64, so multi-lane SHA256
+ * kernels process several pairs at once.
+ *
+ * Returns the root, or a null hash if there are no leaves. If fMutated is
+ * not NULL, it is set when a level ends in two identical hashes (see
+ * CVE-2012-2459 in merkle.cpp).
+ */
+uint256 ComputeMerkleTree(std::vector<uint256>& vTree, bool* fMutated = NULL);
+
+/**
+ * Compute only the merkle root of the given leaves, reusing the leaves'
+ * buffer as scratch space for every level.
+ */
+uint256 ComputeMerkleRoot(std::vector<uint256> vLeaves, bool* fMutated = NULL);
+
+/** Return the number of nodes at each level of a tree with nLeaves leaves, starting with nLeaves. */
+std::vector<size_t> MerkleTreeLevelSizes(size_t nLeaves);
+
+#endif // BITCOIN_CONSENSUS_MERKLE_H
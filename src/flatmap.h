@@ -0,0 +1,354 @@
+// Copyright (c) 2019 The Zcash developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_FLATMAP_H
+#define BITCOIN_FLATMAP_H
+
+#include <assert.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <functional>
+#include <iterator>
+#include <new>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+/** Largest shift <= 12 such that 2^shift nodes of the given size fit in bytes. */
+static constexpr size_t flatmap_chunk_shift(size_t node_size, size_t bytes, size_t shift = 0)
+{
+    return (shift < 12 && (node_size << (shift + 1)) <= bytes) ? flatmap_chunk_shift(node_size, bytes, shift + 1) : shift;
+}
+
+/** Unordered map with an open-addressing index and pooled value storage.
+ *
+ *  Values live in fixed-size chunks of nodes that are never moved, so (unlike
+ *  iterators) pointers and references to elements stay valid until the element
+ *  is erased. The index is a flat array of 8-byte slots, each holding a node
+ *  number and 32 bits of the key's hash, probed linearly. Erased elements leave
+ *  a tombstone in the index and return their node to a free list, so erasing
+ *  never invalidates iterators to other elements and the usual
+ *  `m.erase(it++)` idiom works.
+ *
+ *  Compared to a node-based unordered map this saves the per-element
+ *  allocation and bucket pointer, and most failed probes are resolved without
+ *  touching the nodes at all.
+ *
+ *  The hash function must spread its entropy over all bits of its result; the
+ *  low bits select the slot and the high bits are used as a filter tag.
+ */
+template<typename K, typename T, typename Hash = std::hash<K>, typename Pred = std::equal_to<K> >
+class flatmap
+{
+public:
+    typedef K key_type;
+    typedef T mapped_type;
+    typedef std::pair<const K, T> value_type;
+    typedef size_t size_type;
+    typedef Hash hasher;
+    typedef Pred key_equal;
+
+private:
+    typedef typename std::aligned_storage<sizeof(value_type), std::alignment_of<value_type>::value>::type node_type;
+    static_assert(sizeof(node_type) >= sizeof(uint32_t), "nodes must be able to hold a free list link");
+
+    struct slot {
+        uint32_t tag;
+        uint32_t node;
+    };
+
+    static const uint32_t SLOT_EMPTY = 0xFFFFFFFF;
+    static const uint32_t SLOT_DELETED = 0xFFFFFFFE;
+    static const size_type MIN_SLOTS = 16;
+
+    /** Nodes are allocated in chunks of 2^CHUNK_SHIFT, about 16 KiB each. */
+    static const size_type CHUNK_SHIFT = flatmap_chunk_shift(sizeof(node_type), 16384);
+    static const size_type CHUNK_NODES = size_type(1) << CHUNK_SHIFT;
+
+    std::vector<slot> table;
+    std::vector<node_type*> chunks;
+    size_type nSize;
+    size_type nDeleted;
+    uint32_t nNodesUsed;
+    uint32_t nFreeHead;
+    Hash hash_function;
+    Pred key_eq;
+
+    value_type* node(uint32_t n) const
+    {
+        return reinterpret_cast<value_type*>(&chunks[n >> CHUNK_SHIFT][n & (CHUNK_NODES - 1)]);
+    }
+
+    uint32_t& free_link(uint32_t n) const
+    {
+        return *reinterpret_cast<uint32_t*>(&chunks[n >> CHUNK_SHIFT][n & (CHUNK_NODES - 1)]);
+    }
+
+    uint32_t allocate_node()
+    {
+        if (nFreeHead != SLOT_EMPTY) {
+            uint32_t n = nFreeHead;
+            nFreeHead = free_link(n);
+            return n;
+        }
+        if (nNodesUsed == chunks.size() * CHUNK_NODES) {
+            assert(nNodesUsed < SLOT_DELETED - CHUNK_NODES);
+            chunks.push_back(new node_type[CHUNK_NODES]);
+        }
+        return nNodesUsed++;
+    }
+
+    void free_node(uint32_t n)
+    {
+        free_link(n) = nFreeHead;
+        nFreeHead = n;
+    }
+
+    size_type mask() const { return table.size() - 1; }
+
+    static uint32_t tag_of(size_t h) { return (uint32_t)((uint64_t)h >> 32) ^ (uint32_t)h; }
+
+    /** Find the slot holding key, or SIZE_MAX. */
+    size_type find_slot(const key_type& key, size_t h) const
+    {
+        if (nSize == 0) return (size_type)-1;
+        const uint32_t tag = tag_of(h);
+        for (size_type pos = h & mask(); ; pos = (pos + 1) & mask()) {
+            const slot& s = table[pos];
+            if (s.node == SLOT_EMPTY) return (size_type)-1;
+            if (s.node != SLOT_DELETED && s.tag == tag && key_eq(node(s.node)->first, key)) return pos;
+        }
+    }
+
+    /** Find a free slot for a key known not to be present. */
+    size_type insert_slot(size_t h) const
+    {
+        for (size_type pos = h & mask(); ; pos = (pos + 1) & mask()) {
+            if (table[pos].node >= SLOT_DELETED) return pos;
+        }
+    }
+
+    /** Make room for one more element, rebuilding the index if it is getting full. */
+    void reserve_one()
+    {
+        if (!table.empty() && (nSize + nDeleted + 1) * 4 <= table.size() * 3) return;
+        // Rebuild to a load factor of at most one half, so that at least a
+        // quarter of the table can be consumed before the next rebuild.
+        size_type nSlots = MIN_SLOTS;
+        while ((nSize + 1) * 2 > nSlots) nSlots *= 2;
+        std::vector<slot> old;
+        old.swap(table);
+        slot empty = {0, SLOT_EMPTY};
+        table.assign(nSlots, empty);
+        nDeleted = 0;
+        for (size_type i = 0; i < old.size(); i++) {
+            if (old[i].node < SLOT_DELETED) {
+                table[insert_slot(hash_function(node(old[i].node)->first))] = old[i];
+            }
+        }
+    }
+
+    template<typename... Args>
+    std::pair<size_type, bool> emplace_key(const key_type& key, Args&&... args)
+    {
+        size_t h = hash_function(key);
+        size_type pos = find_slot(key, h);
+        if (pos != (size_type)-1) return std::make_pair(pos, false);
+        reserve_one();
+        pos = insert_slot(h);
+        uint32_t n = allocate_node();
+        try {
+            new (node(n)) value_type(std::forward<Args>(args)...);
+        } catch (...) {
+            free_node(n);
+            throw;
+        }
+        if (table[pos].node == SLOT_DELETED) nDeleted--;
+        table[pos].tag = tag_of(h);
+        table[pos].node = n;
+        nSize++;
+        return std::make_pair(pos, true);
+    }
+
+    void erase_slot(size_type pos)
+    {
+        uint32_t n = table[pos].node;
+        node(n)->~value_type();
+        free_node(n);
+        // A slot followed by an empty one is not part of any probe sequence.
+        if (table[(pos + 1) & mask()].node == SLOT_EMPTY) {
+            table[pos].node = SLOT_EMPTY;
+        } else {
+            table[pos].node = SLOT_DELETED;
+            nDeleted++;
+        }
+        nSize--;
+    }
+
+    template<bool Const>
+    class iterator_base
+    {
+        typedef typename std::conditional<Const, const flatmap*, flatmap*>::type map_pointer;
+        map_pointer m;
+        size_type pos;
+
+        void skip()
+        {
+            while (pos < m->table.size() && m->table[pos].node >= SLOT_DELETED) pos++;
+        }
+
+        friend class flatmap;
+        friend class iterator_base<!Const>;
+
+    public:
+        typedef std::forward_iterator_tag iterator_category;
+        typedef typename flatmap::value_type value_type;
+        typedef ptrdiff_t difference_type;
+        typedef typename std::conditional<Const, const value_type*, value_type*>::type pointer;
+        typedef typename std::conditional<Const, const value_type&, value_type&>::type reference;
+
+        iterator_base() : m(NULL), pos(0) {}
+        iterator_base(map_pointer mIn, size_type posIn) : m(mIn), pos(posIn) { skip(); }
+        iterator_base(const iterator_base<false>& it) : m(it.m), pos(it.pos) {}
+
+        reference operator*() const { return *m->node(m->table[pos].node); }
+        pointer operator->() const { return m->node(m->table[pos].node); }
+        iterator_base& operator++() { pos++; skip(); return *this; }
+        iterator_base operator++(int) { iterator_base copy(*this); ++(*this); return copy; }
+        bool operator==(const iterator_base& x) const { return pos == x.pos; }
+        bool operator!=(const iterator_base& x) const { return pos != x.pos; }
+    };
+
+public:
+    typedef iterator_base<false> iterator;
+    typedef iterator_base<true> const_iterator;
+
+    explicit flatmap(const Hash& hashIn = Hash(), const Pred& eqIn = Pred()) :
+        nSize(0), nDeleted(0), nNodesUsed(0), nFreeHead(SLOT_EMPTY), hash_function(hashIn), key_eq(eqIn) {}
+
+    flatmap(const flatmap& other) :
+        nSize(0), nDeleted(0), nNodesUsed(0), nFreeHead(SLOT_EMPTY), hash_function(other.hash_function), key_eq(other.key_eq)
+    {
+        for (const_iterator it = other.begin(); it != other.end(); ++it) {
+            insert(*it);
+        }
+    }
+
+    flatmap& operator=(const flatmap& other)
+    {
+        if (this != &other) {
+            clear();
+            for (const_iterator it = other.begin(); it != other.end(); ++it) {
+                insert(*it);
+            }
+        }
+        return *this;
+    }
+
+    ~flatmap() { clear(); }
+
+    iterator begin() { return iterator(this, 0); }
+    iterator end() { return iterator(this, table.size()); }
+    const_iterator begin() const { return const_iterator(this, 0); }
+    const_iterator end() const { return const_iterator(this, table.size()); }
+
+    size_type size() const { return nSize; }
+    bool empty() const { return nSize == 0; }
+
+    iterator find(const key_type& key)
+    {
+        size_type pos = find_slot(key, hash_function(key));
+        return pos == (size_type)-1 ? end() : iterator(this, pos);
+    }
+
+    const_iterator find(const key_type& key) const
+    {
+        size_type pos = find_slot(key, hash_function(key));
+        return pos == (size_type)-1 ? end() : const_iterator(this, pos);
+    }
+
+    size_type count(const key_type& key) const { return find_slot(key, hash_function(key)) != (size_type)-1; }
+
+    std::pair<iterator, bool> insert(const value_type& value)
+    {
+        std::pair<size_type, bool> ret = emplace_key(value.first, value);
+        return std::make_pair(iterator(this, ret.first), ret.second);
+    }
+
+    std::pair<iterator, bool> insert(value_type&& value)
+    {
+        std::pair<size_type, bool> ret = emplace_key(value.first, std::move(value));
+        return std::make_pair(iterator(this, ret.first), ret.second);
+    }
+
+    template<typename... Args>
+    std::pair<iterator, bool> emplace(const key_type& key, Args&&... args)
+    {
+        std::pair<size_type, bool> ret = emplace_key(key, std::piecewise_construct, std::forward_as_tuple(key), std::forward_as_tuple(std::forward<Args>(args)...));
+        return std::make_pair(iterator(this, ret.first), ret.second);
+    }
+
+    mapped_type& operator[](const key_type& key)
+    {
+        return emplace(key).first->second;
+    }
+
+    /** Erase an element. Iterators to other elements remain valid. */
+    void erase(const_iterator it)
+    {
+        erase_slot(it.pos);
+    }
+
+    size_type erase(const key_type& key)
+    {
+        size_type pos = find_slot(key, hash_function(key));
+        if (pos == (size_type)-1) return 0;
+        erase_slot(pos);
+        return 1;
+    }
+
+    /** Remove all elements and release all memory. */
+    void clear()
+    {
+        for (size_type i = 0; i < table.size(); i++) {
+            if (table[i].node < SLOT_DELETED) {
+                node(table[i].node)->~value_type();
+            }
+        }
+        for (size_type i = 0; i < chunks.size(); i++) {
+            delete[] chunks[i];
+        }
+        std::vector<slot>().swap(table);
+        std::vector<node_type*>().swap(chunks);
+        nSize = 0;
+        nDeleted = 0;
+        nNodesUsed = 0;
+        nFreeHead = SLOT_EMPTY;
+    }
+
+    void swap(flatmap& other)
+    {
+        table.swap(other.table);
+        chunks.swap(other.chunks);
+        std::swap(nSize, other.nSize);
+        std::swap(nDeleted, other.nDeleted);
+        std::swap(nNodesUsed, other.nNodesUsed);
+        std::swap(nFreeHead, other.nFreeHead);
+        std::swap(hash_function, other.hash_function);
+        std::swap(key_eq, other.key_eq);
+    }
+
+    /** Number of slots in the index; also the bound on iteration. */
+    size_type slot_count() const { return table.size(); }
+
+    /** Heap memory layout, for memusage::DynamicUsage. */
+    size_type index_memory() const { return table.capacity() * sizeof(slot); }
+    size_type chunk_count() const { return chunks.size(); }
+    size_type chunk_list_memory() const { return chunks.capacity() * sizeof(node_type*); }
+    static size_type chunk_memory() { return CHUNK_NODES * sizeof(node_type); }
+};
+
+#endif // BITCOIN_FLATMAP_H
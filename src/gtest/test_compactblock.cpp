@@ -0,0 +1,89 @@
+#include <gtest/gtest.h>
+
+#include "clientversion.h"
+#include "primitives/compactblock.h"
+#include "random.h"
+#include "streams.h"
+#include "version.h"
+
+namespace {
+
+OutputDescription RandomOutput() {
+    OutputDescription output;
+    output.cm = GetRandHash();
+    output.ephemeralKey = GetRandHash();
+    GetRandBytes(output.encCiphertext.begin(), output.encCiphertext.size());
+    return output;
+}
+
+}
+
+TEST(CompactBlock, OnlyKeepsSaplingTransactions) {
+    CBlock block;
+    block.hashPrevBlock = GetRandHash();
+    block.nTime = 1540000000;
+
+    CMutableTransaction coinbase;
+    coinbase.vin.resize(1);
+    coinbase.vin[0].prevout.SetNull();
+    block.vtx.push_back(coinbase);
+
+    CMutableTransaction mtx;
+    mtx.fOverwintered = true;
+    mtx.nVersion = SAPLING_TX_VERSION;
+    mtx.nVersionGroupId = SAPLING_VERSION_GROUP_ID;
+    SpendDescription spend;
+    spend.nullifier = GetRandHash();
+    mtx.vShieldedSpend.push_back(spend);
+    mtx.vShieldedOutput.push_back(RandomOutput());
+    mtx.vShieldedOutput.push_back(RandomOutput());
+    block.vtx.push_back(mtx);
+
+    CCompactBlock compact(block, 280000);
+    EXPECT_EQ(compact.nHeight, 280000);
+    EXPECT_EQ(compact.hash, block.GetHash());
+    EXPECT_EQ(compact.hashPrevBlock, block.hashPrevBlock);
+    EXPECT_EQ(compact.nTime, block.nTime);
+
+    ASSERT_EQ(compact.vtx.size(), 1);
+    const CCompactTx& ctx = compact.vtx[0];
+    EXPECT_EQ(ctx.nIndex, 1);
+    EXPECT_EQ(ctx.hash, block.vtx[1].GetHash());
+    ASSERT_EQ(ctx.vSpends.size(), 1);
+    EXPECT_EQ(ctx.vSpends[0].nf, spend.nullifier);
+    ASSERT_EQ(ctx.vOutputs.size(), 2);
+    for (size_t i = 0; i < ctx.vOutputs.size(); i++) {
+        const OutputDescription& output = block.vtx[1].vShieldedOutput[i];
+        EXPECT_EQ(ctx.vOutputs[i].cm, output.cm);
+        EXPECT_EQ(ctx.vOutputs[i].epk, output.ephemeralKey);
+        EXPECT_TRUE(std::equal(ctx.vOutputs[i].ciphertext.begin(),
+                               ctx.vOutputs[i].ciphertext.end(),
+                               output.encCiphertext.begin()));
+    }
+}
+
+TEST(CompactBlock, SerializationRoundTrip) {
+    CBlock block;
+    CMutableTransaction mtx;
+    mtx.fOverwintered = true;
+    mtx.nVersion = SAPLING_TX_VERSION;
+    mtx.nVersionGroupId = SAPLING_VERSION_GROUP_ID;
+    mtx.vShieldedOutput.push_back(RandomOutput());
+    block.vtx.push_back(mtx);
+
+    CCompactBlock compact(block, 1);
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    ss << compact;
+
+    // 52 bytes of ciphertext instead of the full output description
+    EXPECT_LT(ss.size(), ::GetSerializeSize(block, SER_DISK, CLIENT_VERSION));
+
+    CCompactBlock compact2;
+    ss >> compact2;
+    EXPECT_EQ(compact2.nVersion, compact.nVersion);
+    EXPECT_EQ(compact2.hash, compact.hash);
+    ASSERT_EQ(compact2.vtx.size(), 1);
+    ASSERT_EQ(compact2.vtx[0].vOutputs.size(), 1);
+    EXPECT_EQ(compact2.vtx[0].vOutputs[0].cm, compact.vtx[0].vOutputs[0].cm);
+    EXPECT_EQ(compact2.vtx[0].vOutputs[0].ciphertext, compact.vtx[0].vOutputs[0].ciphertext);
+}
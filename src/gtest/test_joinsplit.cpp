@@ -11,6 +11,7 @@
 #include "version.h"
 #include "serialize.h"
 #include "primitives/transaction.h"
+#include "transaction_builder.h"
 #include "zcash/JoinSplit.hpp"
 #include "zcash/Note.hpp"
 #include "zcash/NoteEncryption.hpp"
@@ -540,6 +541,54 @@ TEST(joinsplit, full_api_test)
     test_full_api(params);
 }
 
+TEST(joinsplit, deferred_proofs)
+{
+    SproutSpendingKey key = SproutSpendingKey::random();
+    SproutPaymentAddress addr = key.address();
+
+    CMutableTransaction mtx;
+    mtx.joinSplitPubKey = random_uint256();
+    JoinSplitProver prover;
+    prover.SetProvingThreads(2);
+
+    // The first JoinSplit creates a note that the second one spends, so the
+    // second can only be constructed once the first one's commitments exist.
+    SproutMerkleTree tree;
+    std::array<JSInput, 2> inputs1 = {JSInput(), JSInput()};
+    std::array<JSOutput, 2> outputs1 = {JSOutput(addr, 10), JSOutput()};
+    std::array<SproutNote, 2> notes1;
+    uint252 phi1;
+    JSDescription js1(true, *params, mtx.joinSplitPubKey, tree.root(), inputs1, outputs1,
+                      10, 0, false, nullptr, &notes1, &phi1);
+    mtx.vjoinsplit.push_back(js1);
+    prover.Add(0, true, inputs1, notes1, phi1);
+
+    tree.append(js1.commitments[0]);
+    auto witness = tree.witness();
+    tree.append(js1.commitments[1]);
+    witness.append(js1.commitments[1]);
+
+    std::array<JSInput, 2> inputs2 = {JSInput(witness, notes1[0], key), JSInput()};
+    std::array<JSOutput, 2> outputs2 = {JSOutput(addr, 9), JSOutput()};
+    std::array<SproutNote, 2> notes2;
+    uint252 phi2;
+    JSDescription js2(true, *params, mtx.joinSplitPubKey, tree.root(), inputs2, outputs2,
+                      0, 1, false, nullptr, &notes2, &phi2);
+    mtx.vjoinsplit.push_back(js2);
+    prover.Add(1, true, inputs2, notes2, phi2);
+
+    // Nothing has been proven yet
+    auto verifier = libzcash::ProofVerifier::Strict();
+    ASSERT_FALSE(mtx.vjoinsplit[0].Verify(*params, verifier, mtx.joinSplitPubKey));
+    ASSERT_FALSE(mtx.vjoinsplit[1].Verify(*params, verifier, mtx.joinSplitPubKey));
+
+    ASSERT_TRUE(prover.Prove(mtx, *params));
+    EXPECT_TRUE(mtx.vjoinsplit[0].Verify(*params, verifier, mtx.joinSplitPubKey));
+    EXPECT_TRUE(mtx.vjoinsplit[1].Verify(*params, verifier, mtx.joinSplitPubKey));
+    EXPECT_EQ(mtx.vjoinsplit[0].commitments, js1.commitments);
+    EXPECT_EQ(mtx.vjoinsplit[1].commitments, js2.commitments);
+}
+
 TEST(joinsplit, note_plaintexts)
 {
     uint252 a_sk = uint252(uint256S("f6da8716682d600f74fc16bd0187faad6a26b4aa4c24d5c055b216d94516840e"));
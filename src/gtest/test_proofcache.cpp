@@ -0,0 +1,27 @@
+#include <gtest/gtest.h>
+
+#include "proofcache.h"
+#include "random.h"
+
+TEST(ProofCache, SetAndGet) {
+    uint256 txid = GetRandHash();
+    uint32_t branchId = 0x76b809bb;
+
+    EXPECT_FALSE(GetCachedShieldedValidity(txid, branchId, false));
+    SetCachedShieldedValidity(txid, branchId);
+    EXPECT_TRUE(GetCachedShieldedValidity(txid, branchId, false));
+    EXPECT_TRUE(GetCachedShieldedValidity(txid, branchId, false));
+
+    // Erasing on lookup removes the entry
+    EXPECT_TRUE(GetCachedShieldedValidity(txid, branchId, true));
+    EXPECT_FALSE(GetCachedShieldedValidity(txid, branchId, false));
+}
+
+TEST(ProofCache, EntriesAreBoundToBranchId) {
+    uint256 txid = GetRandHash();
+
+    SetCachedShieldedValidity(txid, 0x5ba81b19);
+    EXPECT_TRUE(GetCachedShieldedValidity(txid, 0x5ba81b19, false));
+    EXPECT_FALSE(GetCachedShieldedValidity(txid, 0x76b809bb, false));
+    EXPECT_FALSE(GetCachedShieldedValidity(GetRandHash(), 0x5ba81b19, false));
+}
@@ -10,6 +10,7 @@
 #include "addrman.h"
 #include "alert.h"
 #include "arith_uint256.h"
+#include "blockencodings.h"
 #include "chainparams.h"
 #include "checkpoints.h"
 #include "checkqueue.h"
@@ -21,6 +22,9 @@
 #include "metrics.h"
 #include "net.h"
 #include "pow.h"
+#include "primitives/compactblock.h"
+#include "proofcache.h"
+#include "scheduler.h"
 #include "txdb.h"
 #include "txmempool.h"
 #include "ui_interface.h"
@@ -67,6 +71,7 @@ bool fExperimentalMode = false;
 bool fImporting = false;
 bool fReindex = false;
 bool fTxIndex = false;
+bool fCompactBlockIndex = DEFAULT_COMPACTBLOCKINDEX;
 bool fHavePruned = false;
 bool fPruneMode = false;
 bool fIsBareMultisigStd = true;
@@ -200,6 +205,7 @@ namespace {
         int64_t nTime;  //! Time of "getdata" request in microseconds.
         bool fValidatedHeaders;  //! Whether this block has validated headers at the time of request.
         int64_t nTimeDisconnect; //! The timeout for this block request (for disconnecting a slow peer)
+        std::unique_ptr<PartiallyDownloadedBlock> partialBlock;  //! Optional, used for compact block reconstruction.
     };
     map<uint256, pair<NodeId, list<QueuedBlock>::iterator> > mapBlocksInFlight;
 
@@ -214,6 +220,59 @@ namespace {
 
     /** Dirty block file entries. */
     set<int> setDirtyFileInfo;
+
+    /** Peers we asked to announce new blocks with unsolicited cmpctblock messages, oldest first. Protected by cs_main. */
+    list<NodeId> lNodesAnnouncingHeaderAndIDs;
+
+    /** Our current tip in compact form, shared by all peers we announce to with cmpctblock. Protected by cs_main. */
+    std::shared_ptr<const CBlockHeaderAndShortTxIDs> pcmpctblockTip;
+
+    /** Serialized blocks recently sent to peers, most recently used first, and their total size.
+     *  Protected by cs_main. */
+    typedef std::shared_ptr<const std::vector<unsigned char> > RawBlockRef;
+    list<pair<uint256, RawBlockRef> > lRawBlockCache;
+    map<uint256, list<pair<uint256, RawBlockRef> >::iterator> mapRawBlockCache;
+    size_t nRawBlockCacheSize = 0;
+
+    /**
+     * A "tx" or "block" message being checksummed, deserialized and checked
+     * without context on a message precheck thread, while the message
+     * handler serves other peers. It works on its own copy of the payload.
+     *
+     * A valid transaction's shielded data goes in the proof cache, and a
+     * valid block has fChecked set. A transaction that fails keeps its
+     * validation state, and the "tx" handler rejects it from that instead of
+     * verifying it again. Otherwise, if anything fails the message is
+     * processed from its original bytes as usual, so the same errors,
+     * rejects and DoS scores apply.
+     */
+    struct CMessagePrecheck {
+        std::string strCommand;
+        unsigned int nChecksum;
+        CDataStream vRecv;
+
+        CTransaction tx;
+        CBlock block;
+        bool fValid; //! Checksum matched and the payload deserialized; tx or block is set.
+        CValidationState state; //! Why tx failed its checks, for a block at nHeight.
+        int nHeight;
+        std::atomic<bool> fDone;
+
+        CMessagePrecheck(const CNetMessage& msg) :
+            strCommand(msg.hdr.GetCommand()), nChecksum(msg.hdr.nChecksum),
+            vRecv(msg.vRecv.begin(), msg.vRecv.begin() + msg.hdr.nMessageSize, msg.vRecv.GetType(), msg.vRecv.GetVersion()),
+            fValid(false), nHeight(0), fDone(false) {}
+
+        void operator()();
+    };
+
+    /** Services the message precheck threads. */
+    CScheduler messageprecheckqueue;
+    std::atomic<int> nMessagePrecheckThreads(0);
+
+    /** The precheck of each peer's next message, if it is a "tx" or "block". */
+    CCriticalSection cs_mapMessagePrecheck;
+    map<NodeId, std::shared_ptr<CMessagePrecheck> > mapMessagePrecheck;
 } // anon namespace
 
 //////////////////////////////////////////////////////////////////////////////
@@ -254,6 +313,10 @@ struct CNodeState {
     uint256 hashLastUnknownBlock;
     //! The last full block we both have.
     CBlockIndex *pindexLastCommonBlock;
+    //! The best header we have sent our peer.
+    CBlockIndex *pindexBestHeaderSent;
+    //! Length of current-streak of unconnecting headers announcements
+    int nUnconnectingHeaders;
     //! Whether we've started headers synchronization with this peer.
     bool fSyncStarted;
     //! Since when we're stalling block download progress (in microseconds), or 0.
@@ -263,6 +326,12 @@ struct CNodeState {
     int nBlocksInFlightValidHeaders;
     //! Whether we consider this a preferred download peer.
     bool fPreferredDownload;
+    //! Whether this peer wants invs or headers (when possible) for block announcements.
+    bool fPreferHeaders;
+    //! Whether this peer wants new blocks announced to it as cmpctblock messages (BIP 152 high-bandwidth mode).
+    bool fPreferHeaderAndIDs;
+    //! Whether this peer will send us cmpctblocks if we request them.
+    bool fProvidesHeaderAndIDs;
 
     CNodeState() {
         fCurrentlyConnected = false;
@@ -271,11 +340,16 @@ struct CNodeState {
         pindexBestKnownBlock = NULL;
         hashLastUnknownBlock.SetNull();
         pindexLastCommonBlock = NULL;
+        pindexBestHeaderSent = NULL;
+        nUnconnectingHeaders = 0;
         fSyncStarted = false;
         nStallingSince = 0;
         nBlocksInFlight = 0;
         nBlocksInFlightValidHeaders = 0;
         fPreferredDownload = false;
+        fPreferHeaders = false;
+        fPreferHeaderAndIDs = false;
+        fProvidesHeaderAndIDs = false;
     }
 };
 
@@ -312,6 +386,14 @@ int64_t GetBlockTimeout(int64_t nTime, int nValidatedQueuedBefore, const Consens
     return nTime + 500000 * consensusParams.nPowTargetSpacing * (4 + nValidatedQueuedBefore);
 }
 
+// Requires cs_main.
+// Whether our tip is recent enough that a newly announced block is probably
+// its direct successor, and worth fetching without waiting for headers.
+bool CanDirectFetch(const Consensus::Params &consensusParams)
+{
+    return chainActive.Tip()->GetBlockTime() > GetAdjustedTime() - consensusParams.nPowTargetSpacing * 20;
+}
+
 void InitializeNode(NodeId nodeid, const CNode *pnode) {
     LOCK(cs_main);
     CNodeState &state = mapNodeState.insert(std::make_pair(nodeid, CNodeState())).first->second;
@@ -332,7 +414,12 @@ void FinalizeNode(NodeId nodeid) {
 
     BOOST_FOREACH(const QueuedBlock& entry, state->vBlocksInFlight)
         mapBlocksInFlight.erase(entry.hash);
+    lNodesAnnouncingHeaderAndIDs.remove(nodeid);
     EraseOrphansFor(nodeid);
+    {
+        LOCK(cs_mapMessagePrecheck);
+        mapMessagePrecheck.erase(nodeid);
+    }
     nPreferredDownload -= state->fPreferredDownload;
 
     mapNodeState.erase(nodeid);
@@ -356,20 +443,100 @@ bool MarkBlockAsReceived(const uint256& hash) {
 }
 
 // Requires cs_main.
-void MarkBlockAsInFlight(NodeId nodeid, const uint256& hash, const Consensus::Params& consensusParams, CBlockIndex *pindex = NULL) {
+// Returns false, still setting pit, if the block was already in flight from the same peer.
+// pit will only be valid as long as the same cs_main lock is being held.
+bool MarkBlockAsInFlight(NodeId nodeid, const uint256& hash, const Consensus::Params& consensusParams, CBlockIndex *pindex = NULL, list<QueuedBlock>::iterator **pit = NULL) {
     CNodeState *state = State(nodeid);
     assert(state != NULL);
 
+    // Short-circuit most stuff in case it's from the same node.
+    map<uint256, pair<NodeId, list<QueuedBlock>::iterator> >::iterator itInFlight = mapBlocksInFlight.find(hash);
+    if (itInFlight != mapBlocksInFlight.end() && itInFlight->second.first == nodeid) {
+        if (pit)
+            *pit = &itInFlight->second.second;
+        return false;
+    }
+
     // Make sure it's not listed somewhere already.
     MarkBlockAsReceived(hash);
 
     int64_t nNow = GetTimeMicros();
-    QueuedBlock newentry = {hash, pindex, nNow, pindex != NULL, GetBlockTimeout(nNow, nQueuedValidatedHeaders, consensusParams)};
+    QueuedBlock newentry = {hash, pindex, nNow, pindex != NULL, GetBlockTimeout(nNow, nQueuedValidatedHeaders, consensusParams),
+                            std::unique_ptr<PartiallyDownloadedBlock>(pit ? new PartiallyDownloadedBlock(&mempool) : NULL)};
     nQueuedValidatedHeaders += newentry.fValidatedHeaders;
-    list<QueuedBlock>::iterator it = state->vBlocksInFlight.insert(state->vBlocksInFlight.end(), newentry);
     state->nBlocksInFlight++;
     state->nBlocksInFlightValidHeaders += newentry.fValidatedHeaders;
-    mapBlocksInFlight[hash] = std::make_pair(nodeid, it);
+    list<QueuedBlock>::iterator it = state->vBlocksInFlight.insert(state->vBlocksInFlight.end(), std::move(newentry));
+    itInFlight = mapBlocksInFlight.insert(std::make_pair(hash, std::make_pair(nodeid, it))).first;
+    if (pit)
+        *pit = &itInFlight->second.second;
+    return true;
+}
+
+// Requires cs_main.
+// Asks a peer that just gave us a new block first to announce future blocks
+// with unsolicited cmpctblock messages, keeping at most MAX_HB_CMPCTBLOCK_PEERS
+// such peers as BIP 152 recommends.
+void MaybeSetPeerAsAnnouncingHeaderAndIDs(const CNodeState* nodestate, CNode* pfrom) {
+    if (!nodestate->fProvidesHeaderAndIDs)
+        return;
+    BOOST_FOREACH(const NodeId nodeid, lNodesAnnouncingHeaderAndIDs)
+        if (nodeid == pfrom->GetId())
+            return;
+    bool fAnnounceUsingCMPCTBLOCK = false;
+    uint64_t nCMPCTBLOCKVersion = 1;
+    if (lNodesAnnouncingHeaderAndIDs.size() >= MAX_HB_CMPCTBLOCK_PEERS) {
+        NodeId nodeStop = lNodesAnnouncingHeaderAndIDs.front();
+        lNodesAnnouncingHeaderAndIDs.pop_front();
+        LOCK(cs_vNodes);
+        BOOST_FOREACH(CNode* pnode, vNodes) {
+            if (pnode->GetId() == nodeStop) {
+                pnode->PushMessage("sendcmpct", fAnnounceUsingCMPCTBLOCK, nCMPCTBLOCKVersion);
+                break;
+            }
+        }
+    }
+    fAnnounceUsingCMPCTBLOCK = true;
+    pfrom->PushMessage("sendcmpct", fAnnounceUsingCMPCTBLOCK, nCMPCTBLOCKVersion);
+    lNodesAnnouncingHeaderAndIDs.push_back(pfrom->GetId());
+}
+
+// Requires cs_main.
+// Returns our current tip as a compact block, building it at most once per tip.
+std::shared_ptr<const CBlockHeaderAndShortTxIDs> GetCompactTip() {
+    CBlockIndex* pindex = chainActive.Tip();
+    if (!pcmpctblockTip || pcmpctblockTip->header.GetHash() != pindex->GetBlockHash()) {
+        CBlock block;
+        if (!ReadBlockFromDisk(block, pindex))
+            return NULL;
+        pcmpctblockTip = std::make_shared<const CBlockHeaderAndShortTxIDs>(block);
+    }
+    return pcmpctblockTip;
+}
+
+// Requires cs_main.
+// Returns a block's serialized bytes, from the raw block cache if it was sent recently.
+RawBlockRef GetRawBlock(const CBlockIndex* pindex) {
+    const uint256& hash = pindex->GetBlockHash();
+    map<uint256, list<pair<uint256, RawBlockRef> >::iterator>::iterator it = mapRawBlockCache.find(hash);
+    if (it != mapRawBlockCache.end()) {
+        lRawBlockCache.splice(lRawBlockCache.begin(), lRawBlockCache, it->second);
+        return it->second->second;
+    }
+
+    std::shared_ptr<std::vector<unsigned char> > pblock = std::make_shared<std::vector<unsigned char> >();
+    if (!ReadRawBlockFromDisk(*pblock, pindex, Params().MessageStart()))
+        return NULL;
+
+    lRawBlockCache.push_front(make_pair(hash, pblock));
+    mapRawBlockCache[hash] = lRawBlockCache.begin();
+    nRawBlockCacheSize += pblock->size();
+    while (nRawBlockCacheSize > MAX_RAW_BLOCK_CACHE_SIZE && lRawBlockCache.size() > 1) {
+        nRawBlockCacheSize -= lRawBlockCache.back().second->size();
+        mapRawBlockCache.erase(lRawBlockCache.back().first);
+        lRawBlockCache.pop_back();
+    }
+    return pblock;
 }
 
 /** Check whether the last unknown block a peer advertized is not yet known. */
@@ -405,6 +572,18 @@ void UpdateBlockAvailability(NodeId nodeid, const uint256 &hash) {
     }
 }
 
+// Requires cs_main.
+// Whether the peer is known to have the header of pindex, because it told us
+// about it or a descendant, or because we sent it.
+bool PeerHasHeader(CNodeState *state, CBlockIndex *pindex)
+{
+    if (state->pindexBestKnownBlock && pindex == state->pindexBestKnownBlock->GetAncestor(pindex->nHeight))
+        return true;
+    if (state->pindexBestHeaderSent && pindex == state->pindexBestHeaderSent->GetAncestor(pindex->nHeight))
+        return true;
+    return false;
+}
+
 /** Find the last common ancestor two blocks have.
  *  Both pa and pb must be non-NULL. */
 CBlockIndex* LastCommonAncestor(CBlockIndex* pa, CBlockIndex* pb) {
@@ -562,6 +741,7 @@ CBlockIndex* FindForkInGlobalIndex(const CChain& chain, const CBlockLocator& loc
 }
 
 CCoinsViewCache *pcoinsTip = NULL;
+CCoinsViewBackgroundWriter *pcoinswriter = NULL;
 CBlockTreeDB *pblocktree = NULL;
 
 //////////////////////////////////////////////////////////////////////////////
@@ -875,6 +1055,81 @@ unsigned int GetP2SHSigOpCount(const CTransaction& tx, const CCoinsViewCache& in
     return nSigOps;
 }
 
+/** Verify the Ed25519 joinSplitSig of a transaction over dataToBeSigned. */
+static bool CheckJoinSplitSig(const CTransaction& tx, const uint256& dataToBeSigned)
+{
+    BOOST_STATIC_ASSERT(crypto_sign_PUBLICKEYBYTES == 32);
+
+    // We rely on libsodium to check that the signature is canonical.
+    // https://github.com/jedisct1/libsodium/commit/62911edb7ff2275cccd74bf1c8aefcc4d76924e0
+    return crypto_sign_verify_detached(&tx.joinSplitSig[0],
+                                       dataToBeSigned.begin(), 32,
+                                       tx.joinSplitPubKey.begin()
+                                       ) == 0;
+}
+
+/**
+ * Verify the Sapling spend and output proofs of a transaction, together with
+ * the spendAuth signatures and the binding signature over dataToBeSigned.
+ * On failure, strRejectReason and strError describe the first invalid component.
+ */
+static bool CheckSaplingComponents(const CTransaction& tx, const uint256& dataToBeSigned,
+                                   std::string& strRejectReason, std::string& strError)
+{
+    auto ctx = librustzcash_sapling_verification_ctx_init();
+
+    for (const SpendDescription &spend : tx.vShieldedSpend) {
+        if (!librustzcash_sapling_check_spend(
+            ctx,
+            spend.cv.begin(),
+            spend.anchor.begin(),
+            spend.nullifier.begin(),
+            spend.rk.begin(),
+            spend.zkproof.begin(),
+            spend.spendAuthSig.begin(),
+            dataToBeSigned.begin()
+        ))
+        {
+            librustzcash_sapling_verification_ctx_free(ctx);
+            strRejectReason = "bad-txns-sapling-spend-description-invalid";
+            strError = "Sapling spend description invalid";
+            return false;
+        }
+    }
+
+    for (const OutputDescription &output : tx.vShieldedOutput) {
+        if (!librustzcash_sapling_check_output(
+            ctx,
+            output.cv.begin(),
+            output.cm.begin(),
+            output.ephemeralKey.begin(),
+            output.zkproof.begin()
+        ))
+        {
+            librustzcash_sapling_verification_ctx_free(ctx);
+            strRejectReason = "bad-txns-sapling-output-description-invalid";
+            strError = "Sapling output description invalid";
+            return false;
+        }
+    }
+
+    if (!librustzcash_sapling_final_check(
+        ctx,
+        tx.valueBalance,
+        tx.bindingSig.begin(),
+        dataToBeSigned.begin()
+    ))
+    {
+        librustzcash_sapling_verification_ctx_free(ctx);
+        strRejectReason = "bad-txns-sapling-binding-signature-invalid";
+        strError = "Sapling binding signature invalid";
+        return false;
+    }
+
+    librustzcash_sapling_verification_ctx_free(ctx);
+    return true;
+}
+
 /**
  * Check a transaction contextually against a set of consensus rules valid at a given block height.
  * 
@@ -889,7 +1144,8 @@ bool ContextualCheckTransaction(
         CValidationState &state,
         const int nHeight,
         const int dosLevel,
-        bool (*isInitBlockDownload)())
+        bool (*isInitBlockDownload)(),
+        std::vector<CShieldedCheck> *pvChecks)
 {
     bool overwinterActive = NetworkUpgradeActive(nHeight, Params().GetConsensus(), Consensus::UPGRADE_OVERWINTER);
     bool saplingActive = NetworkUpgradeActive(nHeight, Params().GetConsensus(), Consensus::UPGRADE_SAPLING);
@@ -980,6 +1236,11 @@ bool ContextualCheckTransaction(
         !tx.vShieldedOutput.empty())
     {
         auto consensusBranchId = CurrentEpochBranchId(nHeight, Params().GetConsensus());
+        // Signatures and proofs already verified on mempool acceptance
+        // don't need to be checked again.
+        if (GetCachedShieldedValidity(tx.GetHash(), consensusBranchId, false)) {
+            return true;
+        }
         // Empty output script.
         CScript scriptCode;
         try {
@@ -992,14 +1253,10 @@ bool ContextualCheckTransaction(
 
     if (!tx.vjoinsplit.empty())
     {
-        BOOST_STATIC_ASSERT(crypto_sign_PUBLICKEYBYTES == 32);
-
-        // We rely on libsodium to check that the signature is canonical.
-        // https://github.com/jedisct1/libsodium/commit/62911edb7ff2275cccd74bf1c8aefcc4d76924e0
-        if (crypto_sign_verify_detached(&tx.joinSplitSig[0],
-                                        dataToBeSigned.begin(), 32,
-                                        tx.joinSplitPubKey.begin()
-                                        ) != 0) {
+        if (pvChecks) {
+            pvChecks->push_back(CShieldedCheck());
+            CShieldedCheck(tx, dataToBeSigned, CShieldedCheck::JOINSPLIT_SIG).swap(pvChecks->back());
+        } else if (!CheckJoinSplitSig(tx, dataToBeSigned)) {
             return state.DoS(isInitBlockDownload() ? 0 : 100,
                                 error("CheckTransaction(): invalid joinsplit signature"),
                                 REJECT_INVALID, "bad-txns-invalid-joinsplit-signature");
@@ -1009,54 +1266,16 @@ bool ContextualCheckTransaction(
     if (!tx.vShieldedSpend.empty() ||
         !tx.vShieldedOutput.empty())
     {
-        auto ctx = librustzcash_sapling_verification_ctx_init();
-
-        for (const SpendDescription &spend : tx.vShieldedSpend) {
-            if (!librustzcash_sapling_check_spend(
-                ctx,
-                spend.cv.begin(),
-                spend.anchor.begin(),
-                spend.nullifier.begin(),
-                spend.rk.begin(),
-                spend.zkproof.begin(),
-                spend.spendAuthSig.begin(),
-                dataToBeSigned.begin()
-            ))
-            {
-                librustzcash_sapling_verification_ctx_free(ctx);
-                return state.DoS(100, error("ContextualCheckTransaction(): Sapling spend description invalid"),
-                                      REJECT_INVALID, "bad-txns-sapling-spend-description-invalid");
-            }
-        }
-
-        for (const OutputDescription &output : tx.vShieldedOutput) {
-            if (!librustzcash_sapling_check_output(
-                ctx,
-                output.cv.begin(),
-                output.cm.begin(),
-                output.ephemeralKey.begin(),
-                output.zkproof.begin()
-            ))
-            {
-                librustzcash_sapling_verification_ctx_free(ctx);
-                return state.DoS(100, error("ContextualCheckTransaction(): Sapling output description invalid"),
-                                      REJECT_INVALID, "bad-txns-sapling-output-description-invalid");
+        if (pvChecks) {
+            pvChecks->push_back(CShieldedCheck());
+            CShieldedCheck(tx, dataToBeSigned, CShieldedCheck::SAPLING).swap(pvChecks->back());
+        } else {
+            std::string strRejectReason, strError;
+            if (!CheckSaplingComponents(tx, dataToBeSigned, strRejectReason, strError)) {
+                return state.DoS(100, error("ContextualCheckTransaction(): %s", strError),
+                                      REJECT_INVALID, strRejectReason);
             }
         }
-
-        if (!librustzcash_sapling_final_check(
-            ctx,
-            tx.valueBalance,
-            tx.bindingSig.begin(),
-            dataToBeSigned.begin()
-        ))
-        {
-            librustzcash_sapling_verification_ctx_free(ctx);
-            return state.DoS(100, error("ContextualCheckTransaction(): Sapling binding signature invalid"),
-                                  REJECT_INVALID, "bad-txns-sapling-binding-signature-invalid");
-        }
-
-        librustzcash_sapling_verification_ctx_free(ctx);
     }
     return true;
 }
@@ -1074,14 +1293,28 @@ bool CheckTransaction(const CTransaction& tx, CValidationState &state,
         return false;
     } else {
         // Ensure that zk-SNARKs verify
-        BOOST_FOREACH(const JSDescription &joinsplit, tx.vjoinsplit) {
-            if (!joinsplit.Verify(*pzcashParams, verifier, tx.joinSplitPubKey)) {
-                return state.DoS(100, error("CheckTransaction(): joinsplit does not verify"),
-                                    REJECT_INVALID, "bad-txns-joinsplit-verification-failed");
-            }
+        return CheckJoinSplitProofs(tx, state, verifier);
+    }
+}
+
+bool CheckJoinSplitProofs(const CTransaction& tx, CValidationState &state,
+                          libzcash::ProofVerifier& verifier,
+                          std::vector<CShieldedCheck> *pvChecks)
+{
+    if (pvChecks) {
+        for (unsigned int i = 0; i < tx.vjoinsplit.size(); i++) {
+            pvChecks->push_back(CShieldedCheck());
+            CShieldedCheck(tx, i, verifier).swap(pvChecks->back());
         }
         return true;
     }
+    BOOST_FOREACH(const JSDescription &joinsplit, tx.vjoinsplit) {
+        if (!joinsplit.Verify(*pzcashParams, verifier, tx.joinSplitPubKey)) {
+            return state.DoS(100, error("CheckTransaction(): joinsplit does not verify"),
+                                REJECT_INVALID, "bad-txns-joinsplit-verification-failed");
+        }
+    }
+    return true;
 }
 
 bool CheckTransactionWithoutProofVerification(const CTransaction& tx, CValidationState &state)
@@ -1348,8 +1581,22 @@ CAmount GetMinRelayFee(const CTransaction& tx, unsigned int nBytes, bool fAllowF
 }
 
 
-bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransaction &tx, bool fLimitFree,
-                        bool* pfMissingInputs, bool fRejectAbsurdFee)
+/**
+ * Evict the lowest fee-rate packages until the mempool fits in -maxmempool,
+ * and tell listeners about every transaction that was evicted.
+ */
+static void LimitMempoolSize(CTxMemPool& pool, size_t limit)
+{
+    std::list<CTransaction> evicted;
+    pool.TrimToSize(limit, evicted);
+    BOOST_FOREACH(const CTransaction& tx, evicted) {
+        GetMainSignals().TransactionEvictedFromMempool(tx);
+    }
+}
+
+static bool AcceptToMemoryPoolWorker(CTxMemPool& pool, CValidationState &state, const CTransaction &tx, bool fLimitFree,
+                                     bool* pfMissingInputs, bool fRejectAbsurdFee, bool fOverrideMempoolLimit,
+                                     std::vector<COutPoint>& vCoinsToUncache)
 {
     AssertLockHeld(cs_main);
     if (pfMissingInputs)
@@ -1372,7 +1619,10 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransa
         }
     }
 
-    auto verifier = libzcash::ProofVerifier::Strict();
+    // JoinSplit proofs already verified by the message precheck threads
+    // don't need to be checked again.
+    auto verifier = GetCachedShieldedValidity(tx.GetHash(), consensusBranchId, false) ?
+        libzcash::ProofVerifier::Disabled() : libzcash::ProofVerifier::Strict();
     if (!CheckTransaction(tx, state, verifier))
         return error("AcceptToMemoryPool: CheckTransaction failed");
 
@@ -1382,6 +1632,12 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransa
         return error("AcceptToMemoryPool: ContextualCheckTransaction failed");
     }
 
+    // All shielded proofs and signatures are now known to be valid; remember
+    // that so block validation doesn't need to verify them again.
+    if (!tx.vjoinsplit.empty() || !tx.vShieldedSpend.empty() || !tx.vShieldedOutput.empty()) {
+        SetCachedShieldedValidity(tx.GetHash(), CurrentEpochBranchId(nextBlockHeight, Params().GetConsensus()));
+    }
+
     // DoS mitigation: reject transactions expiring soon
     // Note that if a valid transaction belonging to the wallet is in the mempool and the node is shutdown,
     // upon restart, CWalletTx::AcceptToMemoryPool() will be invoked which might result in rejection.
@@ -1448,15 +1704,22 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransa
         CCoinsViewMemPool viewMemPool(pcoinsTip, pool);
         view.SetBackend(viewMemPool);
 
-        // do we already have it?
-        if (view.HaveCoins(hash))
-            return false;
-
         // do all inputs exist?
-        // Note that this does not check for the presence of actual outputs (see the next check for that),
-        // and only helps with filling in pfMissingInputs (to determine missing vs spent).
+        // Spent and missing outputs can no longer be told apart, so an input
+        // spent in the chain is also reported through pfMissingInputs.
         BOOST_FOREACH(const CTxIn txin, tx.vin) {
-            if (!view.HaveCoins(txin.prevout.hash)) {
+            if (!pcoinsTip->HaveCoinInCache(txin.prevout)) {
+                vCoinsToUncache.push_back(txin.prevout);
+            }
+            if (!view.HaveCoin(txin.prevout)) {
+                // Are inputs missing because we already have the tx? Only
+                // outputs already in the cache are checked, as looking each
+                // of them up in the database would cost a read per output.
+                for (size_t out = 0; out < tx.vout.size(); out++) {
+                    if (pcoinsTip->HaveCoinInCache(COutPoint(hash, out)))
+                        return false;
+                }
+                // Otherwise this might be an orphan whose parents we haven't seen yet
                 if (pfMissingInputs)
                     *pfMissingInputs = true;
                 return false;
@@ -1507,8 +1770,8 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransa
         // during reorgs to ensure COINBASE_MATURITY is still met.
         bool fSpendsCoinbase = false;
         BOOST_FOREACH(const CTxIn &txin, tx.vin) {
-            const CCoins *coins = view.AccessCoins(txin.prevout.hash);
-            if (coins->IsCoinBase()) {
+            const Coin &coin = view.AccessCoin(txin.prevout);
+            if (coin.IsCoinBase()) {
                 fSpendsCoinbase = true;
                 break;
             }
@@ -1534,6 +1797,18 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransa
                                 REJECT_INSUFFICIENTFEE, "insufficient fee");
         }
 
+        // Once the mempool has been trimmed, don't accept anything paying
+        // less than the packages that were evicted to make room.
+        CAmount nModifiedFees = nFees;
+        double dPriorityDeltaDummy = 0;
+        pool.ApplyDeltas(hash, dPriorityDeltaDummy, nModifiedFees);
+        CAmount mempoolRejectFee = pool.GetMinFee(GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000).GetFee(nSize);
+        if (mempoolRejectFee > 0 && nModifiedFees < mempoolRejectFee) {
+            return state.DoS(0, error("AcceptToMemoryPool: mempool min fee not met %s, %d < %d",
+                                      hash.ToString(), nModifiedFees, mempoolRejectFee),
+                             REJECT_INSUFFICIENTFEE, "mempool min fee not met");
+        }
+
         // Require that free transactions have sufficient priority to be mined in the next block.
         if (GetBoolArg("-relaypriority", false) && nFees < ::minRelayTxFee.GetFee(nSize) && !AllowFree(view.GetPriority(tx, chainActive.Height() + 1))) {
             return state.DoS(0, false, REJECT_INSUFFICIENTFEE, "insufficient priority");
@@ -1571,6 +1846,18 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransa
             return state.Error("AcceptToMemoryPool: " + errmsg);
         }
 
+        // Calculate in-mempool ancestors, up to a limit.
+        CTxMemPool::setEntries setAncestors;
+        size_t nLimitAncestors = GetArg("-limitancestorcount", DEFAULT_ANCESTOR_LIMIT);
+        size_t nLimitAncestorSize = GetArg("-limitancestorsize", DEFAULT_ANCESTOR_SIZE_LIMIT)*1000;
+        size_t nLimitDescendants = GetArg("-limitdescendantcount", DEFAULT_DESCENDANT_LIMIT);
+        size_t nLimitDescendantSize = GetArg("-limitdescendantsize", DEFAULT_DESCENDANT_SIZE_LIMIT)*1000;
+        std::string errString;
+        if (!pool.CalculateMemPoolAncestors(entry, setAncestors, nLimitAncestors, nLimitAncestorSize, nLimitDescendants, nLimitDescendantSize, errString)) {
+            return state.DoS(0, error("AcceptToMemoryPool: too-long-mempool-chain %s: %s", hash.ToString(), errString),
+                             REJECT_NONSTANDARD, "too-long-mempool-chain");
+        }
+
         // Check against previous transactions
         // This is done last to help prevent CPU exhaustion denial-of-service attacks.
         PrecomputedTransactionData txdata(tx);
@@ -1594,7 +1881,14 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransa
         }
 
         // Store transaction in memory
-        pool.addUnchecked(hash, entry, !IsInitialBlockDownload());
+        pool.addUnchecked(hash, entry, setAncestors, !IsInitialBlockDownload());
+
+        // trim mempool and check if tx was trimmed
+        if (!fOverrideMempoolLimit) {
+            LimitMempoolSize(pool, GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000);
+            if (!pool.exists(hash))
+                return state.DoS(0, false, REJECT_INSUFFICIENTFEE, "mempool full");
+        }
     }
 
     SyncWithWallets(tx, NULL);
@@ -1602,6 +1896,19 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransa
     return true;
 }
 
+bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransaction &tx, bool fLimitFree,
+                        bool* pfMissingInputs, bool fRejectAbsurdFee, bool fOverrideMempoolLimit)
+{
+    std::vector<COutPoint> vCoinsToUncache;
+    bool res = AcceptToMemoryPoolWorker(pool, state, tx, fLimitFree, pfMissingInputs, fRejectAbsurdFee, fOverrideMempoolLimit, vCoinsToUncache);
+    if (!res) {
+        // Don't let rejected transactions fill the coins cache with their inputs
+        BOOST_FOREACH(const COutPoint& outpoint, vCoinsToUncache)
+            pcoinsTip->Uncache(outpoint);
+    }
+    return res;
+}
+
 /** Return transaction in tx, and if it was found inside a block, its hash is placed in hashBlock */
 bool GetTransaction(const uint256 &hash, CTransaction &txOut, uint256 &hashBlock, bool fAllowSlow)
 {
@@ -1636,15 +1943,9 @@ bool GetTransaction(const uint256 &hash, CTransaction &txOut, uint256 &hashBlock
     }
 
     if (fAllowSlow) { // use coin database to locate block that contains transaction, and scan it
-        int nHeight = -1;
-        {
-            CCoinsViewCache &view = *pcoinsTip;
-            const CCoins* coins = view.AccessCoins(hash);
-            if (coins)
-                nHeight = coins->nHeight;
-        }
-        if (nHeight > 0)
-            pindexSlow = chainActive[nHeight];
+        const Coin& coin = AccessByTxid(*pcoinsTip, hash);
+        if (!coin.IsSpent())
+            pindexSlow = chainActive[coin.nHeight];
     }
 
     if (pindexSlow) {
@@ -1729,6 +2030,61 @@ bool ReadBlockFromDisk(CBlock& block, const CBlockIndex* pindex)
     return true;
 }
 
+bool ReadRawBlockFromDisk(std::vector<unsigned char>& block, const CBlockIndex* pindex, const CMessageHeader::MessageStartChars& messageStart)
+{
+    CDiskBlockPos pos = pindex->GetBlockPos();
+    // The block is preceded on disk by the network magic and its size
+    if (pos.nPos < MESSAGE_START_SIZE + sizeof(unsigned int))
+        return error("%s: Invalid block position %s", __func__, pos.ToString());
+    CDiskBlockPos posHeader(pos.nFile, pos.nPos - (MESSAGE_START_SIZE + sizeof(unsigned int)));
+
+    CAutoFile filein(OpenBlockFile(posHeader, true), SER_DISK, CLIENT_VERSION);
+    if (filein.IsNull())
+        return error("%s: OpenBlockFile failed for %s", __func__, pos.ToString());
+
+    try {
+        CMessageHeader::MessageStartChars blkStart;
+        unsigned int nSize;
+        filein >> FLATDATA(blkStart) >> nSize;
+        if (memcmp(blkStart, messageStart, MESSAGE_START_SIZE))
+            return error("%s: Block magic mismatch at %s", __func__, pos.ToString());
+        if (nSize > MAX_BLOCK_SIZE)
+            return error("%s: Block size %u too large at %s", __func__, nSize, pos.ToString());
+
+        // Only the header is deserialized, to check that this is the block
+        // the index expects. Its proof of work was checked when the block
+        // was accepted, so unlike ReadBlockFromDisk we don't redo it here.
+        CBlockHeader header;
+        filein >> header;
+        if (header.GetHash() != pindex->GetBlockHash())
+            return error("%s: GetHash() doesn't match index for %s at %s", __func__,
+                    pindex->ToString(), pos.ToString());
+        if (fseek(filein.Get(), pos.nPos, SEEK_SET))
+            return error("%s: fseek failed for %s", __func__, pos.ToString());
+
+        block.resize(nSize);
+        filein.read((char*)begin_ptr(block), nSize);
+    }
+    catch (const std::exception& e) {
+        return error("%s: Read or I/O error - %s at %s", __func__, e.what(), pos.ToString());
+    }
+
+    return true;
+}
+
+bool ReadCompactBlock(CCompactBlock& block, const CBlockIndex* pindex)
+{
+    if (fCompactBlockIndex && pblocktree->ReadCompactBlock(pindex->GetBlockHash(), block))
+        return true;
+
+    // Not indexed (yet); derive the record from the full block.
+    CBlock fullBlock;
+    if (!ReadBlockFromDisk(fullBlock, pindex))
+        return false;
+    block = CCompactBlock(fullBlock, pindex->nHeight);
+    return true;
+}
+
 CAmount GetBlockSubsidy(int nHeight, const Consensus::Params& consensusParams)
 {
     CAmount nSubsidy = 12.5 * COIN;
@@ -1926,20 +2282,10 @@ void UpdateCoins(const CTransaction& tx, CCoinsViewCache& inputs, CTxUndo &txund
     if (!tx.IsCoinBase()) {
         txundo.vprevout.reserve(tx.vin.size());
         BOOST_FOREACH(const CTxIn &txin, tx.vin) {
-            CCoinsModifier coins = inputs.ModifyCoins(txin.prevout.hash);
-            unsigned nPos = txin.prevout.n;
-
-            if (nPos >= coins->vout.size() || coins->vout[nPos].IsNull())
-                assert(false);
             // mark an outpoint spent, and construct undo information
-            txundo.vprevout.push_back(CTxInUndo(coins->vout[nPos]));
-            coins->Spend(nPos);
-            if (coins->vout.size() == 0) {
-                CTxInUndo& undo = txundo.vprevout.back();
-                undo.nHeight = coins->nHeight;
-                undo.fCoinBase = coins->fCoinBase;
-                undo.nVersion = coins->nVersion;
-            }
+            txundo.vprevout.push_back(Coin());
+            bool is_spent = inputs.SpendCoin(txin.prevout, &txundo.vprevout.back());
+            assert(is_spent);
         }
     }
 
@@ -1947,7 +2293,7 @@ void UpdateCoins(const CTransaction& tx, CCoinsViewCache& inputs, CTxUndo &txund
     inputs.SetNullifiers(tx, true);
 
     // add outputs
-    inputs.ModifyNewCoins(tx.GetHash())->FromTx(tx, nHeight);
+    AddCoins(inputs, tx, nHeight);
 }
 
 void UpdateCoins(const CTransaction& tx, CCoinsViewCache& inputs, int nHeight)
@@ -1956,6 +2302,27 @@ void UpdateCoins(const CTransaction& tx, CCoinsViewCache& inputs, int nHeight)
     UpdateCoins(tx, inputs, txundo, nHeight);
 }
 
+bool CShieldedCheck::operator()() {
+    switch (type) {
+    case SPROUT_PROOF:
+        if (!ptx->vjoinsplit[nJoinSplit].Verify(*pzcashParams, *pverifier, ptx->joinSplitPubKey))
+            return ::error("CShieldedCheck(): %s:%d joinsplit does not verify", ptx->GetHash().ToString(), nJoinSplit);
+        return true;
+    case JOINSPLIT_SIG:
+        if (!CheckJoinSplitSig(*ptx, dataToBeSigned))
+            return ::error("CShieldedCheck(): %s invalid joinsplit signature", ptx->GetHash().ToString());
+        return true;
+    case SAPLING: {
+        std::string strRejectReason, strError;
+        if (!CheckSaplingComponents(*ptx, dataToBeSigned, strRejectReason, strError))
+            return ::error("CShieldedCheck(): %s: %s", ptx->GetHash().ToString(), strError);
+        return true;
+    }
+    default:
+        return true;
+    }
+}
+
 bool CScriptCheck::operator()() {
     const CScript &scriptSig = ptxTo->vin[nIn].scriptSig;
     if (!VerifyScript(scriptSig, scriptPubKey, nFlags, CachingTransactionSignatureChecker(ptxTo, nIn, amount, cacheStore, *txdata), consensusBranchId, &error)) {
@@ -1988,14 +2355,14 @@ bool CheckTxInputs(const CTransaction& tx, CValidationState& state, const CCoins
         for (unsigned int i = 0; i < tx.vin.size(); i++)
         {
             const COutPoint &prevout = tx.vin[i].prevout;
-            const CCoins *coins = inputs.AccessCoins(prevout.hash);
-            assert(coins);
+            const Coin& coin = inputs.AccessCoin(prevout);
+            assert(!coin.IsSpent());
 
-            if (coins->IsCoinBase()) {
+            if (coin.IsCoinBase()) {
                 // Ensure that coinbases are matured
-                if (nSpendHeight - coins->nHeight < COINBASE_MATURITY) {
+                if (nSpendHeight - coin.nHeight < COINBASE_MATURITY) {
                     return state.Invalid(
-                        error("CheckInputs(): tried to spend coinbase at depth %d", nSpendHeight - coins->nHeight),
+                        error("CheckInputs(): tried to spend coinbase at depth %d", nSpendHeight - coin.nHeight),
                         REJECT_INVALID, "bad-txns-premature-spend-of-coinbase");
                 }
 
@@ -2011,8 +2378,8 @@ bool CheckTxInputs(const CTransaction& tx, CValidationState& state, const CCoins
             }
 
             // Check for negative or overflow input values
-            nValueIn += coins->vout[prevout.n].nValue;
-            if (!MoneyRange(coins->vout[prevout.n].nValue) || !MoneyRange(nValueIn))
+            nValueIn += coin.out.nValue;
+            if (!MoneyRange(coin.out.nValue) || !MoneyRange(nValueIn))
                 return state.DoS(100, error("CheckInputs(): txin values out of range"),
                                  REJECT_INVALID, "bad-txns-inputvalues-outofrange");
 
@@ -2072,11 +2439,11 @@ bool ContextualCheckInputs(
         if (fScriptChecks) {
             for (unsigned int i = 0; i < tx.vin.size(); i++) {
                 const COutPoint &prevout = tx.vin[i].prevout;
-                const CCoins* coins = inputs.AccessCoins(prevout.hash);
-                assert(coins);
+                const Coin& coin = inputs.AccessCoin(prevout);
+                assert(!coin.IsSpent());
 
                 // Verify signature
-                CScriptCheck check(*coins, tx, i, flags, cacheStore, consensusBranchId, &txdata);
+                CScriptCheck check(coin.out, tx, i, flags, cacheStore, consensusBranchId, &txdata);
                 if (pvChecks) {
                     pvChecks->push_back(CScriptCheck());
                     check.swap(pvChecks->back());
@@ -2088,7 +2455,7 @@ bool ContextualCheckInputs(
                         // arguments; if so, don't trigger DoS protection to
                         // avoid splitting the network between upgraded and
                         // non-upgraded nodes.
-                        CScriptCheck check2(*coins, tx, i,
+                        CScriptCheck check2(coin.out, tx, i,
                                 flags & ~STANDARD_NOT_MANDATORY_VERIFY_FLAGS, cacheStore, consensusBranchId, &txdata);
                         if (check2())
                             return state.Invalid(false, REJECT_NONSTANDARD, strprintf("non-mandatory-script-verify-flag (%s)", ScriptErrorString(check.GetScriptError())));
@@ -2186,34 +2553,30 @@ bool AbortNode(CValidationState& state, const std::string& strMessage, const std
 } // anon namespace
 
 /**
- * Apply the undo operation of a CTxInUndo to the given chain state.
- * @param undo The undo object.
+ * Restore the UTXO in a Coin at a given COutPoint.
+ * @param undo The Coin to be restored.
  * @param view The coins view to which to apply the changes.
  * @param out The out point that corresponds to the tx input.
  * @return True on success.
  */
-static bool ApplyTxInUndo(const CTxInUndo& undo, CCoinsViewCache& view, const COutPoint& out)
+static bool ApplyTxInUndo(Coin&& undo, CCoinsViewCache& view, const COutPoint& out)
 {
     bool fClean = true;
 
-    CCoinsModifier coins = view.ModifyCoins(out.hash);
-    if (undo.nHeight != 0) {
-        // undo data contains height: this is the last output of the prevout tx being spent
-        if (!coins->IsPruned())
-            fClean = fClean && error("%s: undo data overwriting existing transaction", __func__);
-        coins->Clear();
-        coins->fCoinBase = undo.fCoinBase;
-        coins->nHeight = undo.nHeight;
-        coins->nVersion = undo.nVersion;
-    } else {
-        if (coins->IsPruned())
-            fClean = fClean && error("%s: undo data adding output to missing transaction", __func__);
-    }
-    if (coins->IsAvailable(out.n))
+    if (view.HaveCoin(out))
         fClean = fClean && error("%s: undo data overwriting existing output", __func__);
-    if (coins->vout.size() < out.n+1)
-        coins->vout.resize(out.n+1);
-    coins->vout[out.n] = undo.txout;
+
+    if (undo.nHeight == 0) {
+        // Missing undo metadata (height and coinbase). Older versions included this
+        // information only in undo records for the last spend of a transactions'
+        // outputs. This implies that it must be present for some other output of the same tx.
+        const Coin& alternate = AccessByTxid(view, out.hash);
+        if (alternate.IsSpent())
+            return error("%s: undo data adding output to missing transaction", __func__);
+        undo.nHeight = alternate.nHeight;
+        undo.fCoinBase = alternate.fCoinBase;
+    }
+    view.AddCoin(out, std::move(undo), !fClean);
 
     return fClean;
 }
@@ -2244,21 +2607,14 @@ bool DisconnectBlock(CBlock& block, CValidationState& state, CBlockIndex* pindex
 
         // Check that all outputs are available and match the outputs in the block itself
         // exactly.
-        {
-        CCoinsModifier outs = view.ModifyCoins(hash);
-        outs->ClearUnspendable();
-
-        CCoins outsBlock(tx, pindex->nHeight);
-        // The CCoins serialization does not serialize negative numbers.
-        // No network rules currently depend on the version here, so an inconsistency is harmless
-        // but it must be corrected before txout nversion ever influences a network rule.
-        if (outsBlock.nVersion < 0)
-            outs->nVersion = outsBlock.nVersion;
-        if (*outs != outsBlock)
-            fClean = fClean && error("DisconnectBlock(): added transaction mismatch? database corrupted");
-
-        // remove outputs
-        outs->Clear();
+        for (size_t o = 0; o < tx.vout.size(); o++) {
+            if (!tx.vout[o].scriptPubKey.IsUnspendable()) {
+                COutPoint out(hash, o);
+                Coin coin;
+                bool is_spent = view.SpendCoin(out, &coin);
+                if (!is_spent || tx.vout[o] != coin.out || (uint32_t)pindex->nHeight != coin.nHeight || tx.IsCoinBase() != coin.IsCoinBase())
+                    fClean = fClean && error("DisconnectBlock(): added transaction mismatch? database corrupted");
+            }
         }
 
         // unspend nullifiers
@@ -2266,13 +2622,12 @@ bool DisconnectBlock(CBlock& block, CValidationState& state, CBlockIndex* pindex
 
         // restore inputs
         if (i > 0) { // not coinbases
-            const CTxUndo &txundo = blockUndo.vtxundo[i-1];
+            CTxUndo &txundo = blockUndo.vtxundo[i-1];
             if (txundo.vprevout.size() != tx.vin.size())
                 return error("DisconnectBlock(): transaction and undo data inconsistent");
             for (unsigned int j = tx.vin.size(); j-- > 0;) {
                 const COutPoint &out = tx.vin[j].prevout;
-                const CTxInUndo &undo = txundo.vprevout[j];
-                if (!ApplyTxInUndo(undo, view, out))
+                if (!ApplyTxInUndo(std::move(txundo.vprevout[j]), view, out))
                     fClean = false;
             }
         }
@@ -2335,6 +2690,183 @@ void ThreadScriptCheck() {
     scriptcheckqueue.Thread();
 }
 
+static CCheckQueue<CShieldedCheck> shieldedcheckqueue(8);
+
+void ThreadShieldedCheck() {
+    RenameThread("zcash-proofchk");
+    shieldedcheckqueue.Thread();
+}
+
+static CCheckQueue<CCoinsPrefetch> prefetchqueue(128);
+
+void ThreadCoinsPrefetch() {
+    RenameThread("zcash-prefetch");
+    prefetchqueue.Thread();
+}
+
+void ThreadMessagePrecheck() {
+    RenameThread("zcash-msgcheck");
+    nMessagePrecheckThreads++;
+    try {
+        messageprecheckqueue.serviceQueue();
+    } catch (...) {
+        nMessagePrecheckThreads--;
+        throw;
+    }
+    nMessagePrecheckThreads--;
+}
+
+bool static AlreadyHave(const CInv& inv) EXCLUSIVE_LOCKS_REQUIRED(cs_main);
+
+void CMessagePrecheck::operator()() {
+    uint256 hash = Hash(vRecv.begin(), vRecv.end());
+    if (ReadLE32((unsigned char*)&hash) == nChecksum) {
+        try {
+            if (strCommand == "tx")
+                vRecv >> tx;
+            else
+                vRecv >> block;
+            fValid = true;
+        } catch (const std::exception&) {
+        }
+    }
+
+    if (fValid && strCommand == "tx") {
+        // Verify the shielded proofs and signatures against the rules of the
+        // next block, exactly as AcceptToMemoryPool would, and cache the result
+        // so it doesn't repeat the work while holding cs_main.
+        // Transactions the handler won't pass to AcceptToMemoryPool are
+        // left alone.
+        uint256 txid = tx.GetHash();
+        bool fAlreadyHave = true;
+        if (!tx.vjoinsplit.empty() || !tx.vShieldedSpend.empty() || !tx.vShieldedOutput.empty()) {
+            LOCK(cs_main);
+            fAlreadyHave = AlreadyHave(CInv(MSG_TX, txid));
+            nHeight = chainActive.Height() + 1;
+        }
+        if (!fAlreadyHave) {
+            uint32_t consensusBranchId = CurrentEpochBranchId(nHeight, Params().GetConsensus());
+            if (!GetCachedShieldedValidity(txid, consensusBranchId, false)) {
+                auto verifier = libzcash::ProofVerifier::Strict();
+                if (CheckTransactionWithoutProofVerification(tx, state) &&
+                    CheckJoinSplitProofs(tx, state, verifier) &&
+                    ContextualCheckTransaction(tx, state, nHeight, 10))
+                    SetCachedShieldedValidity(txid, consensusBranchId);
+            }
+        }
+    } else if (fValid) {
+        // Equihash, the merkle root and the per-transaction checks, as
+        // ProcessNewBlock would run them before taking cs_main. A block that
+        // passes has fChecked set, so later CheckBlock calls return at once.
+        CValidationState stateBlock;
+        auto verifier = libzcash::ProofVerifier::Disabled();
+        CheckBlock(block, stateBlock, verifier);
+    }
+
+    fDone = true;
+    WakeMessageHandler();
+}
+
+/**
+ * Return the precheck of pfrom's next message, starting it if necessary, or
+ * NULL if the message is not one that is prechecked.
+ */
+static std::shared_ptr<CMessagePrecheck> GetMessagePrecheck(CNode* pfrom, const CNetMessage& msg)
+{
+    std::string strCommand = msg.hdr.GetCommand();
+    if (strCommand != "tx" && (strCommand != "block" || fImporting || fReindex))
+        return NULL;
+    // ProcessMessage drops these without reading them until the peer has
+    // completed the handshake, so don't do any work for them either.
+    if (pfrom->nVersion == 0 || !pfrom->fSuccessfullyConnected)
+        return NULL;
+
+    std::shared_ptr<CMessagePrecheck> pprecheck;
+    {
+        LOCK(cs_mapMessagePrecheck);
+        std::shared_ptr<CMessagePrecheck>& pslot = mapMessagePrecheck[pfrom->GetId()];
+        if (pslot)
+            return pslot;
+        pslot = std::make_shared<CMessagePrecheck>(msg);
+        pprecheck = pslot;
+    }
+    if (nMessagePrecheckThreads > 0)
+        messageprecheckqueue.schedule(boost::bind(&CMessagePrecheck::operator(), pprecheck), boost::chrono::system_clock::now());
+    else
+        (*pprecheck)();
+    return pprecheck;
+}
+
+bool CCoinsPrefetch::operator()() {
+    if (pcoin) {
+        if (!pview->GetCoin(outpoint, *pcoin))
+            pcoin->Clear();
+    } else if (pfSpent) {
+        *pfSpent = pview->GetNullifier(nullifier, type);
+    }
+    return true;
+}
+
+/**
+ * Load the coins and nullifiers spent by a block into pcoinsTip, looking up
+ * the ones that are not cached yet on the prefetch threads. Connecting the
+ * block then finds its inputs in memory instead of waiting on one database
+ * read at a time. The views below pcoinsTip support concurrent reads.
+ */
+static void PrefetchBlockInputs(const CBlock& block)
+{
+    if (!nScriptCheckThreads)
+        return;
+
+    std::set<uint256> setBlockTxids;
+    std::vector<std::pair<COutPoint, Coin> > vCoins;
+    std::vector<std::pair<uint256, bool> > vSproutNullifiers;
+    std::vector<std::pair<uint256, bool> > vSaplingNullifiers;
+    BOOST_FOREACH(const CTransaction& tx, block.vtx) {
+        if (!tx.IsCoinBase()) {
+            BOOST_FOREACH(const CTxIn& txin, tx.vin) {
+                // Outputs created earlier in the block are not in the database.
+                if (!setBlockTxids.count(txin.prevout.hash) && !pcoinsTip->HaveCoinInCache(txin.prevout))
+                    vCoins.push_back(std::make_pair(txin.prevout, Coin()));
+            }
+        }
+        BOOST_FOREACH(const JSDescription& joinsplit, tx.vjoinsplit) {
+            BOOST_FOREACH(const uint256& nf, joinsplit.nullifiers) {
+                if (!pcoinsTip->HaveNullifierInCache(nf, SPROUT))
+                    vSproutNullifiers.push_back(std::make_pair(nf, false));
+            }
+        }
+        BOOST_FOREACH(const SpendDescription& spend, tx.vShieldedSpend) {
+            if (!pcoinsTip->HaveNullifierInCache(spend.nullifier, SAPLING))
+                vSaplingNullifiers.push_back(std::make_pair(spend.nullifier, false));
+        }
+        setBlockTxids.insert(tx.GetHash());
+    }
+    if (vCoins.empty() && vSproutNullifiers.empty() && vSaplingNullifiers.empty())
+        return;
+
+    const CCoinsView& base = *pcoinsTip->GetBackend();
+    std::vector<CCoinsPrefetch> vChecks;
+    vChecks.reserve(vCoins.size() + vSproutNullifiers.size() + vSaplingNullifiers.size());
+    for (size_t i = 0; i < vCoins.size(); i++)
+        vChecks.push_back(CCoinsPrefetch(base, vCoins[i].first, vCoins[i].second));
+    for (size_t i = 0; i < vSproutNullifiers.size(); i++)
+        vChecks.push_back(CCoinsPrefetch(base, vSproutNullifiers[i].first, SPROUT, vSproutNullifiers[i].second));
+    for (size_t i = 0; i < vSaplingNullifiers.size(); i++)
+        vChecks.push_back(CCoinsPrefetch(base, vSaplingNullifiers[i].first, SAPLING, vSaplingNullifiers[i].second));
+
+    CCheckQueueControl<CCoinsPrefetch> control(&prefetchqueue);
+    control.Add(vChecks);
+    control.Wait();
+
+    for (size_t i = 0; i < vCoins.size(); i++)
+        pcoinsTip->ImportCoin(vCoins[i].first, std::move(vCoins[i].second));
+    for (size_t i = 0; i < vSproutNullifiers.size(); i++)
+        pcoinsTip->ImportNullifier(vSproutNullifiers[i].first, SPROUT, vSproutNullifiers[i].second);
+    for (size_t i = 0; i < vSaplingNullifiers.size(); i++)
+        pcoinsTip->ImportNullifier(vSaplingNullifiers[i].first, SAPLING, vSaplingNullifiers[i].second);
+}
+
 //
 // Called periodically asynchronously; alerts if it smells like
 // we're being fed a bad chain (blocks being generated much
@@ -2420,8 +2952,10 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
     auto verifier = libzcash::ProofVerifier::Strict();
     auto disabledVerifier = libzcash::ProofVerifier::Disabled();
 
-    // Check it again to verify JoinSplit proofs, and in case a previous version let a bad block in
-    if (!CheckBlock(block, state, fExpensiveChecks ? verifier : disabledVerifier, !fJustCheck, !fJustCheck))
+    // Check it again in case a previous version let a bad block in. JoinSplit
+    // proofs are verified per transaction below, so that those already
+    // verified on mempool acceptance can be skipped.
+    if (!CheckBlock(block, state, disabledVerifier, !fJustCheck, !fJustCheck))
         return false;
 
     // verify that the view's current state corresponds to the previous block
@@ -2445,10 +2979,11 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
     // Do not allow blocks that contain transactions which 'overwrite' older transactions,
     // unless those are already completely spent.
     BOOST_FOREACH(const CTransaction& tx, block.vtx) {
-        const CCoins* coins = view.AccessCoins(tx.GetHash());
-        if (coins && !coins->IsPruned())
-            return state.DoS(100, error("ConnectBlock(): tried to overwrite transaction"),
-                             REJECT_INVALID, "bad-txns-BIP30");
+        for (size_t o = 0; o < tx.vout.size(); o++) {
+            if (view.HaveCoin(COutPoint(tx.GetHash(), o)))
+                return state.DoS(100, error("ConnectBlock(): tried to overwrite transaction"),
+                                 REJECT_INVALID, "bad-txns-BIP30");
+        }
     }
 
     unsigned int flags = SCRIPT_VERIFY_P2SH | SCRIPT_VERIFY_CHECKLOCKTIMEVERIFY;
@@ -2459,6 +2994,10 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
 
     CCheckQueueControl<CScriptCheck> control(fExpensiveChecks && nScriptCheckThreads ? &scriptcheckqueue : NULL);
 
+    // JoinSplit proofs are verified by the proof check threads while the
+    // rest of the block is being connected.
+    CCheckQueueControl<CShieldedCheck> shieldedControl(fExpensiveChecks && nScriptCheckThreads ? &shieldedcheckqueue : NULL);
+
     int64_t nTimeStart = GetTimeMicros();
     CAmount nFees = 0;
     int nInputs = 0;
@@ -2526,6 +3065,17 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
 
         txdata.emplace_back(tx);
 
+        // Skip the proofs of transactions whose shielded data was already
+        // verified when they were accepted into the mempool.
+        if (fExpensiveChecks && !tx.vjoinsplit.empty() &&
+            !GetCachedShieldedValidity(tx.GetHash(), consensusBranchId, !fJustCheck))
+        {
+            std::vector<CShieldedCheck> vProofChecks;
+            if (!CheckJoinSplitProofs(tx, state, verifier, nScriptCheckThreads ? &vProofChecks : NULL))
+                return false;
+            shieldedControl.Add(vProofChecks);
+        }
+
         if (!tx.IsCoinBase())
         {
             nFees += view.GetValueIn(tx)-tx.GetValueOut();
@@ -2588,6 +3138,16 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
 
     if (!control.Wait())
         return state.DoS(100, false);
+    if (!shieldedControl.Wait()) {
+        // The queue only reports that some proof in the block failed; verify
+        // the JoinSplits again one transaction at a time to find the offender.
+        BOOST_FOREACH(const CTransaction& tx, block.vtx) {
+            if (!CheckJoinSplitProofs(tx, state, verifier))
+                return error("ConnectBlock(): CheckJoinSplitProofs failed");
+        }
+        return state.DoS(100, error("ConnectBlock(): joinsplit does not verify"),
+                         REJECT_INVALID, "bad-txns-joinsplit-verification-failed");
+    }
     int64_t nTime2 = GetTimeMicros(); nTimeVerify += nTime2 - nTimeStart;
     LogPrint("bench", "    - Verify %u txins: %.2fms (%.3fms/txin) [%.2fs]\n", nInputs - 1, 0.001 * (nTime2 - nTimeStart), nInputs <= 1 ? 0 : 0.001 * (nTime2 - nTimeStart) / (nInputs-1), nTimeVerify * 0.000001);
 
@@ -2628,6 +3188,10 @@ bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pin
         if (!pblocktree->WriteTxIndex(vPos))
             return AbortNode(state, "Failed to write transaction index");
 
+    if (fCompactBlockIndex)
+        if (!pblocktree->WriteCompactBlock(CCompactBlock(block, pindex->nHeight)))
+            return AbortNode(state, "Failed to write compact block");
+
     // add this block to the view's block chain
     view.SetBestBlock(pindex->GetBlockHash());
 
@@ -2657,6 +3221,8 @@ enum FlushStateMode {
  * The caches and indexes are flushed depending on the mode we're called with
  * if they're too large, if it's been a while since the last write,
  * or always and in all cases if we're in prune mode and are deleting files.
+ * Except in FLUSH_STATE_ALWAYS mode or when pruning, the coins database write
+ * may still be running in the background when this returns.
  */
 bool static FlushStateToDisk(CValidationState &state, FlushStateMode mode) {
     LOCK2(cs_main, cs_LastBlockFile);
@@ -2677,6 +3243,9 @@ bool static FlushStateToDisk(CValidationState &state, FlushStateMode mode) {
             }
         }
     }
+    // Release the in-memory copy of a finished background chainstate write.
+    if (!pcoinswriter->Poll())
+        return AbortNode(state, "Failed to write to coin database");
     int64_t nNow = GetTimeMicros();
     // Avoid writing/flushing immediately after startup.
     if (nLastWrite == 0) {
@@ -2724,23 +3293,31 @@ bool static FlushStateToDisk(CValidationState &state, FlushStateMode mode) {
                 return AbortNode(state, "Files to write to block index database");
             }
         }
-        // Finally remove any pruned files
-        if (fFlushForPrune)
+        // Finally remove any pruned files. The chainstate on disk must not
+        // lag behind them, so wait for any background write first.
+        if (fFlushForPrune) {
+            if (!pcoinswriter->Sync())
+                return AbortNode(state, "Failed to write to coin database");
             UnlinkPrunedFiles(setFilesToPrune);
+        }
         nLastWrite = nNow;
     }
     // Flush best chain related state. This can only be done if the blocks / block index write was also done.
     if (fDoFullFlush) {
-        // Typical CCoins structures on disk are around 128 bytes in size.
+        // Typical Coin structures on disk are around 48 bytes in size.
         // Pushing a new one to the database can cause it to be written
         // twice (once in the log, and once in the tables). This is already
         // an overestimation, as most will delete an existing entry or
         // overwrite one. Still, use a conservative safety factor of 2.
-        if (!CheckDiskSpace(128 * 2 * 2 * pcoinsTip->GetCacheSize()))
+        if (!CheckDiskSpace(48 * 2 * 2 * pcoinsTip->GetCacheSize()))
             return state.Error("out of disk space");
         // Flush the chainstate (which may refer to block index entries).
+        // Unless the caller needs it on disk now, the database write
+        // continues in the background.
         if (!pcoinsTip->Flush())
             return AbortNode(state, "Failed to write to coin database");
+        if ((mode == FLUSH_STATE_ALWAYS || fFlushForPrune) && !pcoinswriter->Sync())
+            return AbortNode(state, "Failed to write to coin database");
         nLastFlush = nNow;
     }
     if ((mode == FLUSH_STATE_ALWAYS || mode == FLUSH_STATE_PERIODIC) && nNow > nLastSetChain + (int64_t)DATABASE_WRITE_INTERVAL * 1000000) {
@@ -2835,13 +3412,26 @@ bool static DisconnectTip(CValidationState &state, bool fBare = false) {
 
     if (!fBare) {
         // Resurrect mempool transactions from the disconnected block.
+        std::vector<uint256> vHashUpdate;
         BOOST_FOREACH(const CTransaction &tx, block.vtx) {
             // ignore validation errors in resurrected transactions
             list<CTransaction> removed;
             CValidationState stateDummy;
-            if (tx.IsCoinBase() || !AcceptToMemoryPool(mempool, stateDummy, tx, false, NULL))
+            if (tx.IsCoinBase() || !AcceptToMemoryPool(mempool, stateDummy, tx, false, NULL, false, true)) {
                 mempool.remove(tx, removed, true);
+            } else if (mempool.exists(tx.GetHash())) {
+                vHashUpdate.push_back(tx.GetHash());
+            }
         }
+        // AcceptToMemoryPool/addUnchecked all assume that new mempool entries have
+        // no in-mempool children, which is generally not true when adding
+        // previously-confirmed transactions back to the mempool.
+        // UpdateTransactionsFromBlock finds descendants of any transactions in this
+        // block that were added back and cleans up the mempool state.
+        mempool.UpdateTransactionsFromBlock(vHashUpdate);
+        // We reorganized into a chain that may have left the mempool over
+        // its limit; trim it now that the descendant state is consistent.
+        LimitMempoolSize(mempool, GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000);
         if (sproutAnchorBeforeDisconnect != sproutAnchorAfterDisconnect) {
             // The anchor may not change between block disconnects,
             // in which case we don't want to evict from the mempool yet!
@@ -2872,6 +3462,7 @@ bool static DisconnectTip(CValidationState &state, bool fBare = false) {
 }
 
 static int64_t nTimeReadFromDisk = 0;
+static int64_t nTimePrefetch = 0;
 static int64_t nTimeConnectTotal = 0;
 static int64_t nTimeFlush = 0;
 static int64_t nTimeChainState = 0;
@@ -2898,9 +3489,13 @@ bool static ConnectTip(CValidationState &state, CBlockIndex *pindexNew, CBlock *
     assert(pcoinsTip->GetSproutAnchorAt(pcoinsTip->GetBestAnchor(SPROUT), oldSproutTree));
     assert(pcoinsTip->GetSaplingAnchorAt(pcoinsTip->GetBestAnchor(SAPLING), oldSaplingTree));
     // Apply the block atomically to the chain state.
-    int64_t nTime2 = GetTimeMicros(); nTimeReadFromDisk += nTime2 - nTime1;
+    int64_t nTimeLoaded = GetTimeMicros(); nTimeReadFromDisk += nTimeLoaded - nTime1;
+    LogPrint("bench", "  - Load block from disk: %.2fms [%.2fs]\n", (nTimeLoaded - nTime1) * 0.001, nTimeReadFromDisk * 0.000001);
+    // Warm the coins cache with the block's inputs.
+    PrefetchBlockInputs(*pblock);
+    int64_t nTime2 = GetTimeMicros(); nTimePrefetch += nTime2 - nTimeLoaded;
     int64_t nTime3;
-    LogPrint("bench", "  - Load block from disk: %.2fms [%.2fs]\n", (nTime2 - nTime1) * 0.001, nTimeReadFromDisk * 0.000001);
+    LogPrint("bench", "  - Prefetch inputs: %.2fms [%.2fs]\n", (nTime2 - nTimeLoaded) * 0.001, nTimePrefetch * 0.000001);
     {
         CCoinsViewCache view(pcoinsTip);
         bool rv = ConnectBlock(*pblock, state, pindexNew, view);
@@ -3130,6 +3725,7 @@ static bool ActivateBestChainStep(CValidationState &state, CBlockIndex *pindexMo
  */
 bool ActivateBestChain(CValidationState &state, CBlock *pblock) {
     CBlockIndex *pindexNewTip = NULL;
+    const CBlockIndex *pindexFork = NULL;
     CBlockIndex *pindexMostWork = NULL;
     const CChainParams& chainParams = Params();
     do {
@@ -3144,10 +3740,13 @@ bool ActivateBestChain(CValidationState &state, CBlock *pblock) {
             if (pindexMostWork == NULL || pindexMostWork == chainActive.Tip())
                 return true;
 
+            CBlockIndex *pindexOldTip = chainActive.Tip();
+
             if (!ActivateBestChainStep(state, pindexMostWork, pblock && pblock->GetHash() == pindexMostWork->GetBlockHash() ? pblock : NULL))
                 return false;
 
             pindexNewTip = chainActive.Tip();
+            pindexFork = chainActive.FindFork(pindexOldTip);
             fInitialDownload = IsInitialBlockDownload();
         }
         // When we reach this point, we switched to a new tip (stored in pindexNewTip).
@@ -3155,15 +3754,32 @@ bool ActivateBestChain(CValidationState &state, CBlock *pblock) {
         // Notifications/callbacks that can run without cs_main
         if (!fInitialDownload) {
             uint256 hashNewTip = pindexNewTip->GetBlockHash();
+            // Find the hashes of all blocks that weren't previously in the best chain.
+            std::vector<uint256> vHashes;
+            const CBlockIndex *pindexToAnnounce = pindexNewTip;
+            while (pindexToAnnounce != pindexFork) {
+                vHashes.push_back(pindexToAnnounce->GetBlockHash());
+                pindexToAnnounce = pindexToAnnounce->pprev;
+                if (vHashes.size() == MAX_BLOCKS_TO_ANNOUNCE) {
+                    // Limit announcements in case of a huge reorganization.
+                    // Rely on the peer's synchronization mechanism in that case.
+                    break;
+                }
+            }
             // Relay inventory, but don't relay old inventory during initial block download.
+            // SendMessages decides whether each peer gets headers, a cmpctblock or an inv.
             int nBlockEstimate = 0;
             if (fCheckpointsEnabled)
                 nBlockEstimate = Checkpoints::GetTotalBlocksEstimate(chainParams.Checkpoints());
             {
                 LOCK(cs_vNodes);
-                BOOST_FOREACH(CNode* pnode, vNodes)
-                    if (chainActive.Height() > (pnode->nStartingHeight != -1 ? pnode->nStartingHeight - 2000 : nBlockEstimate))
-                        pnode->PushInventory(CInv(MSG_BLOCK, hashNewTip));
+                BOOST_FOREACH(CNode* pnode, vNodes) {
+                    if (chainActive.Height() > (pnode->nStartingHeight != -1 ? pnode->nStartingHeight - 2000 : nBlockEstimate)) {
+                        BOOST_REVERSE_FOREACH(const uint256& hash, vHashes) {
+                            pnode->PushBlockHash(hash);
+                        }
+                    }
+                }
             }
             // Notify external listeners about the new tip.
             GetMainSignals().UpdatedBlockTip(pindexNewTip);
@@ -3485,6 +4101,9 @@ bool CheckBlock(const CBlock& block, CValidationState& state,
 {
     // These are checks that are independent of context.
 
+    if (block.fChecked)
+        return true;
+
     // Check that the header is valid (particularly PoW).  This is mostly
     // redundant with the call in AcceptBlockHeader.
     if (!CheckBlockHeader(block, state, fCheckPOW))
@@ -3538,6 +4157,9 @@ bool CheckBlock(const CBlock& block, CValidationState& state,
         return state.DoS(100, error("CheckBlock(): out-of-bounds SigOpCount"),
                          REJECT_INVALID, "bad-blk-sigops", true);
 
+    if (fCheckPOW && fCheckMerkleRoot)
+        block.fChecked = true;
+
     return true;
 }
 
@@ -3584,13 +4206,24 @@ bool ContextualCheckBlock(const CBlock& block, CValidationState& state, CBlockIn
     const int nHeight = pindexPrev == NULL ? 0 : pindexPrev->nHeight + 1;
     const Consensus::Params& consensusParams = Params().GetConsensus();
 
+    // JoinSplit signatures and Sapling proofs and signatures of the whole
+    // block are collected and verified together by the proof check threads
+    // while the remaining contextual checks run.
+    CCheckQueueControl<CShieldedCheck> control(nScriptCheckThreads ? &shieldedcheckqueue : NULL);
+    std::vector<const CTransaction*> vShieldedTx;
+
     // Check that all transactions are finalized
     BOOST_FOREACH(const CTransaction& tx, block.vtx) {
 
         // Check transaction contextually against consensus rules at block height
-        if (!ContextualCheckTransaction(tx, state, nHeight, 100)) {
+        std::vector<CShieldedCheck> vChecks;
+        if (!ContextualCheckTransaction(tx, state, nHeight, 100, IsInitialBlockDownload, nScriptCheckThreads ? &vChecks : NULL)) {
             return false; // Failure reason has been set in validation state object
         }
+        if (!vChecks.empty()) {
+            vShieldedTx.push_back(&tx);
+            control.Add(vChecks);
+        }
 
         int nLockTimeFlags = 0;
         int64_t nLockTimeCutoff = (nLockTimeFlags & LOCKTIME_MEDIAN_TIME_PAST)
@@ -3636,6 +4269,19 @@ bool ContextualCheckBlock(const CBlock& block, CValidationState& state, CBlockIn
 //        }
 //    }
 
+    if (!control.Wait()) {
+        // The block-level check only reports that something failed; fall back
+        // to verifying each transaction inline to locate the offender and to
+        // report its specific reject reason.
+        BOOST_FOREACH(const CTransaction* ptx, vShieldedTx) {
+            if (!ContextualCheckTransaction(*ptx, state, nHeight, 100)) {
+                return false;
+            }
+        }
+        return state.DoS(100, error("%s: shielded proofs or signatures invalid", __func__),
+                         REJECT_INVALID, "bad-txns-shielded-verification-failed");
+    }
+
     return true;
 }
 
@@ -4857,7 +5503,8 @@ bool static AlreadyHave(const CInv& inv) EXCLUSIVE_LOCKS_REQUIRED(cs_main)
             return recentRejects->contains(inv.hash) ||
                    mempool.exists(inv.hash) ||
                    mapOrphanTransactions.count(inv.hash) ||
-                   pcoinsTip->HaveCoins(inv.hash);
+                   pcoinsTip->HaveCoinInCache(COutPoint(inv.hash, 0)) || // Best effort: only try output 0 and 1
+                   pcoinsTip->HaveCoinInCache(COutPoint(inv.hash, 1));
         }
     case MSG_BLOCK:
         return mapBlockIndex.count(inv.hash);
@@ -4886,7 +5533,7 @@ void static ProcessGetData(CNode* pfrom)
             boost::this_thread::interruption_point();
             it++;
 
-            if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK)
+            if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK || inv.type == MSG_CMPCT_BLOCK)
             {
                 bool send = false;
                 BlockMap::iterator mi = mapBlockIndex.find(inv.hash);
@@ -4911,32 +5558,52 @@ void static ProcessGetData(CNode* pfrom)
                 // it's available before trying to send.
                 if (send && (mi->second->nStatus & BLOCK_HAVE_DATA))
                 {
-                    // Send block from disk
-                    CBlock block;
-                    if (!ReadBlockFromDisk(block, (*mi).second))
-                        assert(!"cannot load block from disk");
-                    if (inv.type == MSG_BLOCK)
-                        pfrom->PushMessage("block", block);
-                    else // MSG_FILTERED_BLOCK)
+                    // A peer asking for an old block is almost guaranteed not to
+                    // have a useful mempool to match a compact block against, so
+                    // send the full block instead.
+                    bool fFullBlock = inv.type == MSG_BLOCK ||
+                        (inv.type == MSG_CMPCT_BLOCK && mi->second->nHeight < chainActive.Height() - MAX_CMPCTBLOCK_DEPTH);
+                    if (fFullBlock)
+                    {
+                        // Send the block as serialized on disk; there's no need to
+                        // deserialize all of its transactions just to serialize them again.
+                        RawBlockRef pblock = GetRawBlock((*mi).second);
+                        if (!pblock)
+                            assert(!"cannot load block from disk");
+                        pfrom->PushMessage("block", CFlatData((void*)begin_ptr(*pblock), (void*)end_ptr(*pblock)));
+                    }
+                    else
                     {
-                        LOCK(pfrom->cs_filter);
-                        if (pfrom->pfilter)
+                        // Send block from disk
+                        CBlock block;
+                        if (!ReadBlockFromDisk(block, (*mi).second))
+                            assert(!"cannot load block from disk");
+                        if (inv.type == MSG_FILTERED_BLOCK)
                         {
-                            CMerkleBlock merkleBlock(block, *pfrom->pfilter);
-                            pfrom->PushMessage("merkleblock", merkleBlock);
-                            // CMerkleBlock just contains hashes, so also push any transactions in the block the client did not see
-                            // This avoids hurting performance by pointlessly requiring a round-trip
-                            // Note that there is currently no way for a node to request any single transactions we didn't send here -
-                            // they must either disconnect and retry or request the full block.
-                            // Thus, the protocol spec specified allows for us to provide duplicate txn here,
-                            // however we MUST always provide at least what the remote peer needs
-                            typedef std::pair<unsigned int, uint256> PairType;
-                            BOOST_FOREACH(PairType& pair, merkleBlock.vMatchedTxn)
-                                if (!pfrom->setInventoryKnown.count(CInv(MSG_TX, pair.second)))
-                                    pfrom->PushMessage("tx", block.vtx[pair.first]);
+                            LOCK(pfrom->cs_filter);
+                            if (pfrom->pfilter)
+                            {
+                                CMerkleBlock merkleBlock(block, *pfrom->pfilter);
+                                pfrom->PushMessage("merkleblock", merkleBlock);
+                                // CMerkleBlock just contains hashes, so also push any transactions in the block the client did not see
+                                // This avoids hurting performance by pointlessly requiring a round-trip
+                                // Note that there is currently no way for a node to request any single transactions we didn't send here -
+                                // they must either disconnect and retry or request the full block.
+                                // Thus, the protocol spec specified allows for us to provide duplicate txn here,
+                                // however we MUST always provide at least what the remote peer needs
+                                typedef std::pair<unsigned int, uint256> PairType;
+                                BOOST_FOREACH(PairType& pair, merkleBlock.vMatchedTxn)
+                                    if (!pfrom->setInventoryKnown.count(CInv(MSG_TX, pair.second)))
+                                        pfrom->PushMessage("tx", block.vtx[pair.first]);
+                            }
+                            // else
+                                // no response
+                        }
+                        else // MSG_CMPCT_BLOCK
+                        {
+                            CBlockHeaderAndShortTxIDs cmpctblock(block);
+                            pfrom->PushMessage("cmpctblock", cmpctblock);
                         }
-                        // else
-                            // no response
                     }
 
                     // Trigger the peer node to send a getblocks request for the next batch of inventory
@@ -4994,7 +5661,7 @@ void static ProcessGetData(CNode* pfrom)
             // Track requests for our stuff.
             GetMainSignals().Inventory(inv.hash);
 
-            if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK)
+            if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK || inv.type == MSG_CMPCT_BLOCK)
                 break;
         }
     }
@@ -5013,7 +5680,47 @@ void static ProcessGetData(CNode* pfrom)
     }
 }
 
-bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv, int64_t nTimeReceived)
+// Completes a compact block we requested missing transactions for, and
+// processes the result like a "block" message.
+void static ProcessBlockTransactions(CNode* pfrom, const BlockTransactions& resp)
+{
+    LOCK(cs_main);
+
+    map<uint256, pair<NodeId, list<QueuedBlock>::iterator> >::iterator it = mapBlocksInFlight.find(resp.blockhash);
+    if (it == mapBlocksInFlight.end() || !it->second.second->partialBlock ||
+            it->second.first != pfrom->GetId()) {
+        LogPrint("net", "Peer %d sent us block transactions for block we weren't expecting\n", pfrom->id);
+        return;
+    }
+
+    PartiallyDownloadedBlock& partialBlock = *it->second.second->partialBlock;
+    CBlock block;
+    ReadStatus status = partialBlock.FillBlock(block, resp.txn);
+    if (status == READ_STATUS_INVALID) {
+        MarkBlockAsReceived(resp.blockhash); // Reset in-flight state in case of whitelist
+        Misbehaving(pfrom->GetId(), 100);
+        LogPrintf("Peer %d sent us invalid compact block/non-matching block transactions\n", pfrom->id);
+    } else if (status == READ_STATUS_FAILED) {
+        // Might have collided, fall back to getdata now :(
+        vector<CInv> vInv;
+        vInv.push_back(CInv(MSG_BLOCK, resp.blockhash));
+        pfrom->PushMessage("getdata", vInv);
+    } else {
+        // partialBlock is destroyed once ProcessNewBlock marks the block as received.
+        pfrom->AddInventoryKnown(CInv(MSG_BLOCK, resp.blockhash));
+        CValidationState state;
+        ProcessNewBlock(state, pfrom, &block, false, NULL);
+        int nDoS;
+        if (state.IsInvalid(nDoS)) {
+            pfrom->PushMessage("reject", (string)"blocktxn", state.GetRejectCode(),
+                               state.GetRejectReason().substr(0, MAX_REJECT_MESSAGE_LENGTH), resp.blockhash);
+            if (nDoS > 0)
+                Misbehaving(pfrom->GetId(), nDoS);
+        }
+    }
+}
+
+bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv, int64_t nTimeReceived, CMessagePrecheck* pprecheck)
 {
     const CChainParams& chainparams = Params();
     LogPrint("net", "received: %s (%u bytes) peer=%d\n", SanitizeString(strCommand), vRecv.size(), pfrom->id);
@@ -5177,6 +5884,38 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
             LOCK(cs_main);
             State(pfrom->GetId())->fCurrentlyConnected = true;
         }
+
+        // Tell the peer we prefer new blocks announced with headers rather
+        // than an inv, saving the getheaders round trip before we fetch them.
+        pfrom->PushMessage("sendheaders");
+
+        // Tell the peer we can rebuild blocks from compact announcements
+        // (BIP 152 low-bandwidth mode). Peers that predate it ignore the
+        // message. High-bandwidth mode is requested later, from peers that
+        // turn out to relay new blocks to us first.
+        bool fAnnounceUsingCMPCTBLOCK = false;
+        uint64_t nCMPCTBLOCKVersion = 1;
+        pfrom->PushMessage("sendcmpct", fAnnounceUsingCMPCTBLOCK, nCMPCTBLOCKVersion);
+    }
+
+
+    else if (strCommand == "sendheaders")
+    {
+        LOCK(cs_main);
+        State(pfrom->GetId())->fPreferHeaders = true;
+    }
+
+
+    else if (strCommand == "sendcmpct")
+    {
+        bool fAnnounceUsingCMPCTBLOCK = false;
+        uint64_t nCMPCTBLOCKVersion = 0;
+        vRecv >> fAnnounceUsingCMPCTBLOCK >> nCMPCTBLOCKVersion;
+        if (nCMPCTBLOCKVersion == 1) {
+            LOCK(cs_main);
+            State(pfrom->GetId())->fProvidesHeaderAndIDs = true;
+            State(pfrom->GetId())->fPreferHeaderAndIDs = fAnnounceUsingCMPCTBLOCK;
+        }
     }
 
 
@@ -5303,9 +6042,17 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
                     // not a direct successor.
                     pfrom->PushMessage("getheaders", chainActive.GetLocator(pindexBestHeader), inv.hash);
                     CNodeState *nodestate = State(pfrom->GetId());
-                    if (chainActive.Tip()->GetBlockTime() > GetAdjustedTime() - chainparams.GetConsensus().nPowTargetSpacing * 20 &&
+                    if (CanDirectFetch(chainparams.GetConsensus()) &&
                         nodestate->nBlocksInFlight < MAX_BLOCKS_IN_TRANSIT_PER_PEER) {
-                        vToFetch.push_back(inv);
+                        if (nodestate->fProvidesHeaderAndIDs && mapBlocksInFlight.empty()) {
+                            // We are caught up and this peer is the first to tell us about
+                            // the block: rebuild it from our mempool, and ask the peer to
+                            // push its next blocks to us without waiting for a getdata.
+                            MaybeSetPeerAsAnnouncingHeaderAndIDs(nodestate, pfrom);
+                            vToFetch.push_back(CInv(MSG_CMPCT_BLOCK, inv.hash));
+                        } else {
+                            vToFetch.push_back(inv);
+                        }
                         // Mark block as in flight already, even though the actual "getdata" message only goes out
                         // later (within the same cs_main lock, though).
                         MarkBlockAsInFlight(pfrom->GetId(), inv.hash, chainparams.GetConsensus());
@@ -5431,6 +6178,11 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
             if (--nLimit <= 0 || pindex->GetBlockHash() == hashStop)
                 break;
         }
+        // pindex can be NULL either if we sent chainActive.Tip() OR
+        // if our peer has chainActive.Tip() (and thus we are sending an empty
+        // headers message). In both cases it's safe to update
+        // pindexBestHeaderSent to be our tip.
+        State(pfrom->GetId())->pindexBestHeaderSent = pindex ? pindex : chainActive.Tip();
         pfrom->PushMessage("headers", vHeaders);
     }
 
@@ -5440,7 +6192,10 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         vector<uint256> vWorkQueue;
         vector<uint256> vEraseQueue;
         CTransaction tx;
-        vRecv >> tx;
+        if (pprecheck)
+            tx = pprecheck->tx;
+        else
+            vRecv >> tx;
 
         CInv inv(MSG_TX, tx.GetHash());
         pfrom->AddInventoryKnown(inv);
@@ -5453,7 +6208,15 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
         pfrom->setAskFor.erase(inv.hash);
         mapAlreadyAskedFor.erase(inv);
 
-        if (!AlreadyHave(inv) && AcceptToMemoryPool(mempool, state, tx, true, &fMissingInputs))
+        // A transaction that failed its precheck against the rules of the
+        // same next block is rejected without being verified again.
+        bool fPrecheckFailed = false;
+        if (pprecheck && !pprecheck->state.IsValid() && pprecheck->nHeight == chainActive.Height() + 1 && !AlreadyHave(inv)) {
+            state = pprecheck->state;
+            fPrecheckFailed = true;
+        }
+
+        if (!fPrecheckFailed && !AlreadyHave(inv) && AcceptToMemoryPool(mempool, state, tx, true, &fMissingInputs))
         {
             mempool.check(pcoinsTip);
             RelayTransaction(tx);
@@ -5591,6 +6354,35 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
             return true;
         }
 
+        CNodeState *nodestate = State(pfrom->GetId());
+
+        // If this looks like it could be a block announcement (nCount <
+        // MAX_BLOCKS_TO_ANNOUNCE), use special logic for handling headers that
+        // don't connect:
+        // - Send a getheaders message in response to try to connect the chain.
+        // - The peer can send up to MAX_UNCONNECTING_HEADERS in a row that
+        //   don't connect before giving DoS points
+        // - Once a headers message is received that is valid and does connect,
+        //   nUnconnectingHeaders gets reset back to 0.
+        if (mapBlockIndex.find(headers[0].hashPrevBlock) == mapBlockIndex.end() && nCount < MAX_BLOCKS_TO_ANNOUNCE) {
+            nodestate->nUnconnectingHeaders++;
+            pfrom->PushMessage("getheaders", chainActive.GetLocator(pindexBestHeader), uint256());
+            LogPrint("net", "received header %s: missing prev block %s, sending getheaders (%d) to end (peer=%d, nUnconnectingHeaders=%d)\n",
+                    headers[0].GetHash().ToString(),
+                    headers[0].hashPrevBlock.ToString(),
+                    pindexBestHeader->nHeight,
+                    pfrom->id, nodestate->nUnconnectingHeaders);
+            // Set hashLastUnknownBlock for this peer, so that if we
+            // eventually get the headers - even from a different peer -
+            // we can use this peer to download.
+            UpdateBlockAvailability(pfrom->GetId(), headers.back().GetHash());
+
+            if (nodestate->nUnconnectingHeaders % MAX_UNCONNECTING_HEADERS == 0) {
+                Misbehaving(pfrom->GetId(), 20);
+            }
+            return true;
+        }
+
         CBlockIndex *pindexLast = NULL;
         BOOST_FOREACH(const CBlockHeader& header, headers) {
             CValidationState state;
@@ -5608,10 +6400,16 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
             }
         }
 
-        if (pindexLast)
-            UpdateBlockAvailability(pfrom->GetId(), pindexLast->GetBlockHash());
+        if (nodestate->nUnconnectingHeaders > 0) {
+            LogPrint("net", "peer=%d: resetting nUnconnectingHeaders (%d -> 0)\n", pfrom->id, nodestate->nUnconnectingHeaders);
+        }
+        nodestate->nUnconnectingHeaders = 0;
+
+        if (!pindexLast)
+            return true;
+        UpdateBlockAvailability(pfrom->GetId(), pindexLast->GetBlockHash());
 
-        if (nCount == MAX_HEADERS_RESULTS && pindexLast) {
+        if (nCount == MAX_HEADERS_RESULTS) {
             // Headers message had its maximum size; the peer may have more headers.
             // TODO: optimize: if pindexLast is an ancestor of chainActive.Tip or pindexBestHeader, continue
             // from there instead.
@@ -5619,13 +6417,69 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
             pfrom->PushMessage("getheaders", chainActive.GetLocator(pindexLast), uint256());
         }
 
+        // If this set of headers is valid and ends in a block with at least as
+        // much work as our tip, download as much as possible.
+        if (CanDirectFetch(chainparams.GetConsensus()) && pindexLast->IsValid(BLOCK_VALID_TREE) && chainActive.Tip()->nChainWork <= pindexLast->nChainWork) {
+            vector<CBlockIndex *> vToFetch;
+            CBlockIndex *pindexWalk = pindexLast;
+            // Calculate all the blocks we'd need to switch to pindexLast, up to a limit.
+            while (pindexWalk && !chainActive.Contains(pindexWalk) && vToFetch.size() <= MAX_BLOCKS_IN_TRANSIT_PER_PEER) {
+                if (!(pindexWalk->nStatus & BLOCK_HAVE_DATA) &&
+                        !mapBlocksInFlight.count(pindexWalk->GetBlockHash())) {
+                    // We don't have this block, and it's not yet in flight.
+                    vToFetch.push_back(pindexWalk);
+                }
+                pindexWalk = pindexWalk->pprev;
+            }
+            // If pindexWalk still isn't on our main chain, we're looking at a
+            // very large reorg at a time we think we're close to caught up to
+            // the main chain -- this shouldn't really happen.  Bail out on the
+            // direct fetch and rely on parallel download instead.
+            if (!chainActive.Contains(pindexWalk)) {
+                LogPrint("net", "Large reorg, won't direct fetch to %s (%d)\n",
+                        pindexLast->GetBlockHash().ToString(),
+                        pindexLast->nHeight);
+            } else {
+                vector<CInv> vGetData;
+                bool fFirstInFlight = mapBlocksInFlight.empty();
+                // Download as much as possible, from earliest to latest.
+                BOOST_REVERSE_FOREACH(CBlockIndex *pindex, vToFetch) {
+                    if (nodestate->nBlocksInFlight >= MAX_BLOCKS_IN_TRANSIT_PER_PEER) {
+                        // Can't download any more from this peer
+                        break;
+                    }
+                    vGetData.push_back(CInv(MSG_BLOCK, pindex->GetBlockHash()));
+                    MarkBlockAsInFlight(pfrom->GetId(), pindex->GetBlockHash(), chainparams.GetConsensus(), pindex);
+                    LogPrint("net", "Requesting block %s from peer=%d\n",
+                            pindex->GetBlockHash().ToString(), pfrom->id);
+                }
+                if (vGetData.size() > 1) {
+                    LogPrint("net", "Downloading blocks toward %s (%d) via headers direct fetch\n",
+                            pindexLast->GetBlockHash().ToString(), pindexLast->nHeight);
+                }
+                if (vGetData.size() > 0) {
+                    if (nodestate->fProvidesHeaderAndIDs && vGetData.size() == 1 && fFirstInFlight) {
+                        // We seem to be well synced, and this peer was the first to
+                        // give us the new block: fetch it as a compact block, and ask
+                        // the peer to push its next blocks to us directly.
+                        MaybeSetPeerAsAnnouncingHeaderAndIDs(nodestate, pfrom);
+                        vGetData[0] = CInv(MSG_CMPCT_BLOCK, vGetData[0].hash);
+                    }
+                    pfrom->PushMessage("getdata", vGetData);
+                }
+            }
+        }
+
         CheckBlockIndex();
     }
 
     else if (strCommand == "block" && !fImporting && !fReindex) // Ignore blocks received while importing
     {
         CBlock block;
-        vRecv >> block;
+        if (pprecheck)
+            block = std::move(pprecheck->block);
+        else
+            vRecv >> block;
 
         CInv inv(MSG_BLOCK, block.GetHash());
         LogPrint("net", "received block %s peer=%d\n", inv.hash.ToString(), pfrom->id);
@@ -5652,6 +6506,172 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
     }
 
 
+    else if (strCommand == "cmpctblock" && !fImporting && !fReindex) // Ignore blocks received while importing
+    {
+        CBlockHeaderAndShortTxIDs cmpctblock;
+        vRecv >> cmpctblock;
+
+        const Consensus::Params& consensusParams = chainparams.GetConsensus();
+        uint256 hash = cmpctblock.header.GetHash();
+        LogPrint("net", "received cmpctblock %s peer=%d\n", hash.ToString(), pfrom->id);
+        pfrom->AddInventoryKnown(CInv(MSG_BLOCK, hash));
+
+        LOCK(cs_main);
+
+        if (mapBlockIndex.find(cmpctblock.header.hashPrevBlock) == mapBlockIndex.end()) {
+            // Doesn't connect (or is genesis): instead of DoSing in AcceptBlockHeader,
+            // request deeper headers, and let normal block download fetch it afterwards.
+            if (!IsInitialBlockDownload())
+                pfrom->PushMessage("getheaders", chainActive.GetLocator(pindexBestHeader), uint256());
+            map<uint256, pair<NodeId, list<QueuedBlock>::iterator> >::iterator itInFlight = mapBlocksInFlight.find(hash);
+            if (itInFlight != mapBlocksInFlight.end() && itInFlight->second.first == pfrom->GetId())
+                MarkBlockAsReceived(hash);
+            return true;
+        }
+
+        CBlockIndex *pindex = NULL;
+        CValidationState state;
+        if (!AcceptBlockHeader(cmpctblock.header, state, &pindex)) {
+            int nDoS;
+            if (state.IsInvalid(nDoS) && nDoS > 0)
+                Misbehaving(pfrom->GetId(), nDoS);
+            LogPrintf("Peer %d sent us invalid header via cmpctblock\n", pfrom->id);
+            return true;
+        }
+        UpdateBlockAvailability(pfrom->GetId(), hash);
+
+        map<uint256, pair<NodeId, list<QueuedBlock>::iterator> >::iterator blockInFlightIt = mapBlocksInFlight.find(hash);
+        bool fAlreadyInFlight = blockInFlightIt != mapBlocksInFlight.end();
+
+        if (pindex->nStatus & BLOCK_HAVE_DATA) // Nothing to do here
+            return true;
+
+        if (pindex->nChainWork <= chainActive.Tip()->nChainWork || // We know something better
+                pindex->nTx != 0) { // We had this block at some point, but pruned it
+            if (fAlreadyInFlight) {
+                // We requested this block for some reason, but our mempool will probably be useless
+                // so we just grab the block via normal getdata
+                vector<CInv> vInv(1, CInv(MSG_BLOCK, hash));
+                pfrom->PushMessage("getdata", vInv);
+            }
+            return true;
+        }
+
+        // If we're not close to tip yet, give up and let parallel block fetch work its magic
+        if (!fAlreadyInFlight && !CanDirectFetch(consensusParams))
+            return true;
+
+        CNodeState *nodestate = State(pfrom->GetId());
+
+        // We want to be a bit conservative just to be extra careful about DoS
+        // possibilities in compact block processing...
+        if (pindex->nHeight <= chainActive.Height() + 2) {
+            if ((!fAlreadyInFlight && nodestate->nBlocksInFlight < MAX_BLOCKS_IN_TRANSIT_PER_PEER) ||
+                 (fAlreadyInFlight && blockInFlightIt->second.first == pfrom->GetId())) {
+                list<QueuedBlock>::iterator *queuedBlockIt = NULL;
+                if (!MarkBlockAsInFlight(pfrom->GetId(), hash, consensusParams, pindex, &queuedBlockIt)) {
+                    if (!(*queuedBlockIt)->partialBlock)
+                        (*queuedBlockIt)->partialBlock.reset(new PartiallyDownloadedBlock(&mempool));
+                    else {
+                        // The block was already in flight using compact blocks from the same peer
+                        LogPrint("net", "Peer sent us compact block we were already syncing!\n");
+                        return true;
+                    }
+                }
+
+                PartiallyDownloadedBlock& partialBlock = *(*queuedBlockIt)->partialBlock;
+                ReadStatus status = partialBlock.InitData(cmpctblock);
+                if (status == READ_STATUS_INVALID) {
+                    MarkBlockAsReceived(hash); // Reset in-flight state in case of whitelist
+                    Misbehaving(pfrom->GetId(), 100);
+                    LogPrintf("Peer %d sent us invalid compact block\n", pfrom->id);
+                    return true;
+                } else if (status == READ_STATUS_FAILED) {
+                    // Duplicate txindexes, the block is now in-flight, so just request it
+                    vector<CInv> vInv(1, CInv(MSG_BLOCK, hash));
+                    pfrom->PushMessage("getdata", vInv);
+                    return true;
+                }
+
+                BlockTransactionsRequest req;
+                for (size_t i = 0; i < cmpctblock.BlockTxCount(); i++) {
+                    if (!partialBlock.IsTxAvailable(i))
+                        req.indexes.push_back(i);
+                }
+                if (req.indexes.empty()) {
+                    // Every transaction was in our mempool.
+                    BlockTransactions txn;
+                    txn.blockhash = hash;
+                    ProcessBlockTransactions(pfrom, txn);
+                } else {
+                    req.blockhash = hash;
+                    pfrom->PushMessage("getblocktxn", req);
+                }
+            }
+        } else if (fAlreadyInFlight) {
+            // We requested this block, but it's far into the future, so our
+            // mempool will probably be useless - request the block normally
+            vector<CInv> vInv(1, CInv(MSG_BLOCK, hash));
+            pfrom->PushMessage("getdata", vInv);
+        }
+        // Otherwise this was an unsolicited announcement too far ahead to
+        // rebuild; having accepted its header, we treat it like a headers message.
+    }
+
+
+    else if (strCommand == "getblocktxn")
+    {
+        BlockTransactionsRequest req;
+        vRecv >> req;
+
+        LOCK(cs_main);
+
+        BlockMap::iterator it = mapBlockIndex.find(req.blockhash);
+        if (it == mapBlockIndex.end() || !(it->second->nStatus & BLOCK_HAVE_DATA)) {
+            LogPrintf("Peer %d sent us a getblocktxn for a block we don't have\n", pfrom->id);
+            return true;
+        }
+
+        if (it->second->nHeight < chainActive.Height() - MAX_BLOCKTXN_DEPTH) {
+            // If an older block is requested (should never happen in practice,
+            // but can happen in tests) send a block response instead of a
+            // blocktxn response. Sending a full block response instead of a
+            // small blocktxn response is preferable in the case where a peer
+            // might maliciously send lots of getblocktxn requests to trigger
+            // expensive disk reads, because it will require the peer to
+            // actually receive all the data read from disk over the network.
+            LogPrint("net", "Peer %d sent us a getblocktxn for a block > %i deep\n", pfrom->id, MAX_BLOCKTXN_DEPTH);
+            pfrom->vRecvGetData.push_back(CInv(MSG_BLOCK, req.blockhash));
+            ProcessGetData(pfrom);
+            return true;
+        }
+
+        CBlock block;
+        if (!ReadBlockFromDisk(block, it->second))
+            assert(!"cannot load block from disk");
+
+        BlockTransactions resp(req);
+        for (size_t i = 0; i < req.indexes.size(); i++) {
+            if (req.indexes[i] >= block.vtx.size()) {
+                Misbehaving(pfrom->GetId(), 100);
+                LogPrintf("Peer %d sent us a getblocktxn with out-of-bounds tx indices\n", pfrom->id);
+                return true;
+            }
+            resp.txn[i] = block.vtx[req.indexes[i]];
+        }
+        pfrom->PushMessage("blocktxn", resp);
+    }
+
+
+    else if (strCommand == "blocktxn" && !fImporting && !fReindex) // Ignore blocks received while importing
+    {
+        BlockTransactions resp;
+        vRecv >> resp;
+
+        ProcessBlockTransactions(pfrom, resp);
+    }
+
+
     // This asymmetric behavior for inbound and outbound connections was introduced
     // to prevent a fingerprinting attack: an attacker can send specific fake addresses
     // to users' AddrMan and later request them by sending getaddr messages.
@@ -5960,6 +6980,20 @@ bool ProcessMessages(CNode* pfrom)
         if (!msg.complete())
             break;
 
+        // Transactions and blocks are checked on the message precheck threads
+        // first. Leave this peer's messages until that is done, and serve the
+        // other peers in the meantime.
+        std::shared_ptr<CMessagePrecheck> pprecheck = GetMessagePrecheck(pfrom, msg);
+        pfrom->fWaitingForPrecheck = pprecheck && !pprecheck->fDone;
+        if (pfrom->fWaitingForPrecheck)
+            break;
+        if (pprecheck) {
+            LOCK(cs_mapMessagePrecheck);
+            mapMessagePrecheck.erase(pfrom->GetId());
+            if (!pprecheck->fValid)
+                pprecheck.reset();
+        }
+
         // at this point, any failure means we can delete the current message
         it++;
 
@@ -5982,10 +7016,10 @@ bool ProcessMessages(CNode* pfrom)
         // Message size
         unsigned int nMessageSize = hdr.nMessageSize;
 
-        // Checksum
+        // Checksum, unless the precheck already verified it
         CDataStream& vRecv = msg.vRecv;
-        uint256 hash = Hash(vRecv.begin(), vRecv.begin() + nMessageSize);
-        unsigned int nChecksum = ReadLE32((unsigned char*)&hash);
+        uint256 hash = pprecheck ? uint256() : Hash(vRecv.begin(), vRecv.begin() + nMessageSize);
+        unsigned int nChecksum = pprecheck ? hdr.nChecksum : ReadLE32((unsigned char*)&hash);
         if (nChecksum != hdr.nChecksum)
         {
             LogPrintf("%s(%s, %u bytes): CHECKSUM ERROR nChecksum=%08x hdr.nChecksum=%08x\n", __func__,
@@ -5997,7 +7031,7 @@ bool ProcessMessages(CNode* pfrom)
         bool fRet = false;
         try
         {
-            fRet = ProcessMessage(pfrom, strCommand, vRecv, msg.nTime);
+            fRet = ProcessMessage(pfrom, strCommand, vRecv, msg.nTime, pprecheck.get());
             boost::this_thread::interruption_point();
         }
         catch (const std::ios_base::failure& e)
@@ -6169,6 +7203,133 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
             GetMainSignals().Broadcast(nTimeBestReceived);
         }
 
+        //
+        // Try sending block announcements via headers
+        //
+        {
+            // If we have less than MAX_BLOCKS_TO_ANNOUNCE in our
+            // list of block hashes we're relaying, and our peer wants
+            // headers announcements, then find the first header
+            // not yet known to our peer but would connect, and send.
+            // If no header would connect, or if we have too many
+            // blocks, or if the peer doesn't want headers, just
+            // add all to the inv queue.
+            LOCK(pto->cs_inventory);
+            vector<CBlock> vHeaders;
+            bool fRevertToInv = ((!state.fPreferHeaders &&
+                                 (!state.fPreferHeaderAndIDs || pto->vBlockHashesToAnnounce.size() > 1)) ||
+                                pto->vBlockHashesToAnnounce.size() > MAX_BLOCKS_TO_ANNOUNCE);
+            CBlockIndex *pBestIndex = NULL; // last header queued for delivery
+            ProcessBlockAvailability(pto->id); // ensure pindexBestKnownBlock is up-to-date
+
+            if (!fRevertToInv) {
+                bool fFoundStartingHeader = false;
+                // Try to find first header that our peer doesn't have, and
+                // then send all headers past that one.  If we come across any
+                // headers that aren't on chainActive, give up.
+                BOOST_FOREACH(const uint256 &hash, pto->vBlockHashesToAnnounce) {
+                    BlockMap::iterator mi = mapBlockIndex.find(hash);
+                    assert(mi != mapBlockIndex.end());
+                    CBlockIndex *pindex = mi->second;
+                    if (chainActive[pindex->nHeight] != pindex) {
+                        // Bail out if we reorged away from this block
+                        fRevertToInv = true;
+                        break;
+                    }
+                    if (pBestIndex != NULL && pindex->pprev != pBestIndex) {
+                        // This means that the list of blocks to announce don't
+                        // connect to each other.
+                        // This shouldn't really be possible to hit during
+                        // regular operation (because reorgs should take us to
+                        // a chain that has some block not on the prior chain,
+                        // which should be caught by the prior check), but one
+                        // way this could happen is by using invalidateblock /
+                        // reconsiderblock repeatedly on the tip, causing it to
+                        // be added multiple times to vBlockHashesToAnnounce.
+                        // Robustly deal with this rare situation by reverting
+                        // to an inv.
+                        fRevertToInv = true;
+                        break;
+                    }
+                    pBestIndex = pindex;
+                    if (fFoundStartingHeader) {
+                        // add this to the headers message
+                        vHeaders.push_back(pindex->GetBlockHeader());
+                    } else if (PeerHasHeader(&state, pindex)) {
+                        continue; // keep looking for the first new block
+                    } else if (pindex->pprev == NULL || PeerHasHeader(&state, pindex->pprev)) {
+                        // Peer doesn't have this header but they do have the prior one.
+                        // Start sending headers.
+                        fFoundStartingHeader = true;
+                        vHeaders.push_back(pindex->GetBlockHeader());
+                    } else {
+                        // Peer doesn't have this header or the prior one -- nothing will
+                        // connect, so bail out.
+                        fRevertToInv = true;
+                        break;
+                    }
+                }
+            }
+            if (!fRevertToInv && !vHeaders.empty()) {
+                std::shared_ptr<const CBlockHeaderAndShortTxIDs> pcmpctblock;
+                if (vHeaders.size() == 1 && state.fPreferHeaderAndIDs && pBestIndex == chainActive.Tip()) {
+                    // Peers in BIP 152 high-bandwidth mode get our new tip as a
+                    // cmpctblock. We only send a single block this way, as more
+                    // probably means the peer is still syncing or slow.
+                    pcmpctblock = GetCompactTip();
+                }
+                if (pcmpctblock) {
+                    LogPrint("net", "%s: sending header-and-ids %s to peer=%d\n", __func__,
+                            vHeaders.front().GetHash().ToString(), pto->id);
+                    pto->PushMessage("cmpctblock", *pcmpctblock);
+                    state.pindexBestHeaderSent = pBestIndex;
+                } else if (state.fPreferHeaders) {
+                    if (vHeaders.size() > 1) {
+                        LogPrint("net", "%s: %u headers, range (%s, %s), to peer=%d\n", __func__,
+                                vHeaders.size(),
+                                vHeaders.front().GetHash().ToString(),
+                                vHeaders.back().GetHash().ToString(), pto->id);
+                    } else {
+                        LogPrint("net", "%s: sending header %s to peer=%d\n", __func__,
+                                vHeaders.front().GetHash().ToString(), pto->id);
+                    }
+                    pto->PushMessage("headers", vHeaders);
+                    state.pindexBestHeaderSent = pBestIndex;
+                } else {
+                    fRevertToInv = true;
+                }
+            }
+            if (fRevertToInv) {
+                // If falling back to using an inv, just try to inv the tip.
+                // The last entry in vBlockHashesToAnnounce was our tip at some point
+                // in the past.
+                if (!pto->vBlockHashesToAnnounce.empty()) {
+                    const uint256 &hashToAnnounce = pto->vBlockHashesToAnnounce.back();
+                    BlockMap::iterator mi = mapBlockIndex.find(hashToAnnounce);
+                    assert(mi != mapBlockIndex.end());
+                    CBlockIndex *pindex = mi->second;
+
+                    // Warn if we're announcing a block that is not on the main chain.
+                    // This should be very rare and could be optimized out.
+                    // Just log for now.
+                    if (chainActive[pindex->nHeight] != pindex) {
+                        LogPrint("net", "Announcing block %s not on main chain (tip=%s)\n",
+                            hashToAnnounce.ToString(), chainActive.Tip()->GetBlockHash().ToString());
+                    }
+
+                    // If the peer announced this block to us, don't inv it back.
+                    // (Since block announcements may not be via inv's, we can't solely rely on
+                    // setInventoryKnown to track this.)
+                    if (!PeerHasHeader(&state, pindex)) {
+                        pto->PushInventory(CInv(MSG_BLOCK, hashToAnnounce));
+                        LogPrint("net", "%s: sending inv peer=%d hash=%s\n", __func__,
+                            pto->id, hashToAnnounce.ToString());
+                    }
+                }
+            }
+            pto->vBlockHashesToAnnounce.clear();
+        }
+
         //
         // Message: inventory
         //
@@ -6183,6 +7344,7 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
                 if (pto->setInventoryKnown.count(inv))
                     continue;
 
+
                 // trickle out tx inv to protect privacy
                 if (inv.type == MSG_TX && !fSendTrickle)
                 {
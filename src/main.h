@@ -40,9 +40,12 @@
 
 class CBlockIndex;
 class CBlockTreeDB;
+class CCoinsViewBackgroundWriter;
 class CBloomFilter;
+class CCompactBlock;
 class CInv;
 class CScriptCheck;
+class CShieldedCheck;
 class CValidationInterface;
 class CValidationState;
 class PrecomputedTransactionData;
@@ -66,6 +69,17 @@ static const unsigned int MAX_P2SH_SIGOPS = 15;
 static const unsigned int MAX_STANDARD_TX_SIGOPS = MAX_BLOCK_SIGOPS/5;
 /** Default for -minrelaytxfee, minimum relay fee for transactions */
 static const unsigned int DEFAULT_MIN_RELAY_TX_FEE = 100;
+/** Default for -maxmempool, maximum megabytes of mempool memory usage */
+static const unsigned int DEFAULT_MAX_MEMPOOL_SIZE = 300;
+/** Default for -limitancestorcount, max number of in-mempool ancestors */
+static const unsigned int DEFAULT_ANCESTOR_LIMIT = 25;
+/** Default for -limitancestorsize, maximum kilobytes of tx + all in-mempool ancestors.
+ *  Large enough that a single transaction of the maximum size is never rejected by it. */
+static const unsigned int DEFAULT_ANCESTOR_SIZE_LIMIT = MAX_TX_SIZE_AFTER_SAPLING / 1000 + 1;
+/** Default for -limitdescendantcount, max number of in-mempool descendants */
+static const unsigned int DEFAULT_DESCENDANT_LIMIT = 25;
+/** Default for -limitdescendantsize, maximum kilobytes of in-mempool descendants */
+static const unsigned int DEFAULT_DESCENDANT_SIZE_LIMIT = MAX_TX_SIZE_AFTER_SAPLING / 1000 + 1;
 /** Default for -maxorphantx, maximum number of orphan transactions kept in memory */
 static const unsigned int DEFAULT_MAX_ORPHAN_TRANSACTIONS = 100;
 /** Default for -txexpirydelta, in number of blocks */
@@ -94,6 +108,20 @@ static const unsigned int MAX_HEADERS_RESULTS = 160;
  *  degree of disordering of blocks on disk (which make reindexing and in the future perhaps pruning
  *  harder). We'll probably want to make this a per-peer adaptive value at some point. */
 static const unsigned int BLOCK_DOWNLOAD_WINDOW = 1024;
+/** Maximum depth of a block we answer a compact block request for; older blocks are sent in full,
+ *  as the requesting peer's mempool is unlikely to help it rebuild them. */
+static const int MAX_CMPCTBLOCK_DEPTH = 5;
+/** Maximum depth of a block we serve individual transactions of in reply to a getblocktxn. */
+static const int MAX_BLOCKTXN_DEPTH = 10;
+/** Maximum number of headers to announce when relaying blocks with headers message.*/
+static const unsigned int MAX_BLOCKS_TO_ANNOUNCE = 8;
+/** Maximum number of unconnecting headers announcements before DoS score */
+static const int MAX_UNCONNECTING_HEADERS = 10;
+/** Number of peers we ask to announce new blocks to us as unsolicited cmpctblock messages (BIP 152). */
+static const unsigned int MAX_HB_CMPCTBLOCK_PEERS = 3;
+/** Total size of the serialized blocks kept in memory after being sent to a peer, so that the
+ *  same block requested by several peers is only read from disk once. */
+static const unsigned int MAX_RAW_BLOCK_CACHE_SIZE = 16 * 1000 * 1000;
 /** Time to wait (in seconds) between writing blocks/block index to disk. */
 static const unsigned int DATABASE_WRITE_INTERVAL = 60 * 60;
 /** Time to wait (in seconds) between flushing chainstate to disk. */
@@ -101,6 +129,10 @@ static const unsigned int DATABASE_FLUSH_INTERVAL = 24 * 60 * 60;
 /** Maximum length of reject messages. */
 static const unsigned int MAX_REJECT_MESSAGE_LENGTH = 111;
 static const int64_t DEFAULT_MAX_TIP_AGE = 24 * 60 * 60;
+/** Default for -compactblockindex */
+static const bool DEFAULT_COMPACTBLOCKINDEX = false;
+/** Maximum number of compact blocks returned by one REST or RPC request. */
+static const unsigned int MAX_COMPACT_BLOCKS_RESULTS = 1000;
 
 // Sanity check the magic numbers when we change them
 BOOST_STATIC_ASSERT(DEFAULT_BLOCK_MAX_SIZE <= MAX_BLOCK_SIZE);
@@ -131,6 +163,7 @@ extern bool fImporting;
 extern bool fReindex;
 extern int nScriptCheckThreads;
 extern bool fTxIndex;
+extern bool fCompactBlockIndex;
 extern bool fIsBareMultisigStd;
 extern bool fCheckBlockIndex;
 extern bool fCheckpointsEnabled;
@@ -213,6 +246,12 @@ bool ProcessMessages(CNode* pfrom);
 bool SendMessages(CNode* pto, bool fSendTrickle);
 /** Run an instance of the script checking thread */
 void ThreadScriptCheck();
+/** Run an instance of the shielded proof checking thread */
+void ThreadShieldedCheck();
+/** Run an instance of the block input prefetching thread */
+void ThreadCoinsPrefetch();
+/** Run an instance of the message precheck thread */
+void ThreadMessagePrecheck();
 /** Try to detect Partition (network isolation) attacks against us */
 void PartitionCheck(bool (*initialDownloadCheck)(), CCriticalSection& cs, const CBlockIndex *const &bestHeader, int64_t nPowTargetSpacing);
 /** Check whether we are doing an initial block download (synchronizing from disk or network) */
@@ -260,7 +299,7 @@ void PruneAndFlush();
 
 /** (try to) add transaction to memory pool **/
 bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransaction &tx, bool fLimitFree,
-                        bool* pfMissingInputs, bool fRejectAbsurdFee=false);
+                        bool* pfMissingInputs, bool fRejectAbsurdFee=false, bool fOverrideMempoolLimit=false);
 
 
 struct CNodeStateStats {
@@ -344,9 +383,14 @@ bool ContextualCheckInputs(const CTransaction& tx, CValidationState &state, cons
                            const Consensus::Params& consensusParams, uint32_t consensusBranchId,
                            std::vector<CScriptCheck> *pvChecks = NULL);
 
-/** Check a transaction contextually against a set of consensus rules */
+/**
+ * Check a transaction contextually against a set of consensus rules.
+ * If pvChecks is not NULL, joinSplitSig and Sapling proof and signature
+ * checks are pushed onto it instead of being performed inline.
+ */
 bool ContextualCheckTransaction(const CTransaction& tx, CValidationState &state, int nHeight, int dosLevel,
-                                bool (*isInitBlockDownload)() = IsInitialBlockDownload);
+                                bool (*isInitBlockDownload)() = IsInitialBlockDownload,
+                                std::vector<CShieldedCheck> *pvChecks = NULL);
 
 /** Apply the effects of this transaction on the UTXO set represented by view */
 void UpdateCoins(const CTransaction& tx, CCoinsViewCache& inputs, int nHeight);
@@ -356,6 +400,12 @@ void UpdateCoins(const CTransaction& tx, CCoinsViewCache& inputs, int nHeight);
 /** Context-independent validity checks */
 bool CheckTransaction(const CTransaction& tx, CValidationState& state, libzcash::ProofVerifier& verifier);
 bool CheckTransactionWithoutProofVerification(const CTransaction& tx, CValidationState &state);
+/**
+ * Verify the JoinSplit proofs of a transaction. If pvChecks is not NULL,
+ * proof checks are pushed onto it instead of being performed inline.
+ */
+bool CheckJoinSplitProofs(const CTransaction& tx, CValidationState& state, libzcash::ProofVerifier& verifier,
+                          std::vector<CShieldedCheck> *pvChecks = NULL);
 
 /** Check for standard transaction types
  * @return True if all outputs (scriptPubKeys) use only standard transaction forms
@@ -419,8 +469,8 @@ private:
 
 public:
     CScriptCheck(): amount(0), ptxTo(0), nIn(0), nFlags(0), cacheStore(false), consensusBranchId(0), error(SCRIPT_ERR_UNKNOWN_ERROR) {}
-    CScriptCheck(const CCoins& txFromIn, const CTransaction& txToIn, unsigned int nInIn, unsigned int nFlagsIn, bool cacheIn, uint32_t consensusBranchIdIn, PrecomputedTransactionData* txdataIn) :
-        scriptPubKey(txFromIn.vout[txToIn.vin[nInIn].prevout.n].scriptPubKey), amount(txFromIn.vout[txToIn.vin[nInIn].prevout.n].nValue),
+    CScriptCheck(const CTxOut& outIn, const CTransaction& txToIn, unsigned int nInIn, unsigned int nFlagsIn, bool cacheIn, uint32_t consensusBranchIdIn, PrecomputedTransactionData* txdataIn) :
+        scriptPubKey(outIn.scriptPubKey), amount(outIn.nValue),
         ptxTo(&txToIn), nIn(nInIn), nFlags(nFlagsIn), cacheStore(cacheIn), consensusBranchId(consensusBranchIdIn), error(SCRIPT_ERR_UNKNOWN_ERROR), txdata(txdataIn) { }
 
     bool operator()();
@@ -440,11 +490,93 @@ public:
     ScriptError GetScriptError() const { return error; }
 };
 
+/**
+ * Closure representing the verification of shielded components: the proof
+ * of a single JoinSplit, the joinSplitSig of a transaction, or all Sapling
+ * spend and output proofs of a transaction together with its spendAuth and
+ * binding signatures.
+ * Note that this stores references to the transaction and the verifier.
+ */
+class CShieldedCheck
+{
+public:
+    enum Type {
+        NONE,
+        SPROUT_PROOF,
+        JOINSPLIT_SIG,
+        SAPLING
+    };
+
+private:
+    Type type;
+    const CTransaction *ptx;
+    unsigned int nJoinSplit;
+    libzcash::ProofVerifier *pverifier;
+    uint256 dataToBeSigned;
+
+public:
+    CShieldedCheck(): type(NONE), ptx(0), nJoinSplit(0), pverifier(0) {}
+    CShieldedCheck(const CTransaction& txIn, unsigned int nJoinSplitIn, libzcash::ProofVerifier& verifierIn) :
+        type(SPROUT_PROOF), ptx(&txIn), nJoinSplit(nJoinSplitIn), pverifier(&verifierIn) { }
+    CShieldedCheck(const CTransaction& txIn, const uint256& dataToBeSignedIn, Type typeIn) :
+        type(typeIn), ptx(&txIn), nJoinSplit(0), pverifier(0), dataToBeSigned(dataToBeSignedIn) { }
+
+    bool operator()();
+
+    void swap(CShieldedCheck &check) {
+        std::swap(type, check.type);
+        std::swap(ptx, check.ptx);
+        std::swap(nJoinSplit, check.nJoinSplit);
+        std::swap(pverifier, check.pverifier);
+        std::swap(dataToBeSigned, check.dataToBeSigned);
+    }
+};
+
+/**
+ * Closure representing the lookup of a coin or nullifier in a view that
+ * supports concurrent reads, used to load the inputs of a block before it is
+ * connected. The result is stored through the given pointer; a coin that is
+ * not found is left spent.
+ */
+class CCoinsPrefetch
+{
+private:
+    const CCoinsView *pview;
+    COutPoint outpoint;
+    Coin *pcoin;
+    uint256 nullifier;
+    ShieldedType type;
+    bool *pfSpent;
+
+public:
+    CCoinsPrefetch(): pview(0), pcoin(0), type(SPROUT), pfSpent(0) {}
+    CCoinsPrefetch(const CCoinsView& viewIn, const COutPoint& outpointIn, Coin& coinIn) :
+        pview(&viewIn), outpoint(outpointIn), pcoin(&coinIn), type(SPROUT), pfSpent(0) { }
+    CCoinsPrefetch(const CCoinsView& viewIn, const uint256& nullifierIn, ShieldedType typeIn, bool& fSpentIn) :
+        pview(&viewIn), pcoin(0), nullifier(nullifierIn), type(typeIn), pfSpent(&fSpentIn) { }
+
+    bool operator()();
+
+    void swap(CCoinsPrefetch &check) {
+        std::swap(pview, check.pview);
+        std::swap(outpoint, check.outpoint);
+        std::swap(pcoin, check.pcoin);
+        std::swap(nullifier, check.nullifier);
+        std::swap(type, check.type);
+        std::swap(pfSpent, check.pfSpent);
+    }
+};
+
 
 /** Functions for disk access for blocks */
 bool WriteBlockToDisk(CBlock& block, CDiskBlockPos& pos, const CMessageHeader::MessageStartChars& messageStart);
 bool ReadBlockFromDisk(CBlock& block, const CDiskBlockPos& pos);
 bool ReadBlockFromDisk(CBlock& block, const CBlockIndex* pindex);
+/** Read a block's serialized bytes as stored on disk, without deserializing its transactions. */
+bool ReadRawBlockFromDisk(std::vector<unsigned char>& block, const CBlockIndex* pindex, const CMessageHeader::MessageStartChars& messageStart);
+/** Read the compact record of a block, from the compact block index if it is
+ *  maintained and has an entry, or else by deriving it from the full block. */
+bool ReadCompactBlock(CCompactBlock& block, const CBlockIndex* pindex);
 
 
 /** Functions for validating blocks and updating the block tree */
@@ -570,6 +702,9 @@ extern CChain chainActive;
 /** Global variable that points to the active CCoinsView (protected by cs_main) */
 extern CCoinsViewCache *pcoinsTip;
 
+/** Global variable that points to the view writing flushed coins to disk (protected by cs_main) */
+extern CCoinsViewBackgroundWriter *pcoinswriter;
+
 /** Global variable that points to the active block tree (protected by cs_main) */
 extern CBlockTreeDB *pblocktree;
 
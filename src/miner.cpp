@@ -34,8 +34,8 @@
 
 #include "sodium.h"
 
+#include <boost/bind.hpp>
 #include <boost/thread.hpp>
-#include <boost/tuple/tuple.hpp>
 #ifdef ENABLE_MINING
 #include <functional>
 #endif
@@ -48,52 +48,259 @@ using namespace std;
 // BitcoinMiner
 //
 
-//
-// Unconfirmed transactions in the memory pool often depend on other
-// transactions in the memory pool. When we select transactions from the
-// pool, we select by highest priority or fee rate, so we might consider
-// transactions that depend on transactions that aren't yet in the block.
-// The COrphan class keeps track of these 'temporary orphans' while
-// CreateBlock is figuring out which transactions to include.
-//
-class COrphan
+uint64_t nLastBlockTx = 0;
+uint64_t nLastBlockSize = 0;
+CAmount nLongPollFeeThreshold = DEFAULT_LONGPOLL_FEE_THRESHOLD;
+
+/**
+ * The mempool transactions that block templates are assembled from, ranked
+ * by priority and by fee rate. The ranking is kept up to date from the
+ * mempool's add/remove notifications, so CreateNewBlock only looks at the
+ * best candidates instead of visiting (and looking up the inputs of) every
+ * transaction in the pool.
+ *
+ * Priority is the same input-based priority as before: sum(valuein * age)
+ * over the confirmed transparent inputs, divided by the modified size, plus
+ * any PrioritiseTransaction delta. The value and height of each confirmed
+ * input are looked up once and cached. They only change when an in-mempool
+ * parent is confirmed or a confirmed one returns to the mempool, and both
+ * show up as notifications for the parent, so only its spenders are looked
+ * up again. A new tip ages every input, so the priority ranking is then
+ * recomputed from the cached inputs; the fee rate ranking never needs
+ * rebuilding. Both rankings break ties by txid, so the same mempool always
+ * gives the same template.
+ *
+ * All members are guarded by mempool.cs, which the mempool already holds
+ * when it notifies us.
+ */
+class CBlockCandidates
 {
 public:
-    const CTransaction* ptx;
-    set<uint256> setDependsOn;
-    CFeeRate feeRate;
-    double dPriority;
+    struct Candidate;
+
+    template <typename T>
+    struct RankCompare
+    {
+        bool operator()(const std::pair<T, uint256>& a, const std::pair<T, uint256>& b) const
+        {
+            if (a.first == b.first)
+                return a.second < b.second;
+            return a.first > b.first;
+        }
+    };
+    typedef std::map<std::pair<double, uint256>, Candidate*, RankCompare<double> > PriorityMap;
+    typedef std::map<std::pair<CFeeRate, uint256>, Candidate*, RankCompare<CFeeRate> > FeeRateMap;
+
+    struct Candidate
+    {
+        const CTxMemPoolEntry* pentry; //! owned by mempool.mapTx
+        CFeeRate feeRate;              //! including any PrioritiseTransaction delta
+        double dPriorityDelta;
+        CAmount nFeeDelta;
+        std::vector<std::pair<CAmount, int> > vConfirmedIn; //! value and height of confirmed inputs
+        PriorityMap::iterator itPriority; //! end() until the inputs have been looked up
+        FeeRateMap::iterator itFeeRate;
+
+        const CTransaction& GetTx() const { return pentry->GetTx(); }
+        double GetPriority() const { return itPriority->first.first; }
+    };
+
+private:
+    CTxMemPool& pool;
+    std::map<uint256, Candidate> mapCandidates;
+    std::map<uint256, std::set<Candidate*> > mapSpenders; //! by the txid of an input
+    std::set<Candidate*> setStale; //! inputs to be looked up
+    PriorityMap mapByPriority;
+    FeeRateMap mapByFeeRate;
+    unsigned int nPrioritised;
+    const CBlockIndex* pindexRanked;
+    int nRankedHeight;
+    boost::signals2::scoped_connection connAdded;
+    boost::signals2::scoped_connection connRemoved;
+
+    static bool IsPrioritised(const Candidate& candidate)
+    {
+        return candidate.dPriorityDelta > 0 || candidate.nFeeDelta > 0;
+    }
+
+    void MarkStale(Candidate& candidate)
+    {
+        if (candidate.itPriority != mapByPriority.end()) {
+            mapByPriority.erase(candidate.itPriority);
+            candidate.itPriority = mapByPriority.end();
+        }
+        setStale.insert(&candidate);
+    }
+
+    // The inputs spending outputs of hash just became confirmed or unconfirmed.
+    void MarkSpendersStale(const uint256& hash)
+    {
+        std::map<uint256, std::set<Candidate*> >::iterator it = mapSpenders.find(hash);
+        if (it == mapSpenders.end())
+            return;
+        BOOST_FOREACH(Candidate* pcandidate, it->second)
+            MarkStale(*pcandidate);
+    }
+
+    void LookupInputs(Candidate& candidate, const CCoinsViewCache& view) const
+    {
+        // Inputs spending in-mempool outputs add nothing.
+        candidate.vConfirmedIn.clear();
+        BOOST_FOREACH(const CTxIn& txin, candidate.GetTx().vin)
+        {
+            const Coin& coin = view.AccessCoin(txin.prevout);
+            if (!coin.IsSpent())
+                candidate.vConfirmedIn.push_back(std::make_pair(coin.out.nValue, (int)coin.nHeight));
+        }
+    }
+
+    double PriorityAt(const Candidate& candidate, int nHeight) const
+    {
+        double dPriority = 0;
+        for (size_t i = 0; i < candidate.vConfirmedIn.size(); i++)
+            dPriority += (double)candidate.vConfirmedIn[i].first * (nHeight - candidate.vConfirmedIn[i].second);
+        return candidate.GetTx().ComputePriority(dPriority, candidate.pentry->GetTxSize()) + candidate.dPriorityDelta;
+    }
+
+    void InsertPriority(Candidate& candidate, int nHeight)
+    {
+        candidate.itPriority = mapByPriority.insert(std::make_pair(
+            std::make_pair(PriorityAt(candidate, nHeight), candidate.GetTx().GetHash()), &candidate)).first;
+    }
+
+    void EntryAdded(const CTxMemPoolEntry& entry)
+    {
+        const CTransaction& tx = entry.GetTx();
+        const uint256& hash = tx.GetHash();
+        EntryRemoved(entry);
+        Candidate& candidate = mapCandidates[hash];
+        candidate.pentry = &entry;
+        candidate.dPriorityDelta = 0;
+        candidate.nFeeDelta = 0;
+        pool.ApplyDeltas(hash, candidate.dPriorityDelta, candidate.nFeeDelta);
+        if (IsPrioritised(candidate))
+            nPrioritised++;
+        candidate.feeRate = CFeeRate(entry.GetModifiedFee(), entry.GetTxSize());
+        candidate.itPriority = mapByPriority.end();
+        setStale.insert(&candidate);
+        candidate.itFeeRate = mapByFeeRate.insert(std::make_pair(std::make_pair(candidate.feeRate, hash), &candidate)).first;
+        BOOST_FOREACH(const CTxIn& txin, tx.vin)
+            mapSpenders[txin.prevout.hash].insert(&candidate);
+        MarkSpendersStale(hash);
+    }
+
+    void EntryRemoved(const CTxMemPoolEntry& entry)
+    {
+        const CTransaction& tx = entry.GetTx();
+        std::map<uint256, Candidate>::iterator it = mapCandidates.find(tx.GetHash());
+        if (it == mapCandidates.end())
+            return;
+        Candidate& candidate = it->second;
+        if (IsPrioritised(candidate))
+            nPrioritised--;
+        if (candidate.itPriority != mapByPriority.end())
+            mapByPriority.erase(candidate.itPriority);
+        setStale.erase(&candidate);
+        mapByFeeRate.erase(candidate.itFeeRate);
+        BOOST_FOREACH(const CTxIn& txin, tx.vin) {
+            std::map<uint256, std::set<Candidate*> >::iterator itSpenders = mapSpenders.find(txin.prevout.hash);
+            if (itSpenders == mapSpenders.end())
+                continue;
+            itSpenders->second.erase(&candidate);
+            if (itSpenders->second.empty())
+                mapSpenders.erase(itSpenders);
+        }
+        mapCandidates.erase(it);
+        MarkSpendersStale(tx.GetHash());
+    }
+
+public:
+    CBlockCandidates(CTxMemPool& poolIn) : pool(poolIn), nPrioritised(0), pindexRanked(NULL), nRankedHeight(0)
+    {
+        LOCK(pool.cs);
+        connAdded = pool.NotifyEntryAdded.connect(boost::bind(&CBlockCandidates::EntryAdded, this, _1));
+        connRemoved = pool.NotifyEntryRemoved.connect(boost::bind(&CBlockCandidates::EntryRemoved, this, _1));
+        for (CTxMemPool::indexed_transaction_set::iterator mi = pool.mapTx.begin(); mi != pool.mapTx.end(); ++mi) {
+            EntryAdded(*mi);
+        }
+    }
 
-    COrphan(const CTransaction* ptxIn) : ptx(ptxIn), feeRate(0), dPriority(0)
+    /** Rank by the priority transactions will have in a block on top of pindexPrev. */
+    void Rank(const CCoinsViewCache& view, const CBlockIndex* pindexPrev)
     {
+        AssertLockHeld(cs_main);
+        AssertLockHeld(pool.cs);
+        const int nHeight = pindexPrev->nHeight + 1;
+        if (pindexPrev != pindexRanked || nHeight != nRankedHeight) {
+            // Every input has aged, but only the stale ones need looking up.
+            pindexRanked = pindexPrev;
+            nRankedHeight = nHeight;
+            mapByPriority.clear();
+            for (std::map<uint256, Candidate>::iterator it = mapCandidates.begin(); it != mapCandidates.end(); ++it) {
+                Candidate& candidate = it->second;
+                if (setStale.count(&candidate))
+                    candidate.itPriority = mapByPriority.end();
+                else
+                    InsertPriority(candidate, nHeight);
+            }
+        }
+        BOOST_FOREACH(Candidate* pcandidate, setStale) {
+            LookupInputs(*pcandidate, view);
+            InsertPriority(*pcandidate, nHeight);
+        }
+        setStale.clear();
+    }
+
+    const Candidate* Find(const uint256& hash) const
+    {
+        std::map<uint256, Candidate>::const_iterator it = mapCandidates.find(hash);
+        return it == mapCandidates.end() ? NULL : &it->second;
     }
+
+    /** Whether any candidate has a positive PrioritiseTransaction delta. */
+    bool HasPrioritised() const { return nPrioritised > 0; }
+
+    const PriorityMap& ByPriority() const { return mapByPriority; }
+    const FeeRateMap& ByFeeRate() const { return mapByFeeRate; }
 };
 
-uint64_t nLastBlockTx = 0;
-uint64_t nLastBlockSize = 0;
+static CBlockCandidates& GetBlockCandidates()
+{
+    // Constructed on first use, and destroyed before the global mempool it
+    // listens to.
+    static CBlockCandidates candidates(mempool);
+    return candidates;
+}
 
-// We want to sort transactions by priority and fee rate, so:
-typedef boost::tuple<double, CFeeRate, const CTransaction*> TxPriority;
-class TxPriorityCompare
+// Candidates that had to wait for an in-mempool parent are queued in a heap,
+// ordered by priority or fee rate like the candidate they are merged with,
+// and then by txid like the rankings.
+class CandidateCompare
 {
     bool byFee;
 
 public:
-    TxPriorityCompare(bool _byFee) : byFee(_byFee) { }
+    CandidateCompare(bool _byFee) : byFee(_byFee) { }
 
-    bool operator()(const TxPriority& a, const TxPriority& b)
+    bool operator()(const CBlockCandidates::Candidate* a, const CBlockCandidates::Candidate* b) const
     {
         if (byFee)
         {
-            if (a.get<1>() == b.get<1>())
-                return a.get<0>() < b.get<0>();
-            return a.get<1>() < b.get<1>();
+            if (a->feeRate == b->feeRate) {
+                if (a->GetPriority() == b->GetPriority())
+                    return b->GetTx().GetHash() < a->GetTx().GetHash();
+                return a->GetPriority() < b->GetPriority();
+            }
+            return a->feeRate < b->feeRate;
         }
         else
         {
-            if (a.get<0>() == b.get<0>())
-                return a.get<1>() < b.get<1>();
-            return a.get<0>() < b.get<0>();
+            if (a->GetPriority() == b->GetPriority()) {
+                if (a->feeRate == b->feeRate)
+                    return b->GetTx().GetHash() < a->GetTx().GetHash();
+                return a->feeRate < b->feeRate;
+            }
+            return a->GetPriority() < b->GetPriority();
         }
     }
 };
@@ -157,115 +364,97 @@ CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn)
         SaplingMerkleTree sapling_tree;
         assert(view.GetSaplingAnchorAt(view.GetBestAnchor(SAPLING), sapling_tree));
 
-        // Priority order to process transactions
-        list<COrphan> vOrphan; // list memory doesn't move
-        map<uint256, vector<COrphan*> > mapDependers;
+        int64_t nLockTimeCutoff = (STANDARD_LOCKTIME_VERIFY_FLAGS & LOCKTIME_MEDIAN_TIME_PAST)
+                                ? nMedianTimePast
+                                : pblock->GetBlockTime();
         bool fPrintPriority = GetBoolArg("-printpriority", false);
 
-        // This vector will be sorted into a priority queue:
-        vector<TxPriority> vecPriority;
-        vecPriority.reserve(mempool.mapTx.size());
-        for (CTxMemPool::indexed_transaction_set::iterator mi = mempool.mapTx.begin();
-             mi != mempool.mapTx.end(); ++mi)
-        {
-            const CTransaction& tx = mi->GetTx();
-
-            int64_t nLockTimeCutoff = (STANDARD_LOCKTIME_VERIFY_FLAGS & LOCKTIME_MEDIAN_TIME_PAST)
-                                    ? nMedianTimePast
-                                    : pblock->GetBlockTime();
-
-            if (tx.IsCoinBase() || !IsFinalTx(tx, nHeight, nLockTimeCutoff) || IsExpiredTx(tx, nHeight))
-                continue;
-
-            COrphan* porphan = NULL;
-            double dPriority = 0;
-            CAmount nTotalIn = 0;
-            bool fMissingInputs = false;
-            BOOST_FOREACH(const CTxIn& txin, tx.vin)
-            {
-                // Read prev transaction
-                if (!view.HaveCoins(txin.prevout.hash))
-                {
-                    // This should never happen; all transactions in the memory
-                    // pool should connect to either transactions in the chain
-                    // or other transactions in the memory pool.
-                    if (!mempool.mapTx.count(txin.prevout.hash))
-                    {
-                        LogPrintf("ERROR: mempool transaction missing input\n");
-                        if (fDebug) assert("mempool transaction missing input" == 0);
-                        fMissingInputs = true;
-                        if (porphan)
-                            vOrphan.pop_back();
-                        break;
-                    }
-
-                    // Has to wait for dependencies
-                    if (!porphan)
-                    {
-                        // Use list for automatic deletion
-                        vOrphan.push_back(COrphan(&tx));
-                        porphan = &vOrphan.back();
-                    }
-                    mapDependers[txin.prevout.hash].push_back(porphan);
-                    porphan->setDependsOn.insert(txin.prevout.hash);
-                    nTotalIn += mempool.mapTx.find(txin.prevout.hash)->GetTx().vout[txin.prevout.n].nValue;
-                    continue;
-                }
-                const CCoins* coins = view.AccessCoins(txin.prevout.hash);
-                assert(coins);
-
-                CAmount nValueIn = coins->vout[txin.prevout.n].nValue;
-                nTotalIn += nValueIn;
-
-                int nConf = nHeight - coins->nHeight;
-
-                dPriority += (double)nValueIn * nConf;
-            }
-            nTotalIn += tx.GetShieldedValueIn();
-
-            if (fMissingInputs) continue;
-
-            // Priority is sum(valuein * age) / modified_txsize
-            unsigned int nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
-            dPriority = tx.ComputePriority(dPriority, nTxSize);
-
-            uint256 hash = tx.GetHash();
-            mempool.ApplyDeltas(hash, dPriority, nTotalIn);
-
-            CFeeRate feeRate(nTotalIn-tx.GetValueOut(), nTxSize);
+        CBlockCandidates& candidates = GetBlockCandidates();
+        candidates.Rank(view, pindexPrev);
 
-            if (porphan)
-            {
-                porphan->dPriority = dPriority;
-                porphan->feeRate = feeRate;
-            }
-            else
-                vecPriority.push_back(TxPriority(dPriority, feeRate, &(mi->GetTx())));
-        }
+        // Candidates are visited best first, from the priority ranking until
+        // the priority area is full and then from the fee rate ranking. Ones
+        // that spend an output of an in-mempool transaction not yet in the
+        // block wait in mapDependers until it has been added.
+        std::set<const CBlockCandidates::Candidate*> setVisited;
+        std::set<uint256> setInBlock;
+        std::map<uint256, std::vector<const CBlockCandidates::Candidate*> > mapDependers;
+        std::map<const CBlockCandidates::Candidate*, size_t> mapWaitingOn;
+        std::vector<const CBlockCandidates::Candidate*> vecReady;
 
         // Collect transactions into block
         uint64_t nBlockSize = 1000;
         uint64_t nBlockTx = 0;
         int nBlockSigOps = 100;
+        int nLastFewTxs = 0;
         bool fSortedByFee = (nBlockPrioritySize <= 0);
 
-        TxPriorityCompare comparer(fSortedByFee);
-        std::make_heap(vecPriority.begin(), vecPriority.end(), comparer);
+        CandidateCompare comparer(fSortedByFee);
+        CBlockCandidates::PriorityMap::const_iterator itPriority = candidates.ByPriority().begin();
+        CBlockCandidates::FeeRateMap::const_iterator itFeeRate = candidates.ByFeeRate().begin();
 
-        while (!vecPriority.empty())
+        while (true)
         {
-            // Take highest priority transaction off the priority queue:
-            double dPriority = vecPriority.front().get<0>();
-            CFeeRate feeRate = vecPriority.front().get<1>();
-            const CTransaction& tx = *(vecPriority.front().get<2>());
+            // Take the best candidate, either from the ranking or from those
+            // whose parents have been added in the meantime.
+            const CBlockCandidates::Candidate* pcandidate = NULL;
+            if (!fSortedByFee) {
+                while (itPriority != candidates.ByPriority().end() && setVisited.count(itPriority->second))
+                    ++itPriority;
+                if (itPriority != candidates.ByPriority().end())
+                    pcandidate = itPriority->second;
+            } else {
+                while (itFeeRate != candidates.ByFeeRate().end() && setVisited.count(itFeeRate->second))
+                    ++itFeeRate;
+                if (itFeeRate != candidates.ByFeeRate().end())
+                    pcandidate = itFeeRate->second;
+            }
+            if (!vecReady.empty() && (!pcandidate || comparer(pcandidate, vecReady.front()))) {
+                pcandidate = vecReady.front();
+                std::pop_heap(vecReady.begin(), vecReady.end(), comparer);
+                vecReady.pop_back();
+            } else if (pcandidate) {
+                setVisited.insert(pcandidate);
+            } else {
+                break;
+            }
+
+            const CTransaction& tx = pcandidate->GetTx();
+            const uint256& hash = tx.GetHash();
+            double dPriority = pcandidate->GetPriority();
+            CFeeRate feeRate = pcandidate->feeRate;
+
+            if (tx.IsCoinBase() || !IsFinalTx(tx, nHeight, nLockTimeCutoff) || IsExpiredTx(tx, nHeight))
+                continue;
 
-            std::pop_heap(vecPriority.begin(), vecPriority.end(), comparer);
-            vecPriority.pop_back();
+            // Has to wait for in-mempool parents that aren't in the block yet
+            if (!mapWaitingOn.count(pcandidate)) {
+                std::set<uint256> setParents;
+                BOOST_FOREACH(const CTxIn& txin, tx.vin) {
+                    if (!setInBlock.count(txin.prevout.hash) && candidates.Find(txin.prevout.hash))
+                        setParents.insert(txin.prevout.hash);
+                }
+                if (!setParents.empty()) {
+                    BOOST_FOREACH(const uint256& parent, setParents)
+                        mapDependers[parent].push_back(pcandidate);
+                    mapWaitingOn[pcandidate] = setParents.size();
+                    continue;
+                }
+            }
 
             // Size limits
-            unsigned int nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
+            unsigned int nTxSize = pcandidate->pentry->GetTxSize();
             if (nBlockSize + nTxSize >= nBlockMaxSize)
+            {
+                // Once the block is within 100 bytes of full, or 50 more
+                // transactions haven't fit in its last 1000 bytes, stop
+                // looking further down the rankings (as Bitcoin Core does).
+                if (nBlockSize > nBlockMaxSize - 100 || nLastFewTxs > 50)
+                    break;
+                if (nBlockSize > nBlockMaxSize - 1000)
+                    nLastFewTxs++;
                 continue;
+            }
 
             // Legacy limits on sigOps:
             unsigned int nTxSigOps = GetLegacySigOpCount(tx);
@@ -273,12 +462,15 @@ CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn)
                 continue;
 
             // Skip free transactions if we're past the minimum block size:
-            const uint256& hash = tx.GetHash();
-            double dPriorityDelta = 0;
-            CAmount nFeeDelta = 0;
-            mempool.ApplyDeltas(hash, dPriorityDelta, nFeeDelta);
-            if (fSortedByFee && (dPriorityDelta <= 0) && (nFeeDelta <= 0) && (feeRate < ::minRelayTxFee) && (nBlockSize + nTxSize >= nBlockMinSize))
+            if (fSortedByFee && (pcandidate->dPriorityDelta <= 0) && (pcandidate->nFeeDelta <= 0) && (feeRate < ::minRelayTxFee) && (nBlockSize + nTxSize >= nBlockMinSize))
+            {
+                // Nothing after this one pays a higher fee rate, so once the
+                // block is past the minimum size every remaining candidate
+                // would be skipped too, unless it has been prioritised.
+                if (nBlockSize >= nBlockMinSize && !candidates.HasPrioritised())
+                    break;
                 continue;
+            }
 
             // Prioritise by fee once past the priority size or we run out of high-priority
             // transactions:
@@ -286,8 +478,8 @@ CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn)
                 ((nBlockSize + nTxSize >= nBlockPrioritySize) || !AllowFree(dPriority)))
             {
                 fSortedByFee = true;
-                comparer = TxPriorityCompare(fSortedByFee);
-                std::make_heap(vecPriority.begin(), vecPriority.end(), comparer);
+                comparer = CandidateCompare(fSortedByFee);
+                std::make_heap(vecReady.begin(), vecReady.end(), comparer);
             }
 
             if (!view.HaveInputs(tx))
@@ -321,6 +513,7 @@ CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn)
             ++nBlockTx;
             nBlockSigOps += nTxSigOps;
             nFees += nTxFees;
+            setInBlock.insert(hash);
 
             if (fPrintPriority)
             {
@@ -328,21 +521,19 @@ CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn)
                     dPriority, feeRate.ToString(), tx.GetHash().ToString());
             }
 
-            // Add transactions that depend on this one to the priority queue
-            if (mapDependers.count(hash))
+            // Queue transactions that were waiting for this one
+            std::map<uint256, std::vector<const CBlockCandidates::Candidate*> >::iterator itDependers = mapDependers.find(hash);
+            if (itDependers != mapDependers.end())
             {
-                BOOST_FOREACH(COrphan* porphan, mapDependers[hash])
+                BOOST_FOREACH(const CBlockCandidates::Candidate* pdepender, itDependers->second)
                 {
-                    if (!porphan->setDependsOn.empty())
+                    if (--mapWaitingOn[pdepender] == 0)
                     {
-                        porphan->setDependsOn.erase(hash);
-                        if (porphan->setDependsOn.empty())
-                        {
-                            vecPriority.push_back(TxPriority(porphan->dPriority, porphan->feeRate, porphan->ptx));
-                            std::push_heap(vecPriority.begin(), vecPriority.end(), comparer);
-                        }
+                        vecReady.push_back(pdepender);
+                        std::push_heap(vecReady.begin(), vecReady.end(), comparer);
                     }
                 }
+                mapDependers.erase(itDependers);
             }
         }
 
@@ -6,6 +6,7 @@
 #ifndef BITCOIN_MINER_H
 #define BITCOIN_MINER_H
 
+#include "amount.h"
 #include "primitives/block.h"
 
 #include <boost/optional.hpp>
@@ -19,6 +20,11 @@ class CWallet;
 #endif
 namespace Consensus { struct Params; };
 
+/** Default for -longpollfeethreshold */
+static const CAmount DEFAULT_LONGPOLL_FEE_THRESHOLD = COIN / 1000;
+/** Fees that must be added to the mempool before getblocktemplate long-polls are answered early */
+extern CAmount nLongPollFeeThreshold;
+
 struct CBlockTemplate
 {
     CBlock block;
@@ -49,6 +49,9 @@ using namespace std;
 
 namespace {
     const int MAX_OUTBOUND_CONNECTIONS = 8;
+#ifdef USE_EPOLL
+    const int MAX_EPOLL_EVENTS = 256;
+#endif
 
     struct ListenSocket {
         SOCKET socket;
@@ -70,6 +73,9 @@ static bool vfLimited[NET_MAX] = {};
 static CNode* pnodeLocalHost = NULL;
 uint64_t nLocalHostNonce = 0;
 static std::vector<ListenSocket> vhListenSocket;
+#ifdef USE_EPOLL
+static int epollfd = -1;
+#endif
 CAddrMan addrman;
 int nMaxConnections = DEFAULT_MAX_PEER_CONNECTIONS;
 bool fAddressesInitialized = false;
@@ -353,6 +359,25 @@ CNode* FindNode(const CService& addr)
     return NULL;
 }
 
+/**
+ * Start watching a new peer's socket in the socket handler's poller.
+ * Node sockets are edge-triggered: an event only tells us a socket became
+ * readable or writable, and ThreadSocketHandler keeps servicing it until a
+ * read or write would block.
+ */
+static void WatchNodeSocket(CNode* pnode)
+{
+#ifdef USE_EPOLL
+    struct epoll_event event;
+    event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    event.data.ptr = pnode;
+    if (epollfd == -1 || epoll_ctl(epollfd, EPOLL_CTL_ADD, pnode->hSocket, &event) != 0) {
+        LogPrintf("failed to watch socket for peer=%d: %s\n", pnode->id, NetworkErrorString(errno));
+        pnode->CloseSocketDisconnect();
+    }
+#endif
+}
+
 CNode* ConnectNode(CAddress addrConnect, const char *pszDest)
 {
     if (pszDest == NULL) {
@@ -390,6 +415,7 @@ CNode* ConnectNode(CAddress addrConnect, const char *pszDest)
         // Add node
         CNode* pnode = new CNode(hSocket, addrConnect, pszDest ? pszDest : "", false);
         pnode->AddRef();
+        WatchNodeSocket(pnode);
 
         {
             LOCK(cs_vNodes);
@@ -414,6 +440,12 @@ void CNode::CloseSocketDisconnect()
     if (hSocket != INVALID_SOCKET)
     {
         LogPrint("net", "disconnecting peer=%d\n", id);
+#ifdef USE_EPOLL
+        // Deregister explicitly: a duplicated descriptor (e.g. in a forked
+        // child) would otherwise keep the socket in the epoll set.
+        if (epollfd != -1)
+            epoll_ctl(epollfd, EPOLL_CTL_DEL, hSocket, NULL);
+#endif
         CloseSocket(hSocket);
     }
 
@@ -962,6 +994,7 @@ static void AcceptConnection(const ListenSocket& hListenSocket) {
     CNode* pnode = new CNode(hSocket, addr, "", true);
     pnode->AddRef();
     pnode->fWhitelisted = whitelisted;
+    WatchNodeSocket(pnode);
 
     LogPrint("net", "connection from %s accepted\n", addr.ToString());
 
@@ -971,9 +1004,84 @@ static void AcceptConnection(const ListenSocket& hListenSocket) {
     }
 }
 
+/**
+ * Read one buffer's worth of data from a peer's socket into its receive
+ * queue. Clears fPendingRecv once the socket has nothing more to give.
+ *
+ * @return true if any bytes were read.
+ */
+static bool SocketRecvData(CNode* pnode)
+{
+    // typical socket buffer is 8K-64K
+    char pchBuf[0x10000];
+    int nBytes = recv(pnode->hSocket, pchBuf, sizeof(pchBuf), MSG_DONTWAIT);
+    if (nBytes > 0)
+    {
+        if (!pnode->ReceiveMsgBytes(pchBuf, nBytes))
+            pnode->CloseSocketDisconnect();
+        pnode->nLastRecv = GetTime();
+        pnode->nRecvBytes += nBytes;
+        pnode->RecordBytesRecv(nBytes);
+        return true;
+    }
+
+    if (nBytes == 0)
+    {
+        // socket closed gracefully
+        if (!pnode->fDisconnect)
+            LogPrint("net", "socket closed\n");
+        pnode->fPendingRecv = false;
+        pnode->CloseSocketDisconnect();
+    }
+    else
+    {
+        // error
+        int nErr = WSAGetLastError();
+        // An interrupted read hasn't drained the socket, so stay pending.
+        if (nErr != WSAEINTR)
+            pnode->fPendingRecv = false;
+        if (nErr != WSAEWOULDBLOCK && nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS)
+        {
+            if (!pnode->fDisconnect)
+                LogPrintf("socket recv error %s\n", NetworkErrorString(nErr));
+            pnode->CloseSocketDisconnect();
+        }
+    }
+    return false;
+}
+
+static void InactivityCheck(CNode* pnode)
+{
+    int64_t nTime = GetTime();
+    if (nTime - pnode->nTimeConnected > 60)
+    {
+        if (pnode->nLastRecv == 0 || pnode->nLastSend == 0)
+        {
+            LogPrint("net", "socket no message in first 60 seconds, %d %d from %d\n", pnode->nLastRecv != 0, pnode->nLastSend != 0, pnode->id);
+            pnode->fDisconnect = true;
+        }
+        else if (nTime - pnode->nLastSend > TIMEOUT_INTERVAL)
+        {
+            LogPrintf("socket sending timeout: %is\n", nTime - pnode->nLastSend);
+            pnode->fDisconnect = true;
+        }
+        else if (nTime - pnode->nLastRecv > (pnode->nVersion > BIP0031_VERSION ? TIMEOUT_INTERVAL : 90*60))
+        {
+            LogPrintf("socket receive timeout: %is\n", nTime - pnode->nLastRecv);
+            pnode->fDisconnect = true;
+        }
+        else if (pnode->nPingNonceSent && pnode->nPingUsecStart + TIMEOUT_INTERVAL * 1000000 < GetTimeMicros())
+        {
+            LogPrintf("ping timeout: %fs\n", 0.000001 * (GetTimeMicros() - pnode->nPingUsecStart));
+            pnode->fDisconnect = true;
+        }
+    }
+}
+
 void ThreadSocketHandler()
 {
     unsigned int nPrevNodeCount = 0;
+    bool fProgress = false;
     while (true)
     {
         //
@@ -1040,11 +1148,64 @@ void ThreadSocketHandler()
         }
 
         //
-        // Find which sockets have data to receive
+        // Wait for socket readiness
         //
+#ifdef USE_EPOLL
+        // Only block if the last pass moved no data; otherwise sockets that
+        // are still readable or writable need servicing straight away.
+        struct epoll_event events[MAX_EPOLL_EVENTS];
+        int nEvents = epoll_wait(epollfd, events, MAX_EPOLL_EVENTS, fProgress ? 0 : 50);
+        boost::this_thread::interruption_point();
+
+        if (nEvents < 0)
+        {
+            if (errno != EINTR)
+            {
+                LogPrintf("socket epoll_wait error %s\n", NetworkErrorString(errno));
+                MilliSleep(50);
+            }
+            nEvents = 0;
+        }
+
+        // Nodes are only deleted by this thread, after their socket has been
+        // removed from the epoll set, so every pointer reported here is live.
+        bool fAcceptReady = false;
+        for (int i = 0; i < nEvents; i++)
+        {
+            CNode* pnode = static_cast<CNode*>(events[i].data.ptr);
+            if (pnode == NULL) {
+                fAcceptReady = true;
+                continue;
+            }
+            if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+                pnode->fPendingRecv = true;
+            if (events[i].events & EPOLLOUT)
+                pnode->fPendingSend = true;
+        }
+
+        //
+        // Accept new connections
+        //
+        if (fAcceptReady)
+        {
+            BOOST_FOREACH(const ListenSocket& hListenSocket, vhListenSocket)
+            {
+                if (hListenSocket.socket != INVALID_SOCKET)
+                    AcceptConnection(hListenSocket);
+            }
+        }
+
+        vector<CNode*> vNodesCopy;
+        {
+            LOCK(cs_vNodes);
+            vNodesCopy = vNodes;
+            BOOST_FOREACH(CNode* pnode, vNodesCopy)
+                pnode->AddRef();
+        }
+#else
         struct timeval timeout;
         timeout.tv_sec  = 0;
-        timeout.tv_usec = 50000; // frequency to poll pnode->vSend
+        timeout.tv_usec = fProgress ? 0 : 50000; // frequency to poll pnode->vSend
 
         fd_set fdsetRecv;
         fd_set fdsetSend;
@@ -1132,103 +1293,77 @@ void ThreadSocketHandler()
             }
         }
 
-        //
-        // Service each socket
-        //
         vector<CNode*> vNodesCopy;
         {
             LOCK(cs_vNodes);
             vNodesCopy = vNodes;
             BOOST_FOREACH(CNode* pnode, vNodesCopy)
+            {
                 pnode->AddRef();
+                if (pnode->hSocket == INVALID_SOCKET)
+                    continue;
+                pnode->fPendingRecv = FD_ISSET(pnode->hSocket, &fdsetRecv) || FD_ISSET(pnode->hSocket, &fdsetError);
+                pnode->fPendingSend = FD_ISSET(pnode->hSocket, &fdsetSend);
+            }
         }
+#endif
+
+        //
+        // Service each socket
+        //
+        fProgress = false;
         BOOST_FOREACH(CNode* pnode, vNodesCopy)
         {
             boost::this_thread::interruption_point();
 
             //
-            // Receive
+            // Send
             //
             if (pnode->hSocket == INVALID_SOCKET)
                 continue;
-            if (FD_ISSET(pnode->hSocket, &fdsetRecv) || FD_ISSET(pnode->hSocket, &fdsetError))
+            if (pnode->fPendingSend)
             {
-                TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
-                if (lockRecv)
+                TRY_LOCK(pnode->cs_vSend, lockSend);
+                if (lockSend && !pnode->vSendMsg.empty())
                 {
-                    {
-                        // typical socket buffer is 8K-64K
-                        char pchBuf[0x10000];
-                        int nBytes = recv(pnode->hSocket, pchBuf, sizeof(pchBuf), MSG_DONTWAIT);
-                        if (nBytes > 0)
-                        {
-                            if (!pnode->ReceiveMsgBytes(pchBuf, nBytes))
-                                pnode->CloseSocketDisconnect();
-                            pnode->nLastRecv = GetTime();
-                            pnode->nRecvBytes += nBytes;
-                            pnode->RecordBytesRecv(nBytes);
-                        }
-                        else if (nBytes == 0)
-                        {
-                            // socket closed gracefully
-                            if (!pnode->fDisconnect)
-                                LogPrint("net", "socket closed\n");
-                            pnode->CloseSocketDisconnect();
-                        }
-                        else if (nBytes < 0)
-                        {
-                            // error
-                            int nErr = WSAGetLastError();
-                            if (nErr != WSAEWOULDBLOCK && nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS)
-                            {
-                                if (!pnode->fDisconnect)
-                                    LogPrintf("socket recv error %s\n", NetworkErrorString(nErr));
-                                pnode->CloseSocketDisconnect();
-                            }
-                        }
-                    }
+                    uint64_t nSendBytesBefore = pnode->nSendBytes;
+                    SocketSendData(pnode);
+                    if (pnode->nSendBytes != nSendBytesBefore)
+                        fProgress = true;
+                    // Whatever is left over would block; wait to be told
+                    // the socket is writable again.
+                    if (!pnode->vSendMsg.empty())
+                        pnode->fPendingSend = false;
                 }
             }
 
             //
-            // Send
+            // Receive
             //
+            // Drain the send queue before receiving more, so a peer that
+            // isn't reading what we send is held back by TCP flow control.
+            // This holds while we wait for EPOLLOUT too: fPendingRecv stays
+            // set, and receiving resumes once the queue is empty.
             if (pnode->hSocket == INVALID_SOCKET)
                 continue;
-            if (FD_ISSET(pnode->hSocket, &fdsetSend))
+            bool fSendQueued = false;
             {
                 TRY_LOCK(pnode->cs_vSend, lockSend);
-                if (lockSend)
-                    SocketSendData(pnode);
+                fSendQueued = lockSend && !pnode->vSendMsg.empty();
             }
-
-            //
-            // Inactivity checking
-            //
-            int64_t nTime = GetTime();
-            if (nTime - pnode->nTimeConnected > 60)
+            if (pnode->fPendingRecv && !fSendQueued)
             {
-                if (pnode->nLastRecv == 0 || pnode->nLastSend == 0)
-                {
-                    LogPrint("net", "socket no message in first 60 seconds, %d %d from %d\n", pnode->nLastRecv != 0, pnode->nLastSend != 0, pnode->id);
-                    pnode->fDisconnect = true;
-                }
-                else if (nTime - pnode->nLastSend > TIMEOUT_INTERVAL)
-                {
-                    LogPrintf("socket sending timeout: %is\n", nTime - pnode->nLastSend);
-                    pnode->fDisconnect = true;
-                }
-                else if (nTime - pnode->nLastRecv > (pnode->nVersion > BIP0031_VERSION ? TIMEOUT_INTERVAL : 90*60))
-                {
-                    LogPrintf("socket receive timeout: %is\n", nTime - pnode->nLastRecv);
-                    pnode->fDisconnect = true;
-                }
-                else if (pnode->nPingNonceSent && pnode->nPingUsecStart + TIMEOUT_INTERVAL * 1000000 < GetTimeMicros())
+                TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
+                if (lockRecv && (
+                    pnode->vRecvMsg.empty() || !pnode->vRecvMsg.front().complete() ||
+                    pnode->GetTotalRecvSize() <= ReceiveFloodSize()))
                 {
-                    LogPrintf("ping timeout: %fs\n", 0.000001 * (GetTimeMicros() - pnode->nPingUsecStart));
-                    pnode->fDisconnect = true;
+                    if (SocketRecvData(pnode))
+                        fProgress = true;
                 }
             }
+
+            InactivityCheck(pnode);
         }
         {
             LOCK(cs_vNodes);
@@ -1522,6 +1657,11 @@ bool OpenNetworkConnection(const CAddress& addrConnect, CSemaphoreGrant *grantOu
 }
 
 
+void WakeMessageHandler()
+{
+    messageHandlerCondition.notify_one();
+}
+
 void ThreadMessageHandler()
 {
     boost::mutex condition_mutex;
@@ -1561,7 +1701,7 @@ void ThreadMessageHandler()
 
                     if (pnode->nSendSize < SendBufferSize())
                     {
-                        if (!pnode->vRecvGetData.empty() || (!pnode->vRecvMsg.empty() && pnode->vRecvMsg[0].complete()))
+                        if (!pnode->vRecvGetData.empty() || (!pnode->vRecvMsg.empty() && pnode->vRecvMsg[0].complete() && !pnode->fWaitingForPrecheck))
                         {
                             fSleep = false;
                         }
@@ -1769,6 +1909,23 @@ void StartNode(boost::thread_group& threadGroup, CScheduler& scheduler)
 
     Discover(threadGroup);
 
+#ifdef USE_EPOLL
+    if (epollfd == -1) {
+        epollfd = epoll_create1(EPOLL_CLOEXEC);
+        if (epollfd == -1)
+            LogPrintf("epoll_create1 failed: %s\n", NetworkErrorString(errno));
+        // Listen sockets are level-triggered and carry no node; an event on
+        // one just means "call accept()".
+        BOOST_FOREACH(const ListenSocket& hListenSocket, vhListenSocket) {
+            struct epoll_event event;
+            event.events = EPOLLIN;
+            event.data.ptr = NULL;
+            if (epollfd != -1 && epoll_ctl(epollfd, EPOLL_CTL_ADD, hListenSocket.socket, &event) != 0)
+                LogPrintf("failed to watch listen socket: %s\n", NetworkErrorString(errno));
+        }
+    }
+#endif
+
     //
     // Start threads
     //
@@ -1834,6 +1991,11 @@ public:
         vNodes.clear();
         vNodesDisconnected.clear();
         vhListenSocket.clear();
+#ifdef USE_EPOLL
+        if (epollfd != -1)
+            close(epollfd);
+        epollfd = -1;
+#endif
         delete semOutbound;
         semOutbound = NULL;
         delete pnodeLocalHost;
@@ -2080,6 +2242,9 @@ CNode::CNode(SOCKET hSocketIn, const CAddress& addrIn, const std::string& addrNa
     fNetworkNode = false;
     fSuccessfullyConnected = false;
     fDisconnect = false;
+    fPendingRecv = false;
+    fPendingSend = false;
+    fWaitingForPrecheck = false;
     nRefCount = 0;
     nSendSize = 0;
     nSendOffset = 0;
@@ -78,6 +78,8 @@ bool BindListenPort(const CService &bindAddr, std::string& strError, bool fWhite
 void StartNode(boost::thread_group& threadGroup, CScheduler& scheduler);
 bool StopNode();
 void SocketSendData(CNode *pnode);
+/** Wake the message handler thread, e.g. when a message it was waiting on is ready. */
+void WakeMessageHandler();
 
 typedef int NodeId;
 
@@ -276,6 +278,13 @@ public:
     bool fNetworkNode;
     bool fSuccessfullyConnected;
     bool fDisconnect;
+    // Socket readiness as last reported by the socket handler's poller. Only
+    // touched by ThreadSocketHandler; cleared once a read or write would block.
+    bool fPendingRecv;
+    bool fPendingSend;
+    // Set by the message handler while the next message is being checked on
+    // another thread, so it doesn't spin waiting for it.
+    bool fWaitingForPrecheck;
     // We use fRelayTxes for two purposes -
     // a) it allows us to not relay tx invs before receiving the peer's version message
     // b) the peer may tell us in its version message that we should not relay tx invs
@@ -316,6 +325,8 @@ public:
     mruset<CInv> setInventoryKnown;
     std::vector<CInv> vInventoryToSend;
     CCriticalSection cs_inventory;
+    // Block hashes to announce to this peer, as headers or inv, in SendMessages.
+    std::vector<uint256> vBlockHashesToAnnounce;
     std::set<uint256> setAskFor;
     std::multimap<int64_t, CInv> mapAskFor;
 
@@ -426,6 +437,12 @@ public:
         }
     }
 
+    void PushBlockHash(const uint256 &hash)
+    {
+        LOCK(cs_inventory);
+        vBlockHashesToAnnounce.push_back(hash);
+    }
+
     void AskFor(const CInv& inv);
 
     // TODO: Document the postcondition of this function.  Is cs_vSend locked?
@@ -0,0 +1,43 @@
+// Copyright (c) 2018 The Zcash developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "primitives/compactblock.h"
+
+#include <algorithm>
+
+CCompactSaplingOutput::CCompactSaplingOutput(const OutputDescription& output) :
+    cm(output.cm), epk(output.ephemeralKey)
+{
+    std::copy(output.encCiphertext.begin(),
+              output.encCiphertext.begin() + COMPACT_NOTE_SIZE,
+              ciphertext.begin());
+}
+
+CCompactTx::CCompactTx(uint32_t nIndexIn, const CTransaction& tx) :
+    nIndex(nIndexIn), hash(tx.GetHash())
+{
+    vSpends.reserve(tx.vShieldedSpend.size());
+    for (const SpendDescription& spend : tx.vShieldedSpend) {
+        vSpends.push_back(CCompactSaplingSpend(spend));
+    }
+    vOutputs.reserve(tx.vShieldedOutput.size());
+    for (const OutputDescription& output : tx.vShieldedOutput) {
+        vOutputs.push_back(CCompactSaplingOutput(output));
+    }
+}
+
+CCompactBlock::CCompactBlock(const CBlock& block, uint32_t nHeightIn)
+{
+    SetNull();
+    nHeight = nHeightIn;
+    hash = block.GetHash();
+    hashPrevBlock = block.hashPrevBlock;
+    nTime = block.nTime;
+    for (size_t i = 0; i < block.vtx.size(); i++) {
+        const CTransaction& tx = block.vtx[i];
+        if (tx.vShieldedSpend.empty() && tx.vShieldedOutput.empty())
+            continue;
+        vtx.push_back(CCompactTx(i, tx));
+    }
+}
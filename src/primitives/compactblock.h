@@ -0,0 +1,135 @@
+// Copyright (c) 2018 The Zcash developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_PRIMITIVES_COMPACTBLOCK_H
+#define BITCOIN_PRIMITIVES_COMPACTBLOCK_H
+
+#include "primitives/block.h"
+#include "serialize.h"
+#include "uint256.h"
+#include "zcash/Zcash.h"
+
+#include <array>
+#include <vector>
+
+/** Leading bytes of a Sapling encCiphertext that are enough to trial-decrypt
+ * the note plaintext (lead byte, diversifier, value and rcm), without the memo.
+ */
+static const size_t COMPACT_NOTE_SIZE = ZC_NOTEPLAINTEXT_LEADING + ZC_DIVERSIFIER_SIZE + ZC_V_SIZE + ZC_R_SIZE;
+
+/** The nullifier of a Sapling SpendDescription. */
+class CCompactSaplingSpend
+{
+public:
+    uint256 nf;
+
+    CCompactSaplingSpend() { }
+    explicit CCompactSaplingSpend(const SpendDescription& spend) : nf(spend.nullifier) { }
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action) {
+        READWRITE(nf);
+    }
+};
+
+/** The parts of a Sapling OutputDescription a wallet needs to detect and
+ * witness its incoming notes.
+ */
+class CCompactSaplingOutput
+{
+public:
+    uint256 cm;
+    uint256 epk;
+    std::array<unsigned char, COMPACT_NOTE_SIZE> ciphertext;
+
+    CCompactSaplingOutput() { ciphertext.fill(0); }
+    explicit CCompactSaplingOutput(const OutputDescription& output);
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action) {
+        READWRITE(cm);
+        READWRITE(epk);
+        READWRITE(ciphertext);
+    }
+};
+
+/** The shielded parts of a transaction, along with its position in the block. */
+class CCompactTx
+{
+public:
+    uint32_t nIndex;
+    uint256 hash;
+    std::vector<CCompactSaplingSpend> vSpends;
+    std::vector<CCompactSaplingOutput> vOutputs;
+
+    CCompactTx() : nIndex(0) { }
+    CCompactTx(uint32_t nIndexIn, const CTransaction& tx);
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action) {
+        READWRITE(nIndex);
+        READWRITE(hash);
+        READWRITE(vSpends);
+        READWRITE(vOutputs);
+    }
+};
+
+/** A block stripped down to what a light wallet needs to scan it: the header
+ * fields that chain blocks together and, for every transaction with Sapling
+ * spends or outputs, its nullifiers and compact outputs. Transactions without
+ * Sapling components are omitted.
+ */
+class CCompactBlock
+{
+public:
+    static const int32_t CURRENT_VERSION = 1;
+    int32_t nVersion;
+    uint32_t nHeight;
+    uint256 hash;
+    uint256 hashPrevBlock;
+    uint32_t nTime;
+    std::vector<CCompactTx> vtx;
+
+    CCompactBlock()
+    {
+        SetNull();
+    }
+
+    CCompactBlock(const CBlock& block, uint32_t nHeightIn);
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action) {
+        READWRITE(this->nVersion);
+        READWRITE(nHeight);
+        READWRITE(hash);
+        READWRITE(hashPrevBlock);
+        READWRITE(nTime);
+        READWRITE(vtx);
+    }
+
+    void SetNull()
+    {
+        nVersion = CCompactBlock::CURRENT_VERSION;
+        nHeight = 0;
+        hash.SetNull();
+        hashPrevBlock.SetNull();
+        nTime = 0;
+        vtx.clear();
+    }
+
+    bool IsNull() const
+    {
+        return hash.IsNull();
+    }
+};
+
+#endif // BITCOIN_PRIMITIVES_COMPACTBLOCK_H
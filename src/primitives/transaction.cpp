@@ -21,7 +21,9 @@ JSDescription::JSDescription(
     CAmount vpub_old,
     CAmount vpub_new,
     bool computeProof,
-    uint256 *esk // payment disclosure
+    uint256 *esk, // payment disclosure
+    std::array<libzcash::SproutNote, ZC_NUM_JS_OUTPUTS> *out_notes,
+    uint252 *phi
 ) : vpub_old(vpub_old), vpub_new(vpub_new), anchor(anchor)
 {
     std::array<libzcash::SproutNote, ZC_NUM_JS_OUTPUTS> notes;
@@ -42,8 +44,13 @@ JSDescription::JSDescription(
         vpub_new,
         anchor,
         computeProof,
-        esk // payment disclosure
+        esk, // payment disclosure
+        phi
     );
+
+    if (out_notes != nullptr) {
+        *out_notes = notes;
+    }
 }
 
 JSDescription JSDescription::Randomized(
@@ -59,7 +66,9 @@ JSDescription JSDescription::Randomized(
     CAmount vpub_new,
     bool computeProof,
     uint256 *esk, // payment disclosure
-    std::function<int(int)> gen
+    std::function<int(int)> gen,
+    std::array<libzcash::SproutNote, ZC_NUM_JS_OUTPUTS> *notes,
+    uint252 *phi
 )
 {
     // Randomize the order of the inputs and outputs
@@ -75,7 +84,29 @@ JSDescription JSDescription::Randomized(
         makeGrothProof,
         params, joinSplitPubKey, anchor, inputs, outputs,
         vpub_old, vpub_new, computeProof,
-        esk // payment disclosure
+        esk, // payment disclosure
+        notes, phi
+    );
+}
+
+void JSDescription::ProveNotes(
+    bool makeGrothProof,
+    ZCJoinSplit& params,
+    const uint256& joinSplitPubKey,
+    const std::array<libzcash::JSInput, ZC_NUM_JS_INPUTS>& inputs,
+    const std::array<libzcash::SproutNote, ZC_NUM_JS_OUTPUTS>& notes,
+    const uint252& phi
+)
+{
+    proof = params.prove_notes(
+        makeGrothProof,
+        inputs,
+        notes,
+        phi,
+        h_sig(params, joinSplitPubKey),
+        vpub_old,
+        vpub_new,
+        anchor
     );
 }
 
@@ -236,7 +236,9 @@ public:
             CAmount vpub_old,
             CAmount vpub_new,
             bool computeProof = true, // Set to false in some tests
-            uint256 *esk = nullptr // payment disclosure
+            uint256 *esk = nullptr, // payment disclosure
+            std::array<libzcash::SproutNote, ZC_NUM_JS_OUTPUTS> *notes = nullptr, // for ProveNotes
+            uint252 *phi = nullptr // for ProveNotes
     );
 
     static JSDescription Randomized(
@@ -252,7 +254,21 @@ public:
             CAmount vpub_new,
             bool computeProof = true, // Set to false in some tests
             uint256 *esk = nullptr, // payment disclosure
-            std::function<int(int)> gen = GetRandInt
+            std::function<int(int)> gen = GetRandInt,
+            std::array<libzcash::SproutNote, ZC_NUM_JS_OUTPUTS> *notes = nullptr, // for ProveNotes
+            uint252 *phi = nullptr // for ProveNotes
+    );
+
+    // Creates the proof of a JoinSplit that was constructed with
+    // computeProof = false, from the inputs it was given and the output
+    // notes and phi it returned.
+    void ProveNotes(
+            bool makeGrothProof,
+            ZCJoinSplit& params,
+            const uint256& joinSplitPubKey,
+            const std::array<libzcash::JSInput, ZC_NUM_JS_INPUTS>& inputs,
+            const std::array<libzcash::SproutNote, ZC_NUM_JS_OUTPUTS>& notes,
+            const uint252& phi
     );
 
     // Verifies that the JoinSplit proof is correct.
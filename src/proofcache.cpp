@@ -0,0 +1,114 @@
+// Copyright (c) 2018 The Zcash developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "proofcache.h"
+
+#include "crypto/common.h"
+#include "crypto/sha256.h"
+#include "memusage.h"
+#include "random.h"
+#include "util.h"
+
+#include <boost/thread.hpp>
+#include <boost/unordered_set.hpp>
+
+namespace {
+
+/**
+ * We're hashing a nonce into the entries themselves, so we don't need extra
+ * blinding in the set hash computation.
+ */
+class CProofCacheHasher
+{
+public:
+    size_t operator()(const uint256& key) const {
+        return key.GetCheapHash();
+    }
+};
+
+class CProofCache
+{
+private:
+     //! Entries are SHA256(nonce || txid || consensus branch ID):
+    uint256 nonce;
+    typedef boost::unordered_set<uint256, CProofCacheHasher> map_type;
+    map_type setValid;
+    boost::shared_mutex cs_proofcache;
+
+public:
+    CProofCache()
+    {
+        GetRandBytes(nonce.begin(), 32);
+    }
+
+    void
+    ComputeEntry(uint256& entry, const uint256& txid, uint32_t consensusBranchId)
+    {
+        unsigned char branchId[4];
+        WriteLE32(branchId, consensusBranchId);
+        CSHA256().Write(nonce.begin(), 32).Write(txid.begin(), 32).Write(branchId, 4).Finalize(entry.begin());
+    }
+
+    bool
+    Get(const uint256& entry)
+    {
+        boost::shared_lock<boost::shared_mutex> lock(cs_proofcache);
+        return setValid.count(entry);
+    }
+
+    void Erase(const uint256& entry)
+    {
+        boost::unique_lock<boost::shared_mutex> lock(cs_proofcache);
+        setValid.erase(entry);
+    }
+
+    void Set(const uint256& entry)
+    {
+        size_t nMaxCacheSize = GetArg("-maxproofcachesize", DEFAULT_MAX_PROOF_CACHE_SIZE) * ((size_t) 1 << 20);
+        if (nMaxCacheSize <= 0) return;
+
+        boost::unique_lock<boost::shared_mutex> lock(cs_proofcache);
+        while (memusage::DynamicUsage(setValid) > nMaxCacheSize)
+        {
+            map_type::size_type s = GetRand(setValid.bucket_count());
+            map_type::local_iterator it = setValid.begin(s);
+            if (it != setValid.end(s)) {
+                setValid.erase(*it);
+            }
+        }
+
+        setValid.insert(entry);
+    }
+};
+
+CProofCache& GetProofCache()
+{
+    static CProofCache proofCache;
+    return proofCache;
+}
+
+}
+
+bool GetCachedShieldedValidity(const uint256& txid, uint32_t consensusBranchId, bool erase)
+{
+    CProofCache& proofCache = GetProofCache();
+    uint256 entry;
+    proofCache.ComputeEntry(entry, txid, consensusBranchId);
+
+    if (proofCache.Get(entry)) {
+        if (erase) {
+            proofCache.Erase(entry);
+        }
+        return true;
+    }
+    return false;
+}
+
+void SetCachedShieldedValidity(const uint256& txid, uint32_t consensusBranchId)
+{
+    CProofCache& proofCache = GetProofCache();
+    uint256 entry;
+    proofCache.ComputeEntry(entry, txid, consensusBranchId);
+    proofCache.Set(entry);
+}
@@ -0,0 +1,33 @@
+// Copyright (c) 2018 The Zcash developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef ZCASH_PROOFCACHE_H
+#define ZCASH_PROOFCACHE_H
+
+#include "uint256.h"
+
+#include <stdint.h>
+
+// DoS prevention: limit cache size to less than 10MB (over 100000
+// entries on 64-bit systems).
+static const unsigned int DEFAULT_MAX_PROOF_CACHE_SIZE = 10;
+
+/**
+ * Valid shielded data cache, to avoid verifying the JoinSplit proofs,
+ * joinSplitSig and Sapling proofs and signatures of a transaction twice
+ * (once when accepted into the memory pool, and again when its block is
+ * validated).
+ *
+ * The txid commits to all of a transaction's shielded data, and the branch
+ * ID determines the signature hash those signatures are checked against, so
+ * together they identify a verification result.
+ */
+
+/** Whether the shielded data of txid has been verified under consensusBranchId. If erase is set, a hit is removed. */
+bool GetCachedShieldedValidity(const uint256& txid, uint32_t consensusBranchId, bool erase);
+
+/** Record that the shielded data of txid is valid under consensusBranchId. */
+void SetCachedShieldedValidity(const uint256& txid, uint32_t consensusBranchId);
+
+#endif // ZCASH_PROOFCACHE_H
@@ -154,6 +154,9 @@ enum {
     // Nodes may always request a MSG_FILTERED_BLOCK in a getdata, however,
     // MSG_FILTERED_BLOCK should not appear in any invs except as a part of getdata.
     MSG_FILTERED_BLOCK,
+    // Defined in BIP152. Like MSG_FILTERED_BLOCK it is only ever requested
+    // in a getdata, and is answered with a cmpctblock message.
+    MSG_CMPCT_BLOCK,
 };
 
 #endif // BITCOIN_PROTOCOL_H
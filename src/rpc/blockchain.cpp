@@ -9,6 +9,7 @@
 #include "checkpoints.h"
 #include "consensus/validation.h"
 #include "main.h"
+#include "primitives/compactblock.h"
 #include "primitives/transaction.h"
 #include "rpc/server.h"
 #include "streams.h"
@@ -173,6 +174,42 @@ UniValue blockToJSON(const CBlock& block, const CBlockIndex* blockindex, bool tx
     return result;
 }
 
+UniValue compactBlockToJSON(const CCompactBlock& block)
+{
+    UniValue result(UniValue::VOBJ);
+    result.push_back(Pair("hash", block.hash.GetHex()));
+    result.push_back(Pair("height", (int64_t)block.nHeight));
+    result.push_back(Pair("version", block.nVersion));
+    result.push_back(Pair("previousblockhash", block.hashPrevBlock.GetHex()));
+    result.push_back(Pair("time", (int64_t)block.nTime));
+    UniValue txs(UniValue::VARR);
+    BOOST_FOREACH(const CCompactTx& tx, block.vtx)
+    {
+        UniValue objTx(UniValue::VOBJ);
+        objTx.push_back(Pair("index", (int64_t)tx.nIndex));
+        objTx.push_back(Pair("txid", tx.hash.GetHex()));
+        UniValue spends(UniValue::VARR);
+        BOOST_FOREACH(const CCompactSaplingSpend& spend, tx.vSpends)
+        {
+            spends.push_back(spend.nf.GetHex());
+        }
+        objTx.push_back(Pair("spends", spends));
+        UniValue outputs(UniValue::VARR);
+        BOOST_FOREACH(const CCompactSaplingOutput& output, tx.vOutputs)
+        {
+            UniValue objOutput(UniValue::VOBJ);
+            objOutput.push_back(Pair("cmu", output.cm.GetHex()));
+            objOutput.push_back(Pair("ephemeralKey", output.epk.GetHex()));
+            objOutput.push_back(Pair("ciphertext", HexStr(output.ciphertext.begin(), output.ciphertext.end())));
+            outputs.push_back(objOutput);
+        }
+        objTx.push_back(Pair("outputs", outputs));
+        txs.push_back(objTx);
+    }
+    result.push_back(Pair("tx", txs));
+    return result;
+}
+
 UniValue getblockcount(const UniValue& params, bool fHelp)
 {
     if (fHelp || params.size() != 0)
@@ -507,6 +544,98 @@ UniValue getblock(const UniValue& params, bool fHelp)
     return blockToJSON(block, pblockindex, verbosity >= 2);
 }
 
+UniValue getcompactblocks(const UniValue& params, bool fHelp)
+{
+    if (fHelp || params.size() < 1 || params.size() > 3)
+        throw runtime_error(
+            "getcompactblocks height ( count verbose )\n"
+            "\nReturns the compact records of up to 'count' consecutive blocks in the best-block-chain, starting at 'height'.\n"
+            "A compact block holds, for each transaction with Sapling spends or outputs, the nullifiers of its spends and\n"
+            "the note commitment, ephemeral key and first " + strprintf("%d", COMPACT_NOTE_SIZE) + " bytes of the ciphertext of each of its outputs.\n"
+            "This is enough for a wallet to detect its notes and spends without fetching full blocks.\n"
+            "The records are read from the compact block index if -compactblockindex is set, or else derived from the blocks on disk.\n"
+            "\nArguments:\n"
+            "1. height           (numeric, required) The height of the first block\n"
+            "2. count            (numeric, optional, default=1) The number of blocks, at most " + strprintf("%u", MAX_COMPACT_BLOCKS_RESULTS) + "\n"
+            "3. verbose          (boolean, optional, default=true) true for json objects, false for hex encoded data\n"
+            "\nResult (for verbose = true):\n"
+            "[\n"
+            "  {\n"
+            "    \"hash\" : \"hash\",     (string) the block hash\n"
+            "    \"height\" : n,          (numeric) The block height\n"
+            "    \"version\" : n,         (numeric) The compact block format version\n"
+            "    \"previousblockhash\" : \"hash\",  (string) The hash of the previous block\n"
+            "    \"time\" : ttt,          (numeric) The block time in seconds since epoch (Jan 1 1970 GMT)\n"
+            "    \"tx\" : [               (array of json objects) The transactions with Sapling components\n"
+            "      {\n"
+            "        \"index\" : n,       (numeric) The position of the transaction in the block\n"
+            "        \"txid\" : \"id\",     (string) The transaction id\n"
+            "        \"spends\" : [\"nf\", ...],  (array of string) The nullifiers of the Sapling spends\n"
+            "        \"outputs\" : [      (array of json objects) The Sapling outputs\n"
+            "          {\n"
+            "            \"cmu\" : \"hex\",          (string) The note commitment\n"
+            "            \"ephemeralKey\" : \"hex\", (string) The ephemeral public key\n"
+            "            \"ciphertext\" : \"hex\"    (string) The leading bytes of the note ciphertext\n"
+            "          }, ...\n"
+            "        ]\n"
+            "      }, ...\n"
+            "    ]\n"
+            "  }, ...\n"
+            "]\n"
+            "\nResult (for verbose = false):\n"
+            "[\"data\", ...]      (array of string) The serialized, hex-encoded compact blocks\n"
+            "\nExamples:\n"
+            + HelpExampleCli("getcompactblocks", "419200 100")
+            + HelpExampleRpc("getcompactblocks", "419200, 100")
+        );
+
+    int nHeight = params[0].get_int();
+
+    int nCount = 1;
+    if (params.size() > 1)
+        nCount = params[1].get_int();
+    if (nCount < 1 || nCount > (int)MAX_COMPACT_BLOCKS_RESULTS)
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Block count out of range");
+
+    bool fVerbose = true;
+    if (params.size() > 2)
+        fVerbose = params[2].get_bool();
+
+    // Only collect the range under cs_main; reading the blocks can take a
+    // while when the compact block index is off.
+    std::vector<std::pair<const CBlockIndex*, bool> > vBlocks;
+    {
+        LOCK(cs_main);
+        if (nHeight < 0 || nHeight > chainActive.Height())
+            throw JSONRPCError(RPC_INVALID_PARAMETER, "Block height out of range");
+
+        for (const CBlockIndex* pindex = chainActive[nHeight]; pindex != NULL && nCount > 0; pindex = chainActive.Next(pindex), nCount--) {
+            bool fPruned = fHavePruned && !(pindex->nStatus & BLOCK_HAVE_DATA) && pindex->nTx > 0;
+            vBlocks.push_back(std::make_pair(pindex, fPruned));
+        }
+    }
+
+    UniValue result(UniValue::VARR);
+    for (size_t i = 0; i < vBlocks.size(); i++)
+    {
+        CCompactBlock block;
+        if (!ReadCompactBlock(block, vBlocks[i].first)) {
+            if (vBlocks[i].second)
+                throw JSONRPCError(RPC_INTERNAL_ERROR, "Block not available (pruned data)");
+            throw JSONRPCError(RPC_INTERNAL_ERROR, "Can't read block from disk");
+        }
+
+        if (fVerbose) {
+            result.push_back(compactBlockToJSON(block));
+        } else {
+            CDataStream ssBlock(SER_NETWORK, PROTOCOL_VERSION);
+            ssBlock << block;
+            result.push_back(HexStr(ssBlock.begin(), ssBlock.end()));
+        }
+    }
+    return result;
+}
+
 UniValue gettxoutsetinfo(const UniValue& params, bool fHelp)
 {
     if (fHelp || params.size() != 0)
@@ -570,7 +699,6 @@ UniValue gettxout(const UniValue& params, bool fHelp)
             "        ,...\n"
             "     ]\n"
             "  },\n"
-            "  \"version\" : n,              (numeric) The version\n"
             "  \"coinbase\" : true|false     (boolean) Coinbase or not\n"
             "}\n"
 
@@ -594,33 +722,33 @@ UniValue gettxout(const UniValue& params, bool fHelp)
     if (params.size() > 2)
         fMempool = params[2].get_bool();
 
-    CCoins coins;
+    if (n < 0)
+        return NullUniValue;
+    COutPoint out(hash, n);
+
+    Coin coin;
     if (fMempool) {
         LOCK(mempool.cs);
         CCoinsViewMemPool view(pcoinsTip, mempool);
-        if (!view.GetCoins(hash, coins))
+        if (!view.GetCoin(out, coin) || mempool.isSpent(out)) // TODO: filtering spent coins should be done by the CCoinsViewMemPool
             return NullUniValue;
-        mempool.pruneSpent(hash, coins); // TODO: this should be done by the CCoinsViewMemPool
     } else {
-        if (!pcoinsTip->GetCoins(hash, coins))
+        if (!pcoinsTip->GetCoin(out, coin))
             return NullUniValue;
     }
-    if (n<0 || (unsigned int)n>=coins.vout.size() || coins.vout[n].IsNull())
-        return NullUniValue;
 
     BlockMap::iterator it = mapBlockIndex.find(pcoinsTip->GetBestBlock());
     CBlockIndex *pindex = it->second;
     ret.push_back(Pair("bestblock", pindex->GetBlockHash().GetHex()));
-    if ((unsigned int)coins.nHeight == MEMPOOL_HEIGHT)
+    if (coin.nHeight == MEMPOOL_HEIGHT)
         ret.push_back(Pair("confirmations", 0));
     else
-        ret.push_back(Pair("confirmations", pindex->nHeight - coins.nHeight + 1));
-    ret.push_back(Pair("value", ValueFromAmount(coins.vout[n].nValue)));
+        ret.push_back(Pair("confirmations", (int64_t)(pindex->nHeight - coin.nHeight + 1)));
+    ret.push_back(Pair("value", ValueFromAmount(coin.out.nValue)));
     UniValue o(UniValue::VOBJ);
-    ScriptPubKeyToJSON(coins.vout[n].scriptPubKey, o, true);
+    ScriptPubKeyToJSON(coin.out.scriptPubKey, o, true);
     ret.push_back(Pair("scriptPubKey", o));
-    ret.push_back(Pair("version", coins.nVersion));
-    ret.push_back(Pair("coinbase", coins.fCoinBase));
+    ret.push_back(Pair("coinbase", (bool)coin.fCoinBase));
 
     return ret;
 }
@@ -925,6 +1053,9 @@ UniValue mempoolInfoToJSON()
     ret.push_back(Pair("size", (int64_t) mempool.size()));
     ret.push_back(Pair("bytes", (int64_t) mempool.GetTotalTxSize()));
     ret.push_back(Pair("usage", (int64_t) mempool.DynamicMemoryUsage()));
+    size_t maxmempool = GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000;
+    ret.push_back(Pair("maxmempool", (int64_t) maxmempool));
+    ret.push_back(Pair("mempoolminfee", ValueFromAmount(mempool.GetMinFee(maxmempool).GetFeePerK())));
 
     return ret;
 }
@@ -940,6 +1071,8 @@ UniValue getmempoolinfo(const UniValue& params, bool fHelp)
             "  \"size\": xxxxx                (numeric) Current tx count\n"
             "  \"bytes\": xxxxx               (numeric) Sum of all tx sizes\n"
             "  \"usage\": xxxxx               (numeric) Total memory usage for the mempool\n"
+            "  \"maxmempool\": xxxxx          (numeric) Maximum memory usage for the mempool\n"
+            "  \"mempoolminfee\": xxxxx       (numeric) Minimum fee rate in " + CURRENCY_UNIT + "/kB for a transaction to be accepted\n"
             "}\n"
             "\nExamples:\n"
             + HelpExampleCli("getmempoolinfo", "")
@@ -1036,6 +1169,7 @@ static const CRPCCommand commands[] =
     { "blockchain",         "getblockhash",           &getblockhash,           true  },
     { "blockchain",         "getblockheader",         &getblockheader,         true  },
     { "blockchain",         "getchaintips",           &getchaintips,           true  },
+    { "blockchain",         "getcompactblocks",       &getcompactblocks,       true  },
     { "blockchain",         "getdifficulty",          &getdifficulty,          true  },
     { "blockchain",         "getmempoolinfo",         &getmempoolinfo,         true  },
     { "blockchain",         "getrawmempool",          &getrawmempool,          true  },
@@ -72,6 +72,9 @@ static const CRPCConvertParam vRPCConvertParams[] =
     { "listunspent", 2 },
     { "getblock", 1 },
     { "getblockheader", 1 },
+    { "getcompactblocks", 0 },
+    { "getcompactblocks", 1 },
+    { "getcompactblocks", 2 },
     { "gettransaction", 1 },
     { "getrawtransaction", 1 },
     { "createrawtransaction", 0 },
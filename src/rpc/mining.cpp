@@ -25,6 +25,7 @@
 #include "wallet/wallet.h"
 #endif
 
+#include <atomic>
 #include <stdint.h>
 
 #include <boost/assign/list_of.hpp>
@@ -426,6 +427,22 @@ static UniValue BIP22ValidationResult(const CValidationState& state)
     return "valid?";
 }
 
+// getblocktemplate keeps the last template it built, keyed by the tip and the
+// mempool sequence number, and shares it between all callers. Long polls are
+// answered when the tip changes or, through the listener below, once the
+// transactions added to the mempool since that template pay at least
+// -longpollfeethreshold in fees.
+static std::atomic<CAmount> nFeesSinceTemplate(0);
+static std::atomic<bool> fTemplateFeeThresholdReached(false);
+
+static void TemplateMempoolEntryAdded(const CTxMemPoolEntry& entry)
+{
+    CAmount nFees = (nFeesSinceTemplate += entry.GetModifiedFee());
+    if (nFees >= nLongPollFeeThreshold && !fTemplateFeeThresholdReached.exchange(true)) {
+        cvBlockChange.notify_all();
+    }
+}
+
 UniValue getblocktemplate(const UniValue& params, bool fHelp)
 {
     if (fHelp || params.size() > 1)
@@ -561,6 +578,13 @@ UniValue getblocktemplate(const UniValue& params, bool fHelp)
         throw JSONRPCError(RPC_CLIENT_IN_INITIAL_DOWNLOAD, "Zcash is downloading blocks...");
 
     static unsigned int nTransactionsUpdatedLast;
+    static CBlockIndex* pindexPrev;
+    static int64_t nStart;
+    static CBlockTemplate* pblocktemplate;
+
+    static boost::signals2::scoped_connection connEntryAdded;
+    if (!connEntryAdded.connected())
+        connEntryAdded = mempool.NotifyEntryAdded.connect(&TemplateMempoolEntryAdded);
 
     if (!lpval.isNull())
     {
@@ -584,21 +608,24 @@ UniValue getblocktemplate(const UniValue& params, bool fHelp)
             nTransactionsUpdatedLastLP = nTransactionsUpdatedLast;
         }
 
+        // A client holding an older template than the cached one can have
+        // the cached one straight away.
+        bool fNewerTemplate = (hashWatchedChain == chainActive.Tip()->GetBlockHash() &&
+                               pindexPrev == chainActive.Tip() &&
+                               nTransactionsUpdatedLastLP != nTransactionsUpdatedLast);
+
         // Release the wallet and main lock while waiting
         LEAVE_CRITICAL_SECTION(cs_main);
+        if (!fNewerTemplate)
         {
-            checktxtime = boost::get_system_time() + boost::posix_time::minutes(1);
-
             boost::unique_lock<boost::mutex> lock(csBestBlock);
-            while (chainActive.Tip()->GetBlockHash() == hashWatchedChain && IsRPCRunning())
+            while (chainActive.Tip()->GetBlockHash() == hashWatchedChain &&
+                   !fTemplateFeeThresholdReached && IsRPCRunning())
             {
-                if (!cvBlockChange.timed_wait(lock, checktxtime))
-                {
-                    // Timeout: Check transactions for update
-                    if (mempool.GetTransactionsUpdated() != nTransactionsUpdatedLastLP)
-                        break;
-                    checktxtime += boost::posix_time::seconds(10);
-                }
+                // Notifications are sent without holding csBestBlock, so
+                // recheck every few seconds in case one slipped past.
+                checktxtime = boost::get_system_time() + boost::posix_time::seconds(10);
+                cvBlockChange.timed_wait(lock, checktxtime);
             }
         }
         ENTER_CRITICAL_SECTION(cs_main);
@@ -609,11 +636,9 @@ UniValue getblocktemplate(const UniValue& params, bool fHelp)
     }
 
     // Update block
-    static CBlockIndex* pindexPrev;
-    static int64_t nStart;
-    static CBlockTemplate* pblocktemplate;
     if (pindexPrev != chainActive.Tip() ||
-        (mempool.GetTransactionsUpdated() != nTransactionsUpdatedLast && GetTime() - nStart > 5))
+        (mempool.GetTransactionsUpdated() != nTransactionsUpdatedLast &&
+         (GetTime() - nStart > 5 || fTemplateFeeThresholdReached)))
     {
         // Clear pindexPrev so future calls make a new block, despite any failures from here on
         pindexPrev = NULL;
@@ -622,6 +647,10 @@ UniValue getblocktemplate(const UniValue& params, bool fHelp)
         nTransactionsUpdatedLast = mempool.GetTransactionsUpdated();
         CBlockIndex* pindexPrevNew = chainActive.Tip();
         nStart = GetTime();
+        // Transactions are only added to the mempool with cs_main held, so
+        // the new template covers everything counted so far.
+        nFeesSinceTemplate = 0;
+        fTemplateFeeThresholdReached = false;
 
         // Create new block
         if(pblocktemplate)
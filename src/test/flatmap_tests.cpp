@@ -0,0 +1,123 @@
+// Copyright (c) 2019 The Zcash developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "flatmap.h"
+#include "memusage.h"
+#include "random.h"
+#include "uint256.h"
+
+#include "test/test_bitcoin.h"
+
+#include <map>
+#include <string>
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(flatmap_tests, BasicTestingSetup)
+
+namespace {
+struct SaltedHasher
+{
+    uint256 salt;
+    SaltedHasher() : salt(GetRandHash()) {}
+    size_t operator()(const uint256& key) const { return key.GetHash(salt); }
+};
+
+typedef flatmap<uint256, std::string, SaltedHasher> testmap;
+
+void CheckEqual(const testmap& m, const std::map<uint256, std::string>& real)
+{
+    BOOST_CHECK_EQUAL(m.size(), real.size());
+    size_t n = 0;
+    for (testmap::const_iterator it = m.begin(); it != m.end(); ++it) {
+        std::map<uint256, std::string>::const_iterator rit = real.find(it->first);
+        BOOST_CHECK(rit != real.end() && rit->second == it->second);
+        n++;
+    }
+    BOOST_CHECK_EQUAL(n, real.size());
+}
+}
+
+BOOST_AUTO_TEST_CASE(flatmap_random_operations)
+{
+    std::vector<uint256> keys;
+    for (int i = 0; i < 1000; i++) {
+        keys.push_back(GetRandHash());
+    }
+
+    testmap m;
+    std::map<uint256, std::string> real;
+    for (int i = 0; i < 100000; i++) {
+        const uint256& key = keys[insecure_rand() % keys.size()];
+        std::string value = std::to_string(i);
+        switch (insecure_rand() % 5) {
+        case 0: {
+            std::pair<testmap::iterator, bool> ret = m.insert(std::make_pair(key, value));
+            std::pair<std::map<uint256, std::string>::iterator, bool> realret = real.insert(std::make_pair(key, value));
+            BOOST_CHECK_EQUAL(ret.second, realret.second);
+            BOOST_CHECK(ret.first->second == realret.first->second);
+            break;
+        }
+        case 1:
+            m[key] += value;
+            real[key] += value;
+            break;
+        case 2:
+            BOOST_CHECK_EQUAL(m.erase(key), real.erase(key));
+            break;
+        case 3: {
+            testmap::const_iterator it = m.find(key);
+            BOOST_CHECK_EQUAL(it != m.end(), real.count(key) == 1);
+            BOOST_CHECK_EQUAL(m.count(key), real.count(key));
+            break;
+        }
+        case 4:
+            if (insecure_rand() % 1000 == 0) {
+                // Erase part of the map while iterating over it.
+                for (testmap::iterator it = m.begin(); it != m.end();) {
+                    if (insecure_rand() % 2) {
+                        real.erase(it->first);
+                        m.erase(it++);
+                    } else {
+                        ++it;
+                    }
+                }
+                CheckEqual(m, real);
+            }
+            break;
+        }
+        BOOST_CHECK_EQUAL(m.size(), real.size());
+    }
+    CheckEqual(m, real);
+
+    testmap copy(m);
+    CheckEqual(copy, real);
+
+    m.clear();
+    BOOST_CHECK(m.empty());
+    BOOST_CHECK(m.begin() == m.end());
+    BOOST_CHECK_EQUAL(memusage::DynamicUsage(m), 0);
+}
+
+BOOST_AUTO_TEST_CASE(flatmap_reference_stability)
+{
+    testmap m;
+    uint256 first = GetRandHash();
+    std::string* value = &m[first];
+    *value = "first";
+    // Growing the index must not move existing values.
+    for (int i = 0; i < 10000; i++) {
+        m[GetRandHash()] = "other";
+    }
+    BOOST_CHECK(value == &m.find(first)->second);
+    BOOST_CHECK_EQUAL(*value, "first");
+
+    // Memory usage is proportional to the number of elements, not to the
+    // number of individual allocations.
+    size_t usage = memusage::DynamicUsage(m);
+    BOOST_CHECK(usage >= m.size() * sizeof(testmap::value_type));
+    BOOST_CHECK(usage <= m.size() * (sizeof(testmap::value_type) + 4 * 8) + testmap::chunk_memory() + 4096);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
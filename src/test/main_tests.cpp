@@ -101,4 +101,31 @@ BOOST_AUTO_TEST_CASE(test_combiner_all)
     BOOST_CHECK(Test());
 }
 
+BOOST_AUTO_TEST_CASE(read_raw_block_from_disk)
+{
+    // InitBlockIndex has written the genesis block to disk.
+    LOCK(cs_main);
+    const CBlockIndex* pindex = chainActive.Genesis();
+    BOOST_REQUIRE(pindex != NULL);
+
+    CBlock block;
+    BOOST_REQUIRE(ReadBlockFromDisk(block, pindex));
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << block;
+
+    std::vector<unsigned char> raw;
+    BOOST_CHECK(ReadRawBlockFromDisk(raw, pindex, Params().MessageStart()));
+    BOOST_CHECK(raw == std::vector<unsigned char>(ss.begin(), ss.end()));
+
+    // Wrong network magic
+    CMessageHeader::MessageStartChars badStart = {0, 0, 0, 0};
+    BOOST_CHECK(!ReadRawBlockFromDisk(raw, pindex, badStart));
+
+    // Index entry pointing at a different block
+    CBlockIndex index(*pindex);
+    uint256 hashOther = uint256S("01");
+    index.phashBlock = &hashOther;
+    BOOST_CHECK(!ReadRawBlockFromDisk(raw, &index, Params().MessageStart()));
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -157,6 +157,170 @@ BOOST_AUTO_TEST_CASE(MempoolIndexingTest)
     BOOST_CHECK(it == pool.mapTx.get<1>().end());
 }
 
+BOOST_AUTO_TEST_CASE(MempoolAncestorTest)
+{
+    CTxMemPool pool(CFeeRate(0));
+    TestMemPoolEntryHelper entry;
+
+    // A parent with two children, which are both spent by a grandchild:
+    //   txA -> txB -> txD
+    //   txA -> txC -> txD
+    CMutableTransaction txA = CMutableTransaction();
+    txA.vout.resize(2);
+    for (int i = 0; i < 2; i++) {
+        txA.vout[i].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+        txA.vout[i].nValue = 10 * COIN;
+    }
+    pool.addUnchecked(txA.GetHash(), entry.Fee(1000LL).FromTx(txA));
+
+    CMutableTransaction txB = CMutableTransaction();
+    txB.vin.resize(1);
+    txB.vin[0].prevout = COutPoint(txA.GetHash(), 0);
+    txB.vin[0].scriptSig = CScript() << OP_11;
+    txB.vout.resize(1);
+    txB.vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+    txB.vout[0].nValue = 10 * COIN;
+    pool.addUnchecked(txB.GetHash(), entry.Fee(10000LL).FromTx(txB));
+
+    CMutableTransaction txC = CMutableTransaction();
+    txC.vin.resize(1);
+    txC.vin[0].prevout = COutPoint(txA.GetHash(), 1);
+    txC.vin[0].scriptSig = CScript() << OP_11;
+    txC.vout.resize(1);
+    txC.vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+    txC.vout[0].nValue = 10 * COIN;
+    pool.addUnchecked(txC.GetHash(), entry.Fee(0LL).FromTx(txC));
+
+    CMutableTransaction txD = CMutableTransaction();
+    txD.vin.resize(2);
+    txD.vin[0].prevout = COutPoint(txB.GetHash(), 0);
+    txD.vin[0].scriptSig = CScript() << OP_11;
+    txD.vin[1].prevout = COutPoint(txC.GetHash(), 0);
+    txD.vin[1].scriptSig = CScript() << OP_11;
+    txD.vout.resize(1);
+    txD.vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+    txD.vout[0].nValue = 20 * COIN;
+    pool.addUnchecked(txD.GetHash(), entry.Fee(5000LL).FromTx(txD));
+    BOOST_CHECK_EQUAL(pool.size(), 4);
+
+    CTxMemPool::txiter itA = pool.mapTx.find(txA.GetHash());
+    CTxMemPool::txiter itB = pool.mapTx.find(txB.GetHash());
+    CTxMemPool::txiter itC = pool.mapTx.find(txC.GetHash());
+    CTxMemPool::txiter itD = pool.mapTx.find(txD.GetHash());
+    uint64_t sizeA = itA->GetTxSize();
+    uint64_t sizeB = itB->GetTxSize();
+    uint64_t sizeC = itC->GetTxSize();
+    uint64_t sizeD = itD->GetTxSize();
+
+    BOOST_CHECK_EQUAL(itA->GetCountWithAncestors(), 1);
+    BOOST_CHECK_EQUAL(itA->GetCountWithDescendants(), 4);
+    BOOST_CHECK_EQUAL(itA->GetSizeWithDescendants(), sizeA + sizeB + sizeC + sizeD);
+    BOOST_CHECK_EQUAL(itA->GetModFeesWithDescendants(), 16000LL);
+    BOOST_CHECK_EQUAL(itB->GetCountWithAncestors(), 2);
+    BOOST_CHECK_EQUAL(itB->GetCountWithDescendants(), 2);
+    BOOST_CHECK_EQUAL(itB->GetModFeesWithAncestors(), 11000LL);
+    BOOST_CHECK_EQUAL(itD->GetCountWithAncestors(), 4);
+    BOOST_CHECK_EQUAL(itD->GetSizeWithAncestors(), sizeA + sizeB + sizeC + sizeD);
+    BOOST_CHECK_EQUAL(itD->GetModFeesWithAncestors(), 16000LL);
+    BOOST_CHECK_EQUAL(itD->GetCountWithDescendants(), 1);
+
+    // Fee deltas are applied to the whole package.
+    pool.PrioritiseTransaction(txC.GetHash(), txC.GetHash().ToString(), 0.0, 2000LL);
+    BOOST_CHECK_EQUAL(itC->GetModifiedFee(), 2000LL);
+    BOOST_CHECK_EQUAL(itA->GetModFeesWithDescendants(), 18000LL);
+    BOOST_CHECK_EQUAL(itD->GetModFeesWithAncestors(), 18000LL);
+    BOOST_CHECK_EQUAL(itB->GetModFeesWithAncestors(), 11000LL);
+
+    // The ancestor score index is ordered by package fee rate.
+    CTxMemPool::indexed_transaction_set::index<ancestor_score>::type::iterator ait = pool.mapTx.get<ancestor_score>().begin();
+    BOOST_CHECK_EQUAL(ait->GetTx().GetHash().ToString(), txB.GetHash().ToString());
+    for (; ait != pool.mapTx.get<ancestor_score>().end(); ++ait) {
+        CTxMemPool::indexed_transaction_set::index<ancestor_score>::type::iterator next = ait;
+        if (++next == pool.mapTx.get<ancestor_score>().end())
+            break;
+        BOOST_CHECK(ait->GetModFeesWithAncestors() * next->GetSizeWithAncestors() >=
+                    next->GetModFeesWithAncestors() * ait->GetSizeWithAncestors());
+    }
+
+    // Removing txB on its own (as when it is mined) leaves txD behind with
+    // updated ancestor state.
+    std::list<CTransaction> removed;
+    pool.remove(txB, removed, false);
+    BOOST_CHECK_EQUAL(removed.size(), 1);
+    BOOST_CHECK_EQUAL(pool.size(), 3);
+    BOOST_CHECK_EQUAL(itA->GetCountWithDescendants(), 3);
+    BOOST_CHECK_EQUAL(itA->GetModFeesWithDescendants(), 8000LL);
+    BOOST_CHECK_EQUAL(itD->GetCountWithAncestors(), 3);
+    BOOST_CHECK_EQUAL(itD->GetSizeWithAncestors(), sizeA + sizeC + sizeD);
+    BOOST_CHECK_EQUAL(itD->GetModFeesWithAncestors(), 8000LL);
+
+    // Removing txA recursively takes its remaining descendants with it.
+    removed.clear();
+    pool.remove(txA, removed, true);
+    BOOST_CHECK_EQUAL(removed.size(), 3);
+    BOOST_CHECK_EQUAL(pool.size(), 0);
+}
+
+BOOST_AUTO_TEST_CASE(MempoolSizeLimitTest)
+{
+    CTxMemPool pool(CFeeRate(1000));
+    TestMemPoolEntryHelper entry;
+    entry.dPriority = 10.0;
+
+    CMutableTransaction tx1 = CMutableTransaction();
+    tx1.vout.resize(1);
+    tx1.vout[0].scriptPubKey = CScript() << OP_1 << OP_EQUAL;
+    tx1.vout[0].nValue = 10 * COIN;
+    pool.addUnchecked(tx1.GetHash(), entry.Fee(10000LL).FromTx(tx1));
+
+    // A zero-fee parent whose child pays a small fee.
+    CMutableTransaction tx2 = CMutableTransaction();
+    tx2.vout.resize(1);
+    tx2.vout[0].scriptPubKey = CScript() << OP_2 << OP_EQUAL;
+    tx2.vout[0].nValue = 10 * COIN;
+    pool.addUnchecked(tx2.GetHash(), entry.Fee(0LL).FromTx(tx2));
+
+    CMutableTransaction tx3 = CMutableTransaction();
+    tx3.vin.resize(1);
+    tx3.vin[0].prevout = COutPoint(tx2.GetHash(), 0);
+    tx3.vin[0].scriptSig = CScript() << OP_2;
+    tx3.vout.resize(1);
+    tx3.vout[0].scriptPubKey = CScript() << OP_3 << OP_EQUAL;
+    tx3.vout[0].nValue = 10 * COIN;
+    pool.addUnchecked(tx3.GetHash(), entry.Fee(1000LL).FromTx(tx3));
+
+    CFeeRate packageRate(1000LL, pool.mapTx.find(tx2.GetHash())->GetSizeWithDescendants());
+
+    std::list<CTransaction> removed;
+    pool.TrimToSize(pool.DynamicMemoryUsage(), removed);
+    BOOST_CHECK(removed.empty());
+    BOOST_CHECK_EQUAL(pool.size(), 3);
+    BOOST_CHECK_EQUAL(pool.GetMinFee(1).GetFeePerK(), 0);
+
+    // The tx2 package has the lowest fee rate, and goes as a whole.
+    pool.TrimToSize(pool.DynamicMemoryUsage() - 1, removed);
+    BOOST_CHECK_EQUAL(removed.size(), 2);
+    BOOST_CHECK(pool.exists(tx1.GetHash()));
+    BOOST_CHECK(!pool.exists(tx2.GetHash()));
+    BOOST_CHECK(!pool.exists(tx3.GetHash()));
+
+    // The minimum fee is raised above the evicted package's fee rate.
+    CAmount nMinFeePerK = packageRate.GetFeePerK() + 1000;
+    BOOST_CHECK_EQUAL(pool.GetMinFee(1).GetFeePerK(), nMinFeePerK);
+
+    // ... and stays there until a block is connected, after which it decays.
+    std::vector<CTransaction> vtx;
+    std::list<CTransaction> conflicts;
+    SetMockTime(42);
+    SetMockTime(42 + CTxMemPool::ROLLING_FEE_HALFLIFE);
+    BOOST_CHECK_EQUAL(pool.GetMinFee(1).GetFeePerK(), nMinFeePerK);
+    pool.removeForBlock(vtx, 1, conflicts);
+    SetMockTime(42 + 2*CTxMemPool::ROLLING_FEE_HALFLIFE);
+    BOOST_CHECK_EQUAL(pool.GetMinFee(1).GetFeePerK(), nMinFeePerK / 2);
+
+    SetMockTime(0);
+}
+
 BOOST_AUTO_TEST_CASE(RemoveWithoutBranchId) {
     CTxMemPool pool(CFeeRate(0));
     TestMemPoolEntryHelper entry;
@@ -0,0 +1,76 @@
+// Copyright (c) 2015 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "consensus/merkle.h"
+#include "hash.h"
+#include "random.h"
+#include "utilstrencodings.h"
+#include "test/test_bitcoin.h"
+
+#include <vector>
+
+#include <boost/test/unit_test.hpp>
+
+BOOST_FIXTURE_TEST_SUITE(merkle_tests, BasicTestingSetup)
+
+// Older version of the merkle tree code, hashing one pair at a time.
+static std::vector<uint256> BuildMerkleTreeReference(const std::vector<uint256>& vLeaves, bool& mutated)
+{
+    std::vector<uint256> vMerkleTree(vLeaves);
+    int j = 0;
+    mutated = false;
+    for (int nSize = vLeaves.size(); nSize > 1; nSize = (nSize + 1) / 2) {
+        for (int i = 0; i < nSize; i += 2) {
+            int i2 = std::min(i+1, nSize-1);
+            if (i2 == i + 1 && i2 + 1 == nSize && vMerkleTree[j+i] == vMerkleTree[j+i2]) {
+                mutated = true;
+            }
+            vMerkleTree.push_back(Hash(BEGIN(vMerkleTree[j+i]),  END(vMerkleTree[j+i]),
+                                       BEGIN(vMerkleTree[j+i2]), END(vMerkleTree[j+i2])));
+        }
+        j += nSize;
+    }
+    return vMerkleTree;
+}
+
+BOOST_AUTO_TEST_CASE(merkle_test)
+{
+    seed_insecure_rand(false);
+    for (int i = 0; i < 32; i++) {
+        // Try 32 leaf counts between 0 and 4000, hitting every lane remainder.
+        int nLeaves = (i < 17) ? i : 17 + (insecure_rand() % 4000);
+        // Duplicate the last one or two leaves in some iterations.
+        int nDuplicate = (i % 3 == 2 && nLeaves >= 4) ? 1 + (i % 2) : 0;
+
+        std::vector<uint256> vLeaves;
+        for (int j = 0; j < nLeaves; j++) {
+            vLeaves.push_back(GetRandHash());
+        }
+        for (int j = 0; j < nDuplicate; j++) {
+            vLeaves[nLeaves - 1 - j] = vLeaves[nLeaves - 1 - nDuplicate - j];
+        }
+
+        bool fMutatedRef;
+        std::vector<uint256> vRef = BuildMerkleTreeReference(vLeaves, fMutatedRef);
+
+        std::vector<uint256> vTree(vLeaves);
+        bool fMutatedTree;
+        uint256 root = ComputeMerkleTree(vTree, &fMutatedTree);
+        BOOST_CHECK(vTree == vRef);
+        BOOST_CHECK_EQUAL(fMutatedTree, fMutatedRef);
+        BOOST_CHECK(root == (vRef.empty() ? uint256() : vRef.back()));
+
+        bool fMutatedRoot;
+        BOOST_CHECK(ComputeMerkleRoot(vLeaves, &fMutatedRoot) == root);
+        BOOST_CHECK_EQUAL(fMutatedRoot, fMutatedRef);
+
+        std::vector<size_t> vSizes = MerkleTreeLevelSizes(nLeaves);
+        size_t nTotal = 0;
+        for (size_t j = 0; j < vSizes.size(); j++)
+            nTotal += vSizes[j];
+        BOOST_CHECK_EQUAL(nTotal, vRef.size());
+    }
+}
+
+BOOST_AUTO_TEST_SUITE_END()
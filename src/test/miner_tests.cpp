@@ -446,6 +446,53 @@ BOOST_AUTO_TEST_CASE(CreateNewBlock_validity)
     SetMockTime(0);
     mempool.clear();
 
+    // Mixed fee/priority mempool: high priority transactions go in first,
+    // then the rest by fee rate, and free low priority ones are left out.
+    // Priority comes from the value and age of confirmed inputs only, so the
+    // child of an in-mempool parent is taken for its fee. The last two are
+    // alike but for their inputs, and go in by txid.
+    const int nTipHeight = chainActive.Height();
+    const CAmount vCoinValue[] = {100 * COIN, 50 * COIN, 1000000, 100000, 10000, 200000, 200000};
+    const int vCoinHeight[] = {1, 1, nTipHeight, nTipHeight, nTipHeight, nTipHeight, nTipHeight};
+    const CAmount vFee[] = {0, 0, 10000, 20000, 0, 15000, 15000};
+    std::vector<COutPoint> vCoins;
+    std::vector<uint256> vHash;
+    for (unsigned int i = 0; i < 7; ++i)
+    {
+        COutPoint outpoint(ArithToUint256(arith_uint256(i + 1)), 0);
+        pcoinsTip->AddCoin(outpoint, Coin(CTxOut(vCoinValue[i], CScript() << OP_1), vCoinHeight[i], false), false);
+        vCoins.push_back(outpoint);
+        tx.vin.resize(1);
+        tx.vin[0].prevout = outpoint;
+        tx.vin[0].scriptSig = CScript() << OP_1;
+        tx.vin[0].nSequence = std::numeric_limits<uint32_t>::max();
+        tx.vout.resize(1);
+        tx.vout[0].nValue = vCoinValue[i] - vFee[i];
+        tx.vout[0].scriptPubKey = CScript() << OP_1;
+        tx.nLockTime = 0;
+        hash = tx.GetHash();
+        mempool.addUnchecked(hash, entry.Fee(vFee[i]).Time(GetTime()).SpendsCoinbase(false).FromTx(tx));
+        vHash.push_back(hash);
+    }
+    tx.vin[0].prevout = COutPoint(vHash[1], 0);
+    tx.vout[0].nValue = vCoinValue[1] - 30000;
+    uint256 hashChild = tx.GetHash();
+    mempool.addUnchecked(hashChild, entry.Fee(30000).Time(GetTime()).FromTx(tx));
+
+    BOOST_CHECK(pblocktemplate = CreateNewBlock(scriptPubKey));
+    BOOST_REQUIRE_EQUAL(pblocktemplate->block.vtx.size(), 8);
+    BOOST_CHECK(pblocktemplate->block.vtx[1].GetHash() == vHash[0]);
+    BOOST_CHECK(pblocktemplate->block.vtx[2].GetHash() == vHash[1]);
+    BOOST_CHECK(pblocktemplate->block.vtx[3].GetHash() == vHash[2]);
+    BOOST_CHECK(pblocktemplate->block.vtx[4].GetHash() == hashChild);
+    BOOST_CHECK(pblocktemplate->block.vtx[5].GetHash() == vHash[3]);
+    BOOST_CHECK(pblocktemplate->block.vtx[6].GetHash() == std::min(vHash[5], vHash[6]));
+    BOOST_CHECK(pblocktemplate->block.vtx[7].GetHash() == std::max(vHash[5], vHash[6]));
+    delete pblocktemplate;
+    mempool.clear();
+    BOOST_FOREACH(const COutPoint& outpoint, vCoins)
+        pcoinsTip->SpendCoin(outpoint);
+
     BOOST_FOREACH(CTransaction *tx, txFirst)
         delete tx;
 
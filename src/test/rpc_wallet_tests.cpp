@@ -1237,9 +1237,13 @@ BOOST_AUTO_TEST_CASE(rpc_z_sendmany_internals)
             BOOST_CHECK( string(e.what()).find("unsupported joinsplit input")!= string::npos);
         }
 
+        // The proof is only created, and verified, by prove_joinsplits. Test
+        // mode skips creating it, so the JoinSplit must fail verification.
         info.vjsin.clear();
+        proxy.perform_joinsplit(info);
         try {
-            proxy.perform_joinsplit(info);
+            proxy.prove_joinsplits();
+            BOOST_FAIL("Should have caused an error");
         } catch (const std::runtime_error & e) {
             BOOST_CHECK( string(e.what()).find("error verifying joinsplit")!= string::npos);
         }
@@ -1984,9 +1988,12 @@ BOOST_AUTO_TEST_CASE(rpc_z_mergetoaddress_internals)
             BOOST_CHECK( string(e.what()).find("unsupported joinsplit input")!= string::npos);
         }
 
+        // The proof is only created, and verified, by prove_joinsplits. Test
+        // mode skips creating it, so the JoinSplit must fail verification.
         info.vjsin.clear();
+        proxy.perform_joinsplit(info);
         try {
-            proxy.perform_joinsplit(info);
+            proxy.prove_joinsplits();
             BOOST_FAIL("Should have caused an error");
         } catch (const std::runtime_error & e) {
             BOOST_CHECK( string(e.what()).find("error verifying joinsplit")!= string::npos);
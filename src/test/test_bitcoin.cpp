@@ -7,6 +7,7 @@
 #include "test_bitcoin.h"
 
 #include "crypto/common.h"
+#include "crypto/sha256.h"
 
 #include "key.h"
 #include "main.h"
@@ -73,6 +74,7 @@ JoinSplitTestingSetup::~JoinSplitTestingSetup()
 BasicTestingSetup::BasicTestingSetup()
 {
     assert(init_and_check_sodium() != -1);
+    SHA256AutoDetect();
     ECC_Start();
     SetupEnvironment();
     SetupNetworking();
@@ -104,7 +106,8 @@ TestingSetup::TestingSetup()
         mapArgs["-datadir"] = pathTemp.string();
         pblocktree = new CBlockTreeDB(1 << 20, true);
         pcoinsdbview = new CCoinsViewDB(1 << 23, true);
-        pcoinsTip = new CCoinsViewCache(pcoinsdbview);
+        pcoinswriter = new CCoinsViewBackgroundWriter(pcoinsdbview, DEFAULT_BACKGROUND_FLUSH);
+        pcoinsTip = new CCoinsViewCache(pcoinswriter);
         InitBlockIndex();
 #ifdef ENABLE_WALLET
         bool fFirstRun;
@@ -130,6 +133,8 @@ TestingSetup::~TestingSetup()
 #endif
         UnloadBlockIndex();
         delete pcoinsTip;
+        delete pcoinswriter;
+        pcoinswriter = NULL;
         delete pcoinsdbview;
         delete pblocktree;
 #ifdef ENABLE_WALLET
@@ -6,10 +6,17 @@
 
 #include "main.h"
 #include "pubkey.h"
+#include "script/interpreter.h"
 #include "script/sign.h"
+#include "util.h"
+
+#include <atomic>
+#include <functional>
+#include <thread>
 
 #include <boost/variant.hpp>
 #include <librustzcash.h>
+#include <sodium.h>
 
 SpendDescriptionInfo::SpendDescriptionInfo(
     libzcash::SaplingExpandedSpendingKey expsk,
@@ -155,6 +162,10 @@ boost::optional<CTransaction> TransactionBuilder::Build()
     //
     // Sapling spends and outputs
     //
+    // These are created one at a time. Every proof adds its value commitment
+    // randomness to the one proving context that the binding signature is
+    // made from, and librustzcash can't merge contexts built on other threads.
+    //
 
     auto ctx = librustzcash_sapling_proving_ctx_init();
 
@@ -291,3 +302,118 @@ boost::optional<CTransaction> TransactionBuilder::Build()
 
     return CTransaction(mtx);
 }
+
+/** Resolve a -joinsplitprovingthreads value: 0 = one thread per core, <0 = leave that many cores free */
+static int GetProvingThreads(int nThreads)
+{
+    if (nThreads <= 0) {
+        nThreads += GetNumCores();
+    }
+    return std::max(1, nThreads);
+}
+
+/**
+ * Run job(0) .. job(nJobs - 1) on up to nThreads threads, including the
+ * calling one. Returns false as soon as any job fails or throws; jobs that
+ * have not started by then are skipped.
+ */
+static bool RunProvingJobs(size_t nJobs, int nThreads, const std::function<bool(size_t)>& job)
+{
+    std::atomic<size_t> nNext(0);
+    std::atomic<bool> fFailed(false);
+    auto worker = [&]() {
+        size_t i;
+        while (!fFailed && (i = nNext++) < nJobs) {
+            bool fOk = false;
+            try {
+                fOk = job(i);
+            } catch (const std::exception& e) {
+                LogPrintf("RunProvingJobs: %s\n", e.what());
+            }
+            if (!fOk) {
+                fFailed = true;
+            }
+        }
+    };
+
+    std::vector<std::thread> threads;
+    size_t nWorkers = std::min<size_t>(std::max(nThreads, 1), nJobs);
+    for (size_t n = 1; n < nWorkers; n++) {
+        threads.emplace_back(worker);
+    }
+    worker();
+    for (std::thread& t : threads) {
+        t.join();
+    }
+    return !fFailed;
+}
+
+void JoinSplitProver::SetProvingThreads(int nThreads)
+{
+    nProvingThreads = GetProvingThreads(nThreads);
+}
+
+void JoinSplitProver::Add(
+    size_t nJoinSplit,
+    bool makeGrothProof,
+    const std::array<libzcash::JSInput, ZC_NUM_JS_INPUTS>& inputs,
+    const std::array<libzcash::SproutNote, ZC_NUM_JS_OUTPUTS>& notes,
+    const uint252& phi,
+    bool computeProof)
+{
+    jobs.push_back(Job{nJoinSplit, makeGrothProof, inputs, notes, phi, computeProof});
+}
+
+bool JoinSplitProver::Prove(CMutableTransaction& mtx, ZCJoinSplit& params)
+{
+    // The libsnark prover behind PHGR proofs keeps global profiling state,
+    // so only Groth proofs are created concurrently.
+    int nThreads = nProvingThreads;
+    for (const Job& job : jobs) {
+        if (!job.makeGrothProof) {
+            nThreads = 1;
+        }
+    }
+
+    bool fProved = RunProvingJobs(jobs.size(), nThreads, [&](size_t i) {
+        const Job& job = jobs[i];
+        JSDescription& jsdesc = mtx.vjoinsplit.at(job.nJoinSplit);
+        if (job.computeProof) {
+            jsdesc.ProveNotes(job.makeGrothProof, params, mtx.joinSplitPubKey, job.inputs, job.notes, job.phi);
+        }
+        auto verifier = libzcash::ProofVerifier::Strict();
+        return jsdesc.Verify(params, verifier, mtx.joinSplitPubKey);
+    });
+    jobs.clear();
+    return fProved;
+}
+
+void JoinSplitProver::ProveAndSign(
+    CMutableTransaction& mtx,
+    ZCJoinSplit& params,
+    uint32_t consensusBranchId,
+    const unsigned char* joinSplitPrivKey)
+{
+    if (!Prove(mtx, params)) {
+        throw std::runtime_error("error verifying joinsplit");
+    }
+
+    // Empty output script.
+    CScript scriptCode;
+    CTransaction signTx(mtx);
+    uint256 dataToBeSigned = SignatureHash(scriptCode, signTx, NOT_AN_INPUT, SIGHASH_ALL, 0, consensusBranchId);
+
+    // Add the signature
+    if (!(crypto_sign_detached(&mtx.joinSplitSig[0], NULL,
+                               dataToBeSigned.begin(), 32,
+                               joinSplitPrivKey) == 0)) {
+        throw std::runtime_error("crypto_sign_detached failed");
+    }
+
+    // Sanity check
+    if (!(crypto_sign_verify_detached(&mtx.joinSplitSig[0],
+                                      dataToBeSigned.begin(), 32,
+                                      mtx.joinSplitPubKey.begin()) == 0)) {
+        throw std::runtime_error("crypto_sign_verify_detached failed");
+    }
+}
@@ -18,6 +18,9 @@
 
 #include <boost/optional.hpp>
 
+/** Default for -joinsplitprovingthreads */
+static const int DEFAULT_JOINSPLIT_PROVING_THREADS = 1;
+
 struct SpendDescriptionInfo {
     libzcash::SaplingExpandedSpendingKey expsk;
     libzcash::SaplingNote note;
@@ -100,4 +103,56 @@ public:
     boost::optional<CTransaction> Build();
 };
 
+/**
+ * Creates the proofs of a transaction's JoinSplits once all of them have been
+ * planned. A chained JoinSplit only depends on the commitment of the change
+ * note it spends, not on the proof of the JoinSplit that created it, so after
+ * the JoinSplits are constructed with computeProof = false in chain order,
+ * their proofs are independent and can run concurrently.
+ */
+class JoinSplitProver
+{
+private:
+    struct Job {
+        size_t nJoinSplit;
+        bool makeGrothProof;
+        std::array<libzcash::JSInput, ZC_NUM_JS_INPUTS> inputs;
+        std::array<libzcash::SproutNote, ZC_NUM_JS_OUTPUTS> notes;
+        uint252 phi;
+        bool computeProof;
+    };
+
+    std::vector<Job> jobs;
+    int nProvingThreads = 1;
+
+public:
+    // Sets the number of threads Prove() uses (0 = one per core, <0 = leave
+    // that many cores free).
+    void SetProvingThreads(int nThreads);
+
+    // Records the JoinSplit at index nJoinSplit, with the (shuffled) inputs
+    // it was constructed from and the notes and phi it returned. If
+    // computeProof is false the JoinSplit is only verified, not proven.
+    void Add(
+        size_t nJoinSplit,
+        bool makeGrothProof,
+        const std::array<libzcash::JSInput, ZC_NUM_JS_INPUTS>& inputs,
+        const std::array<libzcash::SproutNote, ZC_NUM_JS_OUTPUTS>& notes,
+        const uint252& phi,
+        bool computeProof = true);
+
+    // Creates and verifies the proofs of the recorded JoinSplits of mtx.
+    // Returns false if any of them does not verify. The joinSplitSig must be
+    // created afterwards, as it commits to the proofs.
+    bool Prove(CMutableTransaction& mtx, ZCJoinSplit& params);
+
+    // Proves the recorded JoinSplits of mtx and then creates its joinSplitSig
+    // with joinSplitPrivKey. Throws std::runtime_error on failure.
+    void ProveAndSign(
+        CMutableTransaction& mtx,
+        ZCJoinSplit& params,
+        uint32_t consensusBranchId,
+        const unsigned char* joinSplitPrivKey);
+};
+
 #endif /* TRANSACTION_BUILDER_H */
@@ -7,9 +7,13 @@
 
 #include "chainparams.h"
 #include "hash.h"
+#include "init.h"
 #include "main.h"
 #include "pow.h"
+#include "primitives/compactblock.h"
+#include "ui_interface.h"
 #include "uint256.h"
+#include "util.h"
 
 #include <stdint.h>
 
@@ -23,10 +27,12 @@ static const char DB_SPROUT_ANCHOR = 'A';
 static const char DB_SAPLING_ANCHOR = 'Z';
 static const char DB_NULLIFIER = 's';
 static const char DB_SAPLING_NULLIFIER = 'S';
+static const char DB_COIN = 'C';
 static const char DB_COINS = 'c';
 static const char DB_BLOCK_FILES = 'f';
 static const char DB_TXINDEX = 't';
 static const char DB_BLOCK_INDEX = 'b';
+static const char DB_COMPACT_BLOCK = 'C';
 
 static const char DB_BEST_BLOCK = 'B';
 static const char DB_BEST_SPROUT_ANCHOR = 'a';
@@ -35,6 +41,29 @@ static const char DB_FLAG = 'F';
 static const char DB_REINDEX_FLAG = 'R';
 static const char DB_LAST_BLOCK = 'l';
 
+namespace {
+
+struct CoinEntry {
+    COutPoint* outpoint;
+    char key;
+    CoinEntry(const COutPoint* ptr) : outpoint(const_cast<COutPoint*>(ptr)), key(DB_COIN)  {}
+
+    template<typename Stream>
+    void Serialize(Stream &s) const {
+        s << key;
+        s << outpoint->hash;
+        s << VARINT(outpoint->n);
+    }
+
+    template<typename Stream>
+    void Unserialize(Stream& s) {
+        s >> key;
+        s >> outpoint->hash;
+        s >> VARINT(outpoint->n);
+    }
+};
+
+}
 
 CCoinsViewDB::CCoinsViewDB(std::string dbName, size_t nCacheSize, bool fMemory, bool fWipe) : db(GetDataDir() / dbName, nCacheSize, fMemory, fWipe) {
 }
@@ -84,12 +113,12 @@ bool CCoinsViewDB::GetNullifier(const uint256 &nf, ShieldedType type) const {
     return db.Read(make_pair(dbChar, nf), spent);
 }
 
-bool CCoinsViewDB::GetCoins(const uint256 &txid, CCoins &coins) const {
-    return db.Read(make_pair(DB_COINS, txid), coins);
+bool CCoinsViewDB::GetCoin(const COutPoint &outpoint, Coin &coin) const {
+    return db.Read(CoinEntry(&outpoint), coin);
 }
 
-bool CCoinsViewDB::HaveCoins(const uint256 &txid) const {
-    return db.Exists(make_pair(DB_COINS, txid));
+bool CCoinsViewDB::HaveCoin(const COutPoint &outpoint) const {
+    return db.Exists(CoinEntry(&outpoint));
 }
 
 uint256 CCoinsViewDB::GetBestBlock() const {
@@ -118,9 +147,9 @@ uint256 CCoinsViewDB::GetBestAnchor(ShieldedType type) const {
     return hashBestAnchor;
 }
 
-void BatchWriteNullifiers(CDBBatch& batch, CNullifiersMap& mapToUse, const char& dbChar)
+void BatchWriteNullifiers(CDBBatch& batch, const CNullifiersMap& mapToUse, const char& dbChar)
 {
-    for (CNullifiersMap::iterator it = mapToUse.begin(); it != mapToUse.end();) {
+    for (CNullifiersMap::const_iterator it = mapToUse.begin(); it != mapToUse.end(); ++it) {
         if (it->second.flags & CNullifiersCacheEntry::DIRTY) {
             if (!it->second.entered)
                 batch.Erase(make_pair(dbChar, it->first));
@@ -128,15 +157,13 @@ void BatchWriteNullifiers(CDBBatch& batch, CNullifiersMap& mapToUse, const char&
                 batch.Write(make_pair(dbChar, it->first), true);
             // TODO: changed++? ... See comment in CCoinsViewDB::BatchWrite. If this is needed we could return an int
         }
-        CNullifiersMap::iterator itOld = it++;
-        mapToUse.erase(itOld);
     }
 }
 
 template<typename Map, typename MapIterator, typename MapEntry, typename Tree>
-void BatchWriteAnchors(CDBBatch& batch, Map& mapToUse, const char& dbChar)
+void BatchWriteAnchors(CDBBatch& batch, const Map& mapToUse, const char& dbChar)
 {
-    for (MapIterator it = mapToUse.begin(); it != mapToUse.end();) {
+    for (MapIterator it = mapToUse.begin(); it != mapToUse.end(); ++it) {
         if (it->second.flags & MapEntry::DIRTY) {
             if (!it->second.entered)
                 batch.Erase(make_pair(dbChar, it->first));
@@ -147,8 +174,6 @@ void BatchWriteAnchors(CDBBatch& batch, Map& mapToUse, const char& dbChar)
             }
             // TODO: changed++?
         }
-        MapIterator itOld = it++;
-        mapToUse.erase(itOld);
     }
 }
 
@@ -160,28 +185,46 @@ bool CCoinsViewDB::BatchWrite(CCoinsMap &mapCoins,
                               CAnchorsSaplingMap &mapSaplingAnchors,
                               CNullifiersMap &mapSproutNullifiers,
                               CNullifiersMap &mapSaplingNullifiers) {
+    bool fOk = WriteCoins(mapCoins, hashBlock, hashSproutAnchor, hashSaplingAnchor, mapSproutAnchors, mapSaplingAnchors, mapSproutNullifiers, mapSaplingNullifiers);
+    mapCoins.clear();
+    mapSproutAnchors.clear();
+    mapSaplingAnchors.clear();
+    mapSproutNullifiers.clear();
+    mapSaplingNullifiers.clear();
+    return fOk;
+}
+
+bool CCoinsViewDB::WriteCoins(const CCoinsMap &mapCoins,
+                              const uint256 &hashBlock,
+                              const uint256 &hashSproutAnchor,
+                              const uint256 &hashSaplingAnchor,
+                              const CAnchorsSproutMap &mapSproutAnchors,
+                              const CAnchorsSaplingMap &mapSaplingAnchors,
+                              const CNullifiersMap &mapSproutNullifiers,
+                              const CNullifiersMap &mapSaplingNullifiers) {
     CDBBatch batch(db);
     size_t count = 0;
     size_t changed = 0;
-    for (CCoinsMap::iterator it = mapCoins.begin(); it != mapCoins.end();) {
+    for (CCoinsMap::const_iterator it = mapCoins.begin(); it != mapCoins.end(); ++it) {
         if (it->second.flags & CCoinsCacheEntry::DIRTY) {
-            if (it->second.coins.IsPruned())
-                batch.Erase(make_pair(DB_COINS, it->first));
+            CoinEntry entry(&it->first);
+            if (it->second.coin.IsSpent())
+                batch.Erase(entry);
             else
-                batch.Write(make_pair(DB_COINS, it->first), it->second.coins);
+                batch.Write(entry, it->second.coin);
             changed++;
         }
         count++;
-        CCoinsMap::iterator itOld = it++;
-        mapCoins.erase(itOld);
     }
 
-    ::BatchWriteAnchors<CAnchorsSproutMap, CAnchorsSproutMap::iterator, CAnchorsSproutCacheEntry, SproutMerkleTree>(batch, mapSproutAnchors, DB_SPROUT_ANCHOR);
-    ::BatchWriteAnchors<CAnchorsSaplingMap, CAnchorsSaplingMap::iterator, CAnchorsSaplingCacheEntry, SaplingMerkleTree>(batch, mapSaplingAnchors, DB_SAPLING_ANCHOR);
+    ::BatchWriteAnchors<CAnchorsSproutMap, CAnchorsSproutMap::const_iterator, CAnchorsSproutCacheEntry, SproutMerkleTree>(batch, mapSproutAnchors, DB_SPROUT_ANCHOR);
+    ::BatchWriteAnchors<CAnchorsSaplingMap, CAnchorsSaplingMap::const_iterator, CAnchorsSaplingCacheEntry, SaplingMerkleTree>(batch, mapSaplingAnchors, DB_SAPLING_ANCHOR);
 
     ::BatchWriteNullifiers(batch, mapSproutNullifiers, DB_NULLIFIER);
     ::BatchWriteNullifiers(batch, mapSaplingNullifiers, DB_SAPLING_NULLIFIER);
 
+    // The best block marker goes into the same batch as the coins, so the
+    // database always describes the state at some flushed block.
     if (!hashBlock.IsNull())
         batch.Write(DB_BEST_BLOCK, hashBlock);
     if (!hashSproutAnchor.IsNull())
@@ -189,10 +232,177 @@ bool CCoinsViewDB::BatchWrite(CCoinsMap &mapCoins,
     if (!hashSaplingAnchor.IsNull())
         batch.Write(DB_BEST_SAPLING_ANCHOR, hashSaplingAnchor);
 
-    LogPrint("coindb", "Committing %u changed transactions (out of %u) to coin database...\n", (unsigned int)changed, (unsigned int)count);
+    LogPrint("coindb", "Committing %u changed transaction outputs (out of %u) to coin database...\n", (unsigned int)changed, (unsigned int)count);
     return db.WriteBatch(batch);
 }
 
+CCoinsViewBackgroundWriter::CCoinsViewBackgroundWriter(CCoinsViewDB *dbIn, bool fBackgroundIn) :
+    CCoinsViewBacked(dbIn), db(dbIn), fBackground(fBackgroundIn), fPending(false), fWriteDone(false), fWriteOk(true) {}
+
+CCoinsViewBackgroundWriter::~CCoinsViewBackgroundWriter()
+{
+    Sync();
+}
+
+bool CCoinsViewBackgroundWriter::GetSproutAnchorAt(const uint256 &rt, SproutMerkleTree &tree) const {
+    if (fPending) {
+        CAnchorsSproutMap::const_iterator it = pendingSproutAnchors.find(rt);
+        if (it != pendingSproutAnchors.end()) {
+            if (!it->second.entered)
+                return false;
+            tree = it->second.tree;
+            return true;
+        }
+    }
+    return base->GetSproutAnchorAt(rt, tree);
+}
+
+bool CCoinsViewBackgroundWriter::GetSaplingAnchorAt(const uint256 &rt, SaplingMerkleTree &tree) const {
+    if (fPending) {
+        CAnchorsSaplingMap::const_iterator it = pendingSaplingAnchors.find(rt);
+        if (it != pendingSaplingAnchors.end()) {
+            if (!it->second.entered)
+                return false;
+            tree = it->second.tree;
+            return true;
+        }
+    }
+    return base->GetSaplingAnchorAt(rt, tree);
+}
+
+bool CCoinsViewBackgroundWriter::GetNullifier(const uint256 &nf, ShieldedType type) const {
+    if (fPending) {
+        const CNullifiersMap* mapToUse;
+        switch (type) {
+            case SPROUT:
+                mapToUse = &pendingSproutNullifiers;
+                break;
+            case SAPLING:
+                mapToUse = &pendingSaplingNullifiers;
+                break;
+            default:
+                throw runtime_error("Unknown shielded type");
+        }
+        CNullifiersMap::const_iterator it = mapToUse->find(nf);
+        if (it != mapToUse->end())
+            return it->second.entered;
+    }
+    return base->GetNullifier(nf, type);
+}
+
+bool CCoinsViewBackgroundWriter::GetCoin(const COutPoint &outpoint, Coin &coin) const {
+    if (fPending) {
+        CCoinsMap::const_iterator it = pendingCoins.find(outpoint);
+        if (it != pendingCoins.end()) {
+            // Spent entries are deletions that have not reached the database yet.
+            if (it->second.coin.IsSpent())
+                return false;
+            coin = it->second.coin;
+            return true;
+        }
+    }
+    return base->GetCoin(outpoint, coin);
+}
+
+bool CCoinsViewBackgroundWriter::HaveCoin(const COutPoint &outpoint) const {
+    if (fPending) {
+        CCoinsMap::const_iterator it = pendingCoins.find(outpoint);
+        if (it != pendingCoins.end())
+            return !it->second.coin.IsSpent();
+    }
+    return base->HaveCoin(outpoint);
+}
+
+uint256 CCoinsViewBackgroundWriter::GetBestBlock() const {
+    if (fPending && !hashPendingBlock.IsNull())
+        return hashPendingBlock;
+    return base->GetBestBlock();
+}
+
+uint256 CCoinsViewBackgroundWriter::GetBestAnchor(ShieldedType type) const {
+    if (fPending) {
+        switch (type) {
+            case SPROUT:
+                if (!hashPendingSproutAnchor.IsNull())
+                    return hashPendingSproutAnchor;
+                break;
+            case SAPLING:
+                if (!hashPendingSaplingAnchor.IsNull())
+                    return hashPendingSaplingAnchor;
+                break;
+            default:
+                throw runtime_error("Unknown shielded type");
+        }
+    }
+    return base->GetBestAnchor(type);
+}
+
+bool CCoinsViewBackgroundWriter::BatchWrite(CCoinsMap &mapCoins,
+                                            const uint256 &hashBlock,
+                                            const uint256 &hashSproutAnchor,
+                                            const uint256 &hashSaplingAnchor,
+                                            CAnchorsSproutMap &mapSproutAnchors,
+                                            CAnchorsSaplingMap &mapSaplingAnchors,
+                                            CNullifiersMap &mapSproutNullifiers,
+                                            CNullifiersMap &mapSaplingNullifiers) {
+    // Writes are applied in order: the previous one has to be on disk first.
+    if (!Sync())
+        return false;
+    if (!fBackground)
+        return db->BatchWrite(mapCoins, hashBlock, hashSproutAnchor, hashSaplingAnchor, mapSproutAnchors, mapSaplingAnchors, mapSproutNullifiers, mapSaplingNullifiers);
+
+    pendingCoins.swap(mapCoins);
+    pendingSproutAnchors.swap(mapSproutAnchors);
+    pendingSaplingAnchors.swap(mapSaplingAnchors);
+    pendingSproutNullifiers.swap(mapSproutNullifiers);
+    pendingSaplingNullifiers.swap(mapSaplingNullifiers);
+    hashPendingBlock = hashBlock;
+    hashPendingSproutAnchor = hashSproutAnchor;
+    hashPendingSaplingAnchor = hashSaplingAnchor;
+    fWriteDone = false;
+    fPending = true;
+    writer = boost::thread(&CCoinsViewBackgroundWriter::ThreadWrite, this);
+    return true;
+}
+
+void CCoinsViewBackgroundWriter::ThreadWrite()
+{
+    RenameThread("zcash-coinswrite");
+    int64_t nStart = GetTimeMillis();
+    bool fOk = false;
+    try {
+        // Only reads the pending maps, which validation may be reading concurrently.
+        fOk = db->WriteCoins(pendingCoins, hashPendingBlock, hashPendingSproutAnchor, hashPendingSaplingAnchor,
+                             pendingSproutAnchors, pendingSaplingAnchors, pendingSproutNullifiers, pendingSaplingNullifiers);
+    } catch (const std::exception& e) {
+        LogPrintf("%s: %s\n", __func__, e.what());
+    }
+    LogPrint("coindb", "Background chainstate write %s in %dms\n", fOk ? "completed" : "failed", GetTimeMillis() - nStart);
+    fWriteOk = fOk;
+    fWriteDone = true;
+}
+
+bool CCoinsViewBackgroundWriter::Poll()
+{
+    if (fPending && fWriteDone)
+        return Sync();
+    return true;
+}
+
+bool CCoinsViewBackgroundWriter::Sync()
+{
+    if (!fPending)
+        return fWriteOk;
+    writer.join();
+    fPending = false;
+    pendingCoins.clear();
+    pendingSproutAnchors.clear();
+    pendingSaplingAnchors.clear();
+    pendingSproutNullifiers.clear();
+    pendingSaplingNullifiers.clear();
+    return fWriteOk;
+}
+
 CBlockTreeDB::CBlockTreeDB(size_t nCacheSize, bool fMemory, bool fWipe) : CDBWrapper(GetDataDir() / "blocks" / "index", nCacheSize, fMemory, fWipe) {
 }
 
@@ -216,35 +426,49 @@ bool CBlockTreeDB::ReadLastBlockFile(int &nFile) {
     return Read(DB_LAST_BLOCK, nFile);
 }
 
+/**
+ * Hash the unspent outputs of one transaction the same way the per-txid
+ * records were hashed, so that hash_serialized is unchanged by the upgrade.
+ */
+static void ApplyStats(CCoinsStats &stats, CHashWriter& ss, const std::map<uint32_t, Coin>& outputs)
+{
+    assert(!outputs.empty());
+    stats.nTransactions++;
+    for (std::map<uint32_t, Coin>::const_iterator it = outputs.begin(); it != outputs.end(); ++it) {
+        ss << VARINT(it->first + 1);
+        ss << it->second.out;
+        stats.nTransactionOutputs++;
+        stats.nTotalAmount += it->second.out.nValue;
+    }
+    ss << VARINT(0);
+}
+
 bool CCoinsViewDB::GetStats(CCoinsStats &stats) const {
     /* It seems that there are no "const iterators" for LevelDB.  Since we
        only need read operations on it, use a const-cast to get around
        that restriction.  */
     boost::scoped_ptr<CDBIterator> pcursor(const_cast<CDBWrapper*>(&db)->NewIterator());
-    pcursor->Seek(DB_COINS);
+    pcursor->Seek(DB_COIN);
 
     CHashWriter ss(SER_GETHASH, PROTOCOL_VERSION);
     stats.hashBlock = GetBestBlock();
     ss << stats.hashBlock;
-    CAmount nTotalAmount = 0;
+    uint256 prevkey;
+    std::map<uint32_t, Coin> outputs;
     while (pcursor->Valid()) {
         boost::this_thread::interruption_point();
-        std::pair<char, uint256> key;
-        CCoins coins;
-        if (pcursor->GetKey(key) && key.first == DB_COINS) {
-            if (pcursor->GetValue(coins)) {
-                stats.nTransactions++;
-                for (unsigned int i=0; i<coins.vout.size(); i++) {
-                    const CTxOut &out = coins.vout[i];
-                    if (!out.IsNull()) {
-                        stats.nTransactionOutputs++;
-                        ss << VARINT(i+1);
-                        ss << out;
-                        nTotalAmount += out.nValue;
-                    }
+        COutPoint key;
+        CoinEntry entry(&key);
+        Coin coin;
+        if (pcursor->GetKey(entry) && entry.key == DB_COIN) {
+            if (pcursor->GetValue(coin)) {
+                if (!outputs.empty() && key.hash != prevkey) {
+                    ApplyStats(stats, ss, outputs);
+                    outputs.clear();
                 }
+                prevkey = key.hash;
+                outputs[key.n] = std::move(coin);
                 stats.nSerializedSize += 32 + pcursor->GetValueSize();
-                ss << VARINT(0);
             } else {
                 return error("CCoinsViewDB::GetStats() : unable to read value");
             }
@@ -253,12 +477,14 @@ bool CCoinsViewDB::GetStats(CCoinsStats &stats) const {
         }
         pcursor->Next();
     }
+    if (!outputs.empty()) {
+        ApplyStats(stats, ss, outputs);
+    }
     {
         LOCK(cs_main);
         stats.nHeight = mapBlockIndex.find(stats.hashBlock)->second->nHeight;
     }
     stats.hashSerialized = ss.GetHash();
-    stats.nTotalAmount = nTotalAmount;
     return true;
 }
 
@@ -293,6 +519,14 @@ bool CBlockTreeDB::WriteTxIndex(const std::vector<std::pair<uint256, CDiskTxPos>
     return WriteBatch(batch);
 }
 
+bool CBlockTreeDB::ReadCompactBlock(const uint256 &hash, CCompactBlock &block) {
+    return Read(make_pair(DB_COMPACT_BLOCK, hash), block);
+}
+
+bool CBlockTreeDB::WriteCompactBlock(const CCompactBlock &block) {
+    return Write(make_pair(DB_COMPACT_BLOCK, block.hash), block);
+}
+
 bool CBlockTreeDB::WriteFlag(const std::string &name, bool fValue) {
     return Write(std::make_pair(DB_FLAG, name), fValue ? '1' : '0');
 }
@@ -358,3 +592,128 @@ bool CBlockTreeDB::LoadBlockIndexGuts()
 
     return true;
 }
+
+namespace {
+
+//! Legacy class to deserialize pre-upgrade per-transaction coins records
+class CCoins
+{
+public:
+    //! whether transaction is a coinbase
+    bool fCoinBase;
+
+    //! unspent transaction outputs; spent outputs are .IsNull(); spent outputs at the end of the array are dropped
+    std::vector<CTxOut> vout;
+
+    //! at which height this transaction was included in the active block chain
+    int nHeight;
+
+    //! empty constructor
+    CCoins() : fCoinBase(false), vout(0), nHeight(0) { }
+
+    template<typename Stream>
+    void Unserialize(Stream &s) {
+        unsigned int nCode = 0;
+        // version
+        int nVersionDummy;
+        ::Unserialize(s, VARINT(nVersionDummy));
+        // header code
+        ::Unserialize(s, VARINT(nCode));
+        fCoinBase = nCode & 1;
+        std::vector<bool> vAvail(2, false);
+        vAvail[0] = (nCode & 2) != 0;
+        vAvail[1] = (nCode & 4) != 0;
+        unsigned int nMaskCode = (nCode / 8) + ((nCode & 6) != 0 ? 0 : 1);
+        // spentness bitmask
+        while (nMaskCode > 0) {
+            unsigned char chAvail = 0;
+            ::Unserialize(s, chAvail);
+            for (unsigned int p = 0; p < 8; p++) {
+                bool f = (chAvail & (1 << p)) != 0;
+                vAvail.push_back(f);
+            }
+            if (chAvail != 0)
+                nMaskCode--;
+        }
+        // txouts themself
+        vout.assign(vAvail.size(), CTxOut());
+        for (unsigned int i = 0; i < vAvail.size(); i++) {
+            if (vAvail[i])
+                ::Unserialize(s, REF(CTxOutCompressor(vout[i])));
+        }
+        // coinbase height
+        ::Unserialize(s, VARINT(nHeight));
+    }
+};
+
+}
+
+/** Upgrade the database from older formats.
+ *
+ * Currently implemented: from the per-tx utxo model to per-txout.
+ */
+bool CCoinsViewDB::Upgrade() {
+    boost::scoped_ptr<CDBIterator> pcursor(db.NewIterator());
+    pcursor->Seek(make_pair(DB_COINS, uint256()));
+    // Nothing to do unless there are old per-tx records; the nullifier and
+    // anchor records sort after them.
+    std::pair<unsigned char, uint256> key;
+    if (!pcursor->Valid() || !pcursor->GetKey(key) || key.first != DB_COINS) {
+        return true;
+    }
+
+    int64_t count = 0;
+    LogPrintf("Upgrading utxo-set database...\n");
+    LogPrintf("[0%%]...");
+    uiInterface.ShowProgress(_("Upgrading UTXO database"), 0);
+    size_t batch_size = 1 << 24;
+    CDBBatch batch(db);
+    int reportDone = 0;
+    std::pair<unsigned char, uint256> prev_key(DB_COINS, uint256());
+    while (pcursor->Valid()) {
+        boost::this_thread::interruption_point();
+        if (ShutdownRequested()) {
+            break;
+        }
+        if (pcursor->GetKey(key) && key.first == DB_COINS) {
+            if (count++ % 256 == 0) {
+                uint32_t high = 0x100 * *key.second.begin() + *(key.second.begin() + 1);
+                int percentageDone = (int)(high * 100.0 / 65536.0 + 0.5);
+                uiInterface.ShowProgress(_("Upgrading UTXO database"), percentageDone);
+                if (reportDone < percentageDone/10) {
+                    // report max. every 10% step
+                    LogPrintf("[%d%%]...", percentageDone);
+                    reportDone = percentageDone/10;
+                }
+            }
+            CCoins old_coins;
+            if (!pcursor->GetValue(old_coins)) {
+                return error("%s: cannot parse CCoins record", __func__);
+            }
+            COutPoint outpoint(key.second, 0);
+            for (size_t i = 0; i < old_coins.vout.size(); ++i) {
+                if (!old_coins.vout[i].IsNull() && !old_coins.vout[i].scriptPubKey.IsUnspendable()) {
+                    Coin newcoin(std::move(old_coins.vout[i]), old_coins.nHeight, old_coins.fCoinBase);
+                    outpoint.n = i;
+                    CoinEntry entry(&outpoint);
+                    batch.Write(entry, newcoin);
+                }
+            }
+            batch.Erase(key);
+            if (batch.SizeEstimate() > batch_size) {
+                db.WriteBatch(batch);
+                batch.Clear();
+                db.CompactRange(prev_key, key);
+                prev_key = key;
+            }
+            pcursor->Next();
+        } else {
+            break;
+        }
+    }
+    db.WriteBatch(batch);
+    db.CompactRange(std::pair<unsigned char, uint256>(DB_COINS, uint256()), key);
+    uiInterface.ShowProgress("", 100);
+    LogPrintf("[%s].\n", ShutdownRequested() ? "CANCELLED" : "DONE");
+    return !ShutdownRequested();
+}
@@ -9,13 +9,17 @@
 #include "coins.h"
 #include "dbwrapper.h"
 
+#include <atomic>
 #include <map>
 #include <string>
 #include <utility>
 #include <vector>
 
+#include <boost/thread.hpp>
+
 class CBlockFileInfo;
 class CBlockIndex;
+class CCompactBlock;
 struct CDiskTxPos;
 class uint256;
 
@@ -25,6 +29,8 @@ static const int64_t nDefaultDbCache = 450;
 static const int64_t nMaxDbCache = sizeof(void*) > 4 ? 16384 : 1024;
 //! min. -dbcache in (MiB)
 static const int64_t nMinDbCache = 4;
+//! -backgroundflush default
+static const bool DEFAULT_BACKGROUND_FLUSH = true;
 
 /** CCoinsView backed by the coin database (chainstate/) */
 class CCoinsViewDB : public CCoinsView
@@ -38,8 +44,8 @@ public:
     bool GetSproutAnchorAt(const uint256 &rt, SproutMerkleTree &tree) const;
     bool GetSaplingAnchorAt(const uint256 &rt, SaplingMerkleTree &tree) const;
     bool GetNullifier(const uint256 &nf, ShieldedType type) const;
-    bool GetCoins(const uint256 &txid, CCoins &coins) const;
-    bool HaveCoins(const uint256 &txid) const;
+    bool GetCoin(const COutPoint &outpoint, Coin &coin) const;
+    bool HaveCoin(const COutPoint &outpoint) const;
     uint256 GetBestBlock() const;
     uint256 GetBestAnchor(ShieldedType type) const;
     bool BatchWrite(CCoinsMap &mapCoins,
@@ -51,6 +57,81 @@ public:
                     CNullifiersMap &mapSproutNullifiers,
                     CNullifiersMap &mapSaplingNullifiers);
     bool GetStats(CCoinsStats &stats) const;
+
+    //! Write the dirty entries of the given maps in one atomic batch, leaving the maps untouched.
+    bool WriteCoins(const CCoinsMap &mapCoins,
+                    const uint256 &hashBlock,
+                    const uint256 &hashSproutAnchor,
+                    const uint256 &hashSaplingAnchor,
+                    const CAnchorsSproutMap &mapSproutAnchors,
+                    const CAnchorsSaplingMap &mapSaplingAnchors,
+                    const CNullifiersMap &mapSproutNullifiers,
+                    const CNullifiersMap &mapSaplingNullifiers);
+
+    //! Attempt to update from an older database format. Returns whether an error occurred.
+    bool Upgrade();
+};
+
+/**
+ * CCoinsView on top of the coin database that can write flushed caches on a
+ * background thread.
+ *
+ * A flushed cache is kept in memory until it has been written, and lookups
+ * are answered from it first, so validation continues against the current
+ * state while LevelDB catches up. Each flush, including its best block and
+ * anchor markers, is written as a single batch, so after a crash the database
+ * describes the state at the last completed flush. Flushes are written in
+ * order: a new one waits for the previous write to finish.
+ */
+class CCoinsViewBackgroundWriter : public CCoinsViewBacked
+{
+private:
+    CCoinsViewDB *db;
+    bool fBackground;
+
+    //! The flushed state being written; only changed while no write is in progress.
+    CCoinsMap pendingCoins;
+    CAnchorsSproutMap pendingSproutAnchors;
+    CAnchorsSaplingMap pendingSaplingAnchors;
+    CNullifiersMap pendingSproutNullifiers;
+    CNullifiersMap pendingSaplingNullifiers;
+    uint256 hashPendingBlock;
+    uint256 hashPendingSproutAnchor;
+    uint256 hashPendingSaplingAnchor;
+    bool fPending;
+
+    boost::thread writer;
+    std::atomic<bool> fWriteDone;
+    std::atomic<bool> fWriteOk;
+
+    void ThreadWrite();
+
+public:
+    CCoinsViewBackgroundWriter(CCoinsViewDB *dbIn, bool fBackgroundIn);
+    ~CCoinsViewBackgroundWriter();
+
+    bool GetSproutAnchorAt(const uint256 &rt, SproutMerkleTree &tree) const;
+    bool GetSaplingAnchorAt(const uint256 &rt, SaplingMerkleTree &tree) const;
+    bool GetNullifier(const uint256 &nf, ShieldedType type) const;
+    bool GetCoin(const COutPoint &outpoint, Coin &coin) const;
+    bool HaveCoin(const COutPoint &outpoint) const;
+    uint256 GetBestBlock() const;
+    uint256 GetBestAnchor(ShieldedType type) const;
+    bool BatchWrite(CCoinsMap &mapCoins,
+                    const uint256 &hashBlock,
+                    const uint256 &hashSproutAnchor,
+                    const uint256 &hashSaplingAnchor,
+                    CAnchorsSproutMap &mapSproutAnchors,
+                    CAnchorsSaplingMap &mapSaplingAnchors,
+                    CNullifiersMap &mapSproutNullifiers,
+                    CNullifiersMap &mapSaplingNullifiers);
+
+    //! Release the in-memory copy if the background write has finished. Returns false if it failed.
+    bool Poll();
+    //! Wait until everything flushed so far is on disk. Returns false if a write failed.
+    bool Sync();
+    //! Whether a background write is in progress.
+    bool IsWriting() const { return fPending; }
 };
 
 /** Access to the block database (blocks/index/) */
@@ -70,6 +151,8 @@ public:
     bool ReadReindexing(bool &fReindex);
     bool ReadTxIndex(const uint256 &txid, CDiskTxPos &pos);
     bool WriteTxIndex(const std::vector<std::pair<uint256, CDiskTxPos> > &list);
+    bool ReadCompactBlock(const uint256 &hash, CCompactBlock &block);
+    bool WriteCompactBlock(const CCompactBlock &block);
     bool WriteFlag(const std::string &name, bool fValue);
     bool ReadFlag(const std::string &name, bool &fValue);
     bool LoadBlockIndexGuts();
@@ -106,6 +106,7 @@ private:
     std::vector<MergeToAddressInputSaplingNote> saplingNoteInputs_;
 
     TransactionBuilder builder_;
+    JoinSplitProver joinsplitProver_;
     CTransaction tx_;
 
     std::array<unsigned char, ZC_MEMO_SIZE> get_memo_from_hex_string(std::string s);
@@ -123,6 +124,9 @@ private:
         std::vector<boost::optional<SproutWitness>> witnesses,
         uint256 anchor);
 
+    // Creates the proofs of the JoinSplits added by perform_joinsplit and signs them
+    UniValue prove_joinsplits();
+
     void sign_send_raw_transaction(UniValue obj); // throws exception if there was an error
 
     void lock_utxos();
@@ -186,6 +190,11 @@ public:
         return delegate->perform_joinsplit(info, witnesses, anchor);
     }
 
+    UniValue prove_joinsplits()
+    {
+        return delegate->prove_joinsplits();
+    }
+
     void sign_send_raw_transaction(UniValue obj)
     {
         delegate->sign_send_raw_transaction(obj);
@@ -80,6 +80,8 @@ AsyncRPCOperation_sendmany::AsyncRPCOperation_sendmany(
         throw JSONRPCError(RPC_INVALID_PARAMETER, "No recipients");
     }
 
+    joinsplitProver_.SetProvingThreads(GetArg("-joinsplitprovingthreads", DEFAULT_JOINSPLIT_PROVING_THREADS));
+
     isUsingBuilder_ = false;
     if (builder) {
         isUsingBuilder_ = true;
@@ -649,7 +651,7 @@ bool AsyncRPCOperation_sendmany::main_impl() {
             }
             obj = perform_joinsplit(info);
         }
-        sign_send_raw_transaction(obj);
+        sign_send_raw_transaction(prove_joinsplits());
         return true;
     }
     /**
@@ -927,11 +929,28 @@ bool AsyncRPCOperation_sendmany::main_impl() {
     assert(zOutputsDeque.size() == 0);
     assert(vpubNewProcessed);
 
-    sign_send_raw_transaction(obj);
+    sign_send_raw_transaction(prove_joinsplits());
     return true;
 }
 
 
+/**
+ * Create the proofs of the JoinSplits added by perform_joinsplit, which runs
+ * them on up to -joinsplitprovingthreads threads, and then sign the JoinSplits.
+ * Returns the raw transaction, ready for sign_send_raw_transaction.
+ */
+UniValue AsyncRPCOperation_sendmany::prove_joinsplits()
+{
+    CMutableTransaction mtx(tx_);
+    joinsplitProver_.ProveAndSign(mtx, *pzcashParams, consensusBranchId_, joinSplitPrivKey_);
+
+    tx_ = CTransaction(mtx);
+
+    UniValue obj(UniValue::VOBJ);
+    obj.push_back(Pair("rawtxn", EncodeHexTx(tx_)));
+    return obj;
+}
+
 /**
  * Sign and send a raw transaction.
  * Raw transaction as hex string should be in object field "rawtxn"
@@ -1179,9 +1198,15 @@ UniValue AsyncRPCOperation_sendmany::perform_joinsplit(
     std::array<size_t, ZC_NUM_JS_OUTPUTS> outputMap;
 
     uint256 esk; // payment disclosure - secret
+    std::array<libzcash::SproutNote, ZC_NUM_JS_OUTPUTS> notes;
+    uint252 phi;
+    bool makeGrothProof = mtx.fOverwintered && (mtx.nVersion >= SAPLING_TX_VERSION);
 
+    // Only the notes, commitments and ciphertexts are created here. The proof
+    // is left to prove_joinsplits(), so that the JoinSplits chained after this
+    // one can be planned without waiting for it.
     JSDescription jsdesc = JSDescription::Randomized(
-            mtx.fOverwintered && (mtx.nVersion >= SAPLING_TX_VERSION),
+            makeGrothProof,
             *pzcashParams,
             joinSplitPubKey_,
             anchor,
@@ -1191,39 +1216,14 @@ UniValue AsyncRPCOperation_sendmany::perform_joinsplit(
             outputMap,
             info.vpub_old,
             info.vpub_new,
-            !this->testmode,
-            &esk); // parameter expects pointer to esk, so pass in address
-    {
-        auto verifier = libzcash::ProofVerifier::Strict();
-        if (!(jsdesc.Verify(*pzcashParams, verifier, joinSplitPubKey_))) {
-            throw std::runtime_error("error verifying joinsplit");
-        }
-    }
+            false,
+            &esk, // parameter expects pointer to esk, so pass in address
+            GetRandInt,
+            &notes,
+            &phi);
 
     mtx.vjoinsplit.push_back(jsdesc);
-
-    // Empty output script.
-    CScript scriptCode;
-    CTransaction signTx(mtx);
-    uint256 dataToBeSigned = SignatureHash(scriptCode, signTx, NOT_AN_INPUT, SIGHASH_ALL, 0, consensusBranchId_);
-
-    // Add the signature
-    if (!(crypto_sign_detached(&mtx.joinSplitSig[0], NULL,
-            dataToBeSigned.begin(), 32,
-            joinSplitPrivKey_
-            ) == 0))
-    {
-        throw std::runtime_error("crypto_sign_detached failed");
-    }
-
-    // Sanity check
-    if (!(crypto_sign_verify_detached(&mtx.joinSplitSig[0],
-            dataToBeSigned.begin(), 32,
-            mtx.joinSplitPubKey.begin()
-            ) == 0))
-    {
-        throw std::runtime_error("crypto_sign_verify_detached failed");
-    }
+    joinsplitProver_.Add(mtx.vjoinsplit.size() - 1, makeGrothProof, inputs, notes, phi, !testmode);
 
     CTransaction rawTx(mtx);
     tx_ = rawTx;
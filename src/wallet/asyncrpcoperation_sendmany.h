@@ -106,6 +106,7 @@ private:
     std::vector<SaplingNoteEntry> z_sapling_inputs_;
 
     TransactionBuilder builder_;
+    JoinSplitProver joinsplitProver_;
     CTransaction tx_;
    
     void add_taddr_change_output_to_tx(CAmount amount);
@@ -127,6 +128,9 @@ private:
         std::vector<boost::optional < SproutWitness>> witnesses,
         uint256 anchor);
 
+    // Creates the proofs of the JoinSplits added by perform_joinsplit and signs them
+    UniValue prove_joinsplits();
+
     void sign_send_raw_transaction(UniValue obj);     // throws exception if there was an error
 
     // payment disclosure!
@@ -191,6 +195,10 @@ public:
         return delegate->perform_joinsplit(info, witnesses, anchor);
     }
 
+    UniValue prove_joinsplits() {
+        return delegate->prove_joinsplits();
+    }
+
     void sign_send_raw_transaction(UniValue obj) {
         delegate->sign_send_raw_transaction(obj);
     }
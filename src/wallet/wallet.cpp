@@ -6,6 +6,7 @@
 #include "wallet/wallet.h"
 
 #include "checkpoints.h"
+#include "checkqueue.h"
 #include "coincontrol.h"
 #include "consensus/upgrades.h"
 #include "consensus/validation.h"
@@ -24,6 +25,7 @@
 #include "zcash/zip32.h"
 
 #include <assert.h>
+#include <exception>
 
 #include <boost/algorithm/string/replace.hpp>
 #include <boost/filesystem.hpp>
@@ -53,6 +55,64 @@ CFeeRate CWallet::minTxFee = CFeeRate(1000);
  * @{
  */
 
+namespace {
+
+/**
+ * Closure representing trial decryption of one Sapling output with a
+ * contiguous range of incoming viewing keys. The first key in the range that
+ * decrypts the output, and the resulting plaintext, are written to *pResult.
+ * Note that this stores references to the output, the keys and the result.
+ */
+class CSaplingTrialDecryption
+{
+public:
+    typedef boost::optional<std::pair<size_t, SaplingNotePlaintext>> result_type;
+
+private:
+    const OutputDescription *poutput;
+    const std::vector<SaplingIncomingViewingKey> *pivks;
+    size_t nBegin;
+    size_t nEnd;
+    result_type *pResult;
+
+public:
+    CSaplingTrialDecryption() : poutput(NULL), pivks(NULL), nBegin(0), nEnd(0), pResult(NULL) {}
+    CSaplingTrialDecryption(const OutputDescription& outputIn, const std::vector<SaplingIncomingViewingKey>& ivksIn,
+                            size_t nBeginIn, size_t nEndIn, result_type& resultIn) :
+        poutput(&outputIn), pivks(&ivksIn), nBegin(nBeginIn), nEnd(nEndIn), pResult(&resultIn) {}
+
+    bool operator()()
+    {
+        for (size_t j = nBegin; j < nEnd; j++) {
+            auto result = SaplingNotePlaintext::decrypt(poutput->encCiphertext, (*pivks)[j], poutput->ephemeralKey, poutput->cm);
+            if (result) {
+                *pResult = std::make_pair(j, result.get());
+                break;
+            }
+        }
+        // Failing to decrypt is the expected outcome, not an error.
+        return true;
+    }
+
+    void swap(CSaplingTrialDecryption &check)
+    {
+        std::swap(poutput, check.poutput);
+        std::swap(pivks, check.pivks);
+        std::swap(nBegin, check.nBegin);
+        std::swap(nEnd, check.nEnd);
+        std::swap(pResult, check.pResult);
+    }
+};
+
+CCheckQueue<CSaplingTrialDecryption> trialdecryptionqueue(16);
+
+}
+
+void ThreadSaplingTrialDecryption() {
+    RenameThread("zcash-decrypt");
+    trialdecryptionqueue.Thread();
+}
+
 struct CompareValueOnly
 {
     bool operator()(const pair<CAmount, pair<const CWalletTx*, unsigned int> >& t1,
@@ -558,6 +618,12 @@ void CWallet::ChainTip(const CBlockIndex *pindex,
                        SaplingMerkleTree saplingTree, 
                        bool added)
 {
+    LOCK(cs_wallet);
+    // A running rescan applies (and undoes) the blocks itself, in order, once
+    // it gets to them. See ScanForWalletTransactions.
+    if (fRescanning) {
+        return;
+    }
     if (added) {
         IncrementNoteWitnesses(pindex, pblock, sproutTree, saplingTree);
     } else {
@@ -568,6 +634,11 @@ void CWallet::ChainTip(const CBlockIndex *pindex,
 
 void CWallet::SetBestChain(const CBlockLocator& loc)
 {
+    LOCK(cs_wallet);
+    // The witness caches don't match loc until a running rescan catches up.
+    if (fRescanning) {
+        return;
+    }
     CWalletDB walletdb(strWalletFile);
     SetBestChainINTERNAL(walletdb, loc);
 }
@@ -979,25 +1050,36 @@ void CopyPreviousWitnesses(NoteDataMap& noteDataMap, int indexHeight, int64_t nW
 }
 
 template<typename NoteDataMap>
-void AppendNoteCommitment(NoteDataMap& noteDataMap, int indexHeight, int64_t nWitnessCacheSize, const uint256& note_commitment)
+void CollectLiveWitnesses(NoteDataMap& noteDataMap, int indexHeight, std::vector<typename NoteDataMap::mapped_type*>& vLiveNotes)
 {
     for (auto& item : noteDataMap) {
         auto* nd = &(item.second);
         if (nd->witnessHeight < indexHeight && nd->witnesses.size() > 0) {
-            // Check the validity of the cache
-            // See comment in CopyPreviousWitnesses about validity.
-            assert(nWitnessCacheSize >= nd->witnesses.size());
-            nd->witnesses.front().append(note_commitment);
+            vLiveNotes.push_back(nd);
         }
     }
 }
 
+template<typename NoteData>
+void AppendNoteCommitment(const std::vector<NoteData*>& vLiveNotes, int64_t nWitnessCacheSize, const uint256& note_commitment)
+{
+    for (NoteData* nd : vLiveNotes) {
+        // Check the validity of the cache
+        // See comment in CopyPreviousWitnesses about validity.
+        assert(nWitnessCacheSize >= nd->witnesses.size());
+        nd->witnesses.front().append(note_commitment);
+    }
+}
+
 template<typename OutPoint, typename NoteData, typename Witness>
-void WitnessNoteIfMine(std::map<OutPoint, NoteData>& noteDataMap, int indexHeight, int64_t nWitnessCacheSize, const OutPoint& key, const Witness& witness)
+void WitnessNoteIfMine(std::map<OutPoint, NoteData>& noteDataMap, int indexHeight, int64_t nWitnessCacheSize, const OutPoint& key, const Witness& witness, std::vector<NoteData*>& vLiveNotes)
 {
     if (noteDataMap.count(key) && noteDataMap[key].witnessHeight < indexHeight) {
         auto* nd = &(noteDataMap[key]);
-        if (nd->witnesses.size() > 0) {
+        if (nd->witnesses.size() == 0) {
+            // Notes that already had a witness are tracked in vLiveNotes.
+            vLiveNotes.push_back(nd);
+        } else {
             // We think this can happen because we write out the
             // witness cache state after every block increment or
             // decrement, but the block index itself is written in
@@ -1059,6 +1141,17 @@ void CWallet::IncrementNoteWitnesses(const CBlockIndex* pindex,
         pblock = &block;
     }
 
+    // Index the notes whose witnesses must be advanced by this block, so
+    // that each note commitment only touches those notes instead of
+    // scanning the whole wallet. Notes witnessed in this block are added as
+    // they are found.
+    std::vector<SproutNoteData*> vLiveSproutNotes;
+    std::vector<SaplingNoteData*> vLiveSaplingNotes;
+    for (std::pair<const uint256, CWalletTx>& wtxItem : mapWallet) {
+        ::CollectLiveWitnesses(wtxItem.second.mapSproutNoteData, pindex->nHeight, vLiveSproutNotes);
+        ::CollectLiveWitnesses(wtxItem.second.mapSaplingNoteData, pindex->nHeight, vLiveSaplingNotes);
+    }
+
     for (const CTransaction& tx : pblock->vtx) {
         auto hash = tx.GetHash();
         bool txIsOurs = mapWallet.count(hash);
@@ -1070,14 +1163,12 @@ void CWallet::IncrementNoteWitnesses(const CBlockIndex* pindex,
                 sproutTree.append(note_commitment);
 
                 // Increment existing witnesses
-                for (std::pair<const uint256, CWalletTx>& wtxItem : mapWallet) {
-                    ::AppendNoteCommitment(wtxItem.second.mapSproutNoteData, pindex->nHeight, nWitnessCacheSize, note_commitment);
-                }
+                ::AppendNoteCommitment(vLiveSproutNotes, nWitnessCacheSize, note_commitment);
 
                 // If this is our note, witness it
                 if (txIsOurs) {
                     JSOutPoint jsoutpt {hash, i, j};
-                    ::WitnessNoteIfMine(mapWallet[hash].mapSproutNoteData, pindex->nHeight, nWitnessCacheSize, jsoutpt, sproutTree.witness());
+                    ::WitnessNoteIfMine(mapWallet[hash].mapSproutNoteData, pindex->nHeight, nWitnessCacheSize, jsoutpt, sproutTree.witness(), vLiveSproutNotes);
                 }
             }
         }
@@ -1087,14 +1178,12 @@ void CWallet::IncrementNoteWitnesses(const CBlockIndex* pindex,
             saplingTree.append(note_commitment);
 
             // Increment existing witnesses
-            for (std::pair<const uint256, CWalletTx>& wtxItem : mapWallet) {
-                ::AppendNoteCommitment(wtxItem.second.mapSaplingNoteData, pindex->nHeight, nWitnessCacheSize, note_commitment);
-            }
+            ::AppendNoteCommitment(vLiveSaplingNotes, nWitnessCacheSize, note_commitment);
 
             // If this is our note, witness it
             if (txIsOurs) {
                 SaplingOutPoint outPoint {hash, i};
-                ::WitnessNoteIfMine(mapWallet[hash].mapSaplingNoteData, pindex->nHeight, nWitnessCacheSize, outPoint, saplingTree.witness());
+                ::WitnessNoteIfMine(mapWallet[hash].mapSaplingNoteData, pindex->nHeight, nWitnessCacheSize, outPoint, saplingTree.witness(), vLiveSaplingNotes);
             }
         }
     }
@@ -1166,6 +1255,33 @@ void CWallet::DecrementNoteWitnesses(const CBlockIndex* pindex)
     // of the wallet.dat is maintained).
 }
 
+template<typename NoteDataMap>
+void RewindNoteWitnesses(NoteDataMap& noteDataMap, int indexHeight)
+{
+    for (auto& item : noteDataMap) {
+        auto* nd = &(item.second);
+        // Notes found by the rescan are still witnessed below indexHeight,
+        // and are left for it to bring up to the new tip.
+        if (nd->witnessHeight == indexHeight) {
+            if (nd->witnesses.size() > 0) {
+                nd->witnesses.pop_front();
+            }
+            nd->witnessHeight = indexHeight - 1;
+        }
+    }
+}
+
+void CWallet::RewindNoteWitnesses(const CBlockIndex* pindex)
+{
+    LOCK(cs_wallet);
+    for (std::pair<const uint256, CWalletTx>& wtxItem : mapWallet) {
+        ::RewindNoteWitnesses(wtxItem.second.mapSproutNoteData, pindex->nHeight);
+        ::RewindNoteWitnesses(wtxItem.second.mapSaplingNoteData, pindex->nHeight);
+    }
+    // nWitnessCacheSize is left alone: it still bounds the caches of the
+    // notes the rescan has not reached.
+}
+
 bool CWallet::EncryptWallet(const SecureString& strWalletPassphrase)
 {
     if (IsCrypted())
@@ -1590,14 +1706,15 @@ bool CWallet::UpdatedNoteData(const CWalletTx& wtxIn, CWalletTx& wtx)
  * pblock is optional, but should be provided if the transaction is known to be in a block.
  * If fUpdate is true, existing transactions will be updated.
  */
-bool CWallet::AddToWalletIfInvolvingMe(const CTransaction& tx, const CBlock* pblock, bool fUpdate)
+bool CWallet::AddToWalletIfInvolvingMe(const CTransaction& tx, const CBlock* pblock, bool fUpdate,
+                                       const std::pair<mapSaplingNoteData_t, SaplingIncomingViewingKeyMap>* pSaplingNotes)
 {
     {
         AssertLockHeld(cs_wallet);
         bool fExisted = mapWallet.count(tx.GetHash()) != 0;
         if (fExisted && !fUpdate) return false;
         auto sproutNoteData = FindMySproutNotes(tx);
-        auto saplingNoteDataAndAddressesToAdd = FindMySaplingNotes(tx);
+        auto saplingNoteDataAndAddressesToAdd = pSaplingNotes ? *pSaplingNotes : FindMySaplingNotes(tx);
         auto saplingNoteData = saplingNoteDataAndAddressesToAdd.first;
         auto addressesToAdd = saplingNoteDataAndAddressesToAdd.second;
         for (const auto &addressToAdd : addressesToAdd) {
@@ -1766,37 +1883,96 @@ mapSproutNoteData_t CWallet::FindMySproutNotes(const CTransaction &tx) const
  * already have been cached in CWalletTx.mapSaplingNoteData.
  */
 std::pair<mapSaplingNoteData_t, SaplingIncomingViewingKeyMap> CWallet::FindMySaplingNotes(const CTransaction &tx) const
+{
+    return FindMySaplingNotes(std::vector<const CTransaction*>(1, &tx)).front();
+}
+
+/**
+ * Finds the Sapling notes sent to this wallet in each of the given
+ * transactions, trial-decrypting all of their outputs in one pass so that
+ * the work can be spread across the trial decryption threads.
+ */
+std::vector<std::pair<mapSaplingNoteData_t, SaplingIncomingViewingKeyMap>> CWallet::FindMySaplingNotes(const std::vector<const CTransaction*>& vtx) const
 {
     LOCK(cs_SpendingKeyStore);
-    uint256 hash = tx.GetHash();
 
-    mapSaplingNoteData_t noteData;
-    SaplingIncomingViewingKeyMap viewingKeysToAdd;
+    std::vector<std::pair<mapSaplingNoteData_t, SaplingIncomingViewingKeyMap>> vResults(vtx.size());
+
+    size_t nOutputs = 0;
+    for (const CTransaction* ptx : vtx) {
+        nOutputs += ptx->vShieldedOutput.size();
+    }
+    if (nOutputs == 0 || mapSaplingFullViewingKeys.empty()) {
+        return vResults;
+    }
+
+    std::vector<SaplingIncomingViewingKey> ivks;
+    ivks.reserve(mapSaplingFullViewingKeys.size());
+    for (auto it = mapSaplingFullViewingKeys.begin(); it != mapSaplingFullViewingKeys.end(); ++it) {
+        ivks.push_back(it->first);
+    }
 
     // Protocol Spec: 4.19 Block Chain Scanning (Sapling)
-    for (uint32_t i = 0; i < tx.vShieldedOutput.size(); ++i) {
-        const OutputDescription output = tx.vShieldedOutput[i];
-        for (auto it = mapSaplingFullViewingKeys.begin(); it != mapSaplingFullViewingKeys.end(); ++it) {
-            SaplingIncomingViewingKey ivk = it->first;
-            auto result = SaplingNotePlaintext::decrypt(output.encCiphertext, ivk, output.ephemeralKey, output.cm);
-            if (!result) {
-                continue;
+    //
+    // Split the (output, ivk) matrix into work units of consecutive keys for
+    // each output. Results are kept per work unit, so the first matching key
+    // in map order wins regardless of which thread found it.
+    size_t nChecksPerOutput = (ivks.size() + TRIAL_DECRYPTION_KEYS_PER_CHECK - 1) / TRIAL_DECRYPTION_KEYS_PER_CHECK;
+    std::vector<CSaplingTrialDecryption::result_type> vDecrypted(nOutputs * nChecksPerOutput);
+    std::vector<CSaplingTrialDecryption> vChecks;
+    vChecks.reserve(vDecrypted.size());
+    size_t nSlot = 0;
+    for (const CTransaction* ptx : vtx) {
+        for (const OutputDescription& output : ptx->vShieldedOutput) {
+            for (size_t c = 0; c < nChecksPerOutput; c++) {
+                size_t nBegin = c * TRIAL_DECRYPTION_KEYS_PER_CHECK;
+                size_t nEnd = std::min(nBegin + TRIAL_DECRYPTION_KEYS_PER_CHECK, ivks.size());
+                vChecks.push_back(CSaplingTrialDecryption());
+                CSaplingTrialDecryption(output, ivks, nBegin, nEnd, vDecrypted[nSlot++]).swap(vChecks.back());
             }
-            auto address = ivk.address(result.get().d);
-            if (address && mapSaplingIncomingViewingKeys.count(address.get()) == 0) {
-                viewingKeysToAdd[address.get()] = ivk;
+        }
+    }
+
+    // cs_SpendingKeyStore serializes all users of the queue.
+    bool fParallel = nScriptCheckThreads && nOutputs * ivks.size() >= MIN_PARALLEL_TRIAL_DECRYPTIONS;
+    if (fParallel) {
+        CCheckQueueControl<CSaplingTrialDecryption> control(&trialdecryptionqueue);
+        control.Add(vChecks);
+        control.Wait();
+    } else {
+        for (CSaplingTrialDecryption& check : vChecks) {
+            check();
+        }
+    }
+
+    nSlot = 0;
+    for (size_t t = 0; t < vtx.size(); t++) {
+        uint256 hash = vtx[t]->GetHash();
+        mapSaplingNoteData_t& noteData = vResults[t].first;
+        SaplingIncomingViewingKeyMap& viewingKeysToAdd = vResults[t].second;
+        for (uint32_t i = 0; i < vtx[t]->vShieldedOutput.size(); ++i, nSlot += nChecksPerOutput) {
+            for (size_t c = 0; c < nChecksPerOutput; c++) {
+                const auto& result = vDecrypted[nSlot + c];
+                if (!result) {
+                    continue;
+                }
+                const SaplingIncomingViewingKey& ivk = ivks[result->first];
+                auto address = ivk.address(result->second.d);
+                if (address && mapSaplingIncomingViewingKeys.count(address.get()) == 0) {
+                    viewingKeysToAdd[address.get()] = ivk;
+                }
+                // We don't cache the nullifier here as computing it requires knowledge of the note position
+                // in the commitment tree, which can only be determined when the transaction has been mined.
+                SaplingOutPoint op {hash, i};
+                SaplingNoteData nd;
+                nd.ivk = ivk;
+                noteData.insert(std::make_pair(op, nd));
+                break;
             }
-            // We don't cache the nullifier here as computing it requires knowledge of the note position
-            // in the commitment tree, which can only be determined when the transaction has been mined.
-            SaplingOutPoint op {hash, i};
-            SaplingNoteData nd;
-            nd.ivk = ivk;
-            noteData.insert(std::make_pair(op, nd));
-            break;
         }
     }
 
-    return std::make_pair(noteData, viewingKeysToAdd);
+    return vResults;
 }
 
 bool CWallet::IsSproutNullifierFromMe(const uint256& nullifier) const
@@ -2386,10 +2562,112 @@ void CWallet::WitnessNoteCommitment(std::vector<uint256> commitments,
     }
 }
 
+namespace {
+
+/**
+ * Reads a sequence of blocks from disk on a background thread, staying up to
+ * RESCAN_PREFETCH_BLOCKS ahead of the consumer, so that disk reads and header
+ * checks overlap with wallet scanning. Block index entries are never freed,
+ * so this runs without cs_main; the consumer must check that the blocks are
+ * still in the active chain before using them.
+ */
+class CBlockPrefetcher
+{
+private:
+    const std::vector<CBlockIndex*>& vIndex;
+    boost::mutex mutex;
+    boost::condition_variable cond;
+    std::map<size_t, CBlock> mapReady;
+    size_t nConsumed;
+    bool fStop;
+    //! Exception thrown while reading block nFailed, passed on to the consumer
+    std::exception_ptr error;
+    size_t nFailed;
+    boost::thread thread;
+
+    void ThreadRead()
+    {
+        for (size_t i = 0; i < vIndex.size(); i++) {
+            {
+                boost::unique_lock<boost::mutex> lock(mutex);
+                while (!fStop && i >= nConsumed + RESCAN_PREFETCH_BLOCKS) {
+                    cond.wait(lock);
+                }
+                if (fStop) {
+                    return;
+                }
+            }
+            CBlock block;
+            try {
+                ReadBlockFromDisk(block, vIndex[i]);
+            } catch (...) {
+                {
+                    boost::unique_lock<boost::mutex> lock(mutex);
+                    error = std::current_exception();
+                    nFailed = i;
+                }
+                cond.notify_all();
+                return;
+            }
+            {
+                boost::unique_lock<boost::mutex> lock(mutex);
+                mapReady[i] = std::move(block);
+            }
+            cond.notify_all();
+        }
+    }
+
+public:
+    CBlockPrefetcher(const std::vector<CBlockIndex*>& vIndexIn) : vIndex(vIndexIn), nConsumed(0), fStop(false), nFailed(0)
+    {
+        thread = boost::thread(&CBlockPrefetcher::ThreadRead, this);
+    }
+
+    ~CBlockPrefetcher()
+    {
+        {
+            boost::unique_lock<boost::mutex> lock(mutex);
+            fStop = true;
+        }
+        cond.notify_all();
+        thread.join();
+    }
+
+    //! Wait for block i to be read, and move it into block. Blocks must be taken in order.
+    //! Rethrows the exception if reading the block failed.
+    void Take(size_t i, CBlock& block)
+    {
+        boost::unique_lock<boost::mutex> lock(mutex);
+        while (mapReady.count(i) == 0) {
+            if (error && nFailed == i) {
+                std::rethrow_exception(error);
+            }
+            cond.wait(lock);
+        }
+        block = std::move(mapReady[i]);
+        mapReady.erase(i);
+        nConsumed = i + 1;
+        cond.notify_all();
+    }
+};
+
+}
+
 /**
  * Scan the block chain (starting in pindexStart) for transactions
  * from or to us. If fUpdate is true, found transactions that already
  * exist in the wallet will be updated.
+ *
+ * The scan is pipelined: blocks are read from disk ahead of time on a
+ * background thread, the Sapling outputs of RESCAN_DECRYPTION_BLOCKS blocks
+ * at a time are trial-decrypted together on the trial decryption threads,
+ * and transactions and note witnesses are then applied strictly in order.
+ *
+ * cs_main and cs_wallet are only held while a window of blocks is applied,
+ * so the caller must not hold them. While the scan runs, ChainTip leaves the
+ * witness caches alone: the scan applies blocks connected in the meantime
+ * itself, and undoes the ones that were disconnected when it retakes the
+ * locks.
  */
 int CWallet::ScanForWalletTransactions(CBlockIndex* pindexStart, bool fUpdate)
 {
@@ -2401,6 +2679,15 @@ int CWallet::ScanForWalletTransactions(CBlockIndex* pindexStart, bool fUpdate)
 
     std::vector<uint256> myTxHashes;
 
+    LOCK(cs_rescan);
+
+    // Notes found by the scan are witnessed at pindexScanned, the last block
+    // it applied. All other notes are witnessed at pindexWalletTip, the tip
+    // when the scan started or pindexScanned once the scan has passed it.
+    const CBlockIndex* pindexScanned;
+    const CBlockIndex* pindexWalletTip;
+    double dProgressStart;
+    double dProgressTip;
     {
         LOCK2(cs_main, cs_wallet);
 
@@ -2410,56 +2697,135 @@ int CWallet::ScanForWalletTransactions(CBlockIndex* pindexStart, bool fUpdate)
             pindex = chainActive.Next(pindex);
 
         ShowProgress(_("Rescanning..."), 0); // show rescan progress in GUI as dialog or on splashscreen, if -rescan on startup
-        double dProgressStart = Checkpoints::GuessVerificationProgress(chainParams.Checkpoints(), pindex, false);
-        double dProgressTip = Checkpoints::GuessVerificationProgress(chainParams.Checkpoints(), chainActive.Tip(), false);
-        while (pindex)
-        {
-            if (pindex->nHeight % 100 == 0 && dProgressTip - dProgressStart > 0.0)
-                ShowProgress(_("Rescanning..."), std::max(1, std::min(99, (int)((Checkpoints::GuessVerificationProgress(chainParams.Checkpoints(), pindex, false) - dProgressStart) / (dProgressTip - dProgressStart) * 100))));
+        dProgressStart = Checkpoints::GuessVerificationProgress(chainParams.Checkpoints(), pindex, false);
+        dProgressTip = Checkpoints::GuessVerificationProgress(chainParams.Checkpoints(), chainActive.Tip(), false);
 
-            CBlock block;
-            ReadBlockFromDisk(block, pindex);
-            BOOST_FOREACH(CTransaction& tx, block.vtx)
+        pindexScanned = pindex ? pindex->pprev : chainActive.Tip();
+        pindexWalletTip = chainActive.Tip();
+        fRescanning = true;
+    }
+
+    try {
+        while (true) {
+            std::vector<CBlockIndex*> vIndex;
             {
-                if (AddToWalletIfInvolvingMe(tx, &block, fUpdate)) {
-                    myTxHashes.push_back(tx.GetHash());
-                    ret++;
+                LOCK2(cs_main, cs_wallet);
+
+                // Undo the blocks that were disconnected while the locks were
+                // released, down to the fork with the active chain.
+                while (pindexWalletTip && !chainActive.Contains(pindexWalletTip)) {
+                    CBlock block;
+                    ReadBlockFromDisk(block, pindexWalletTip);
+                    if (pindexWalletTip == pindexScanned) {
+                        DecrementNoteWitnesses(pindexWalletTip);
+                        pindexScanned = pindexScanned->pprev;
+                    } else {
+                        RewindNoteWitnesses(pindexWalletTip);
+                    }
+                    UpdateSaplingNullifierNoteMapForBlock(&block);
+                    pindexWalletTip = pindexWalletTip->pprev;
                 }
-            }
 
-            SproutMerkleTree sproutTree;
-            SaplingMerkleTree saplingTree;
-            // This should never fail: we should always be able to get the tree
-            // state on the path to the tip of our chain
-            assert(pcoinsTip->GetSproutAnchorAt(pindex->hashSproutAnchor, sproutTree));
-            if (pindex->pprev) {
-                if (NetworkUpgradeActive(pindex->pprev->nHeight, Params().GetConsensus(), Consensus::UPGRADE_SAPLING)) {
-                    assert(pcoinsTip->GetSaplingAnchorAt(pindex->pprev->hashFinalSaplingRoot, saplingTree));
+                CBlockIndex* pindexNext = pindexScanned ? chainActive.Next(pindexScanned) : chainActive.Genesis();
+                for (; pindexNext; pindexNext = chainActive.Next(pindexNext)) {
+                    vIndex.push_back(pindexNext);
                 }
-            }
-            // Increment note witness caches
-            ChainTip(pindex, &block, sproutTree, saplingTree, true);
 
-            pindex = chainActive.Next(pindex);
-            if (GetTime() >= nNow + 60) {
-                nNow = GetTime();
-                LogPrintf("Still rescanning. At block %d. Progress=%f\n", pindex->nHeight, Checkpoints::GuessVerificationProgress(chainParams.Checkpoints(), pindex));
+                if (vIndex.empty()) {
+                    // Caught up with the tip, so ChainTip can take over again.
+                    fRescanning = false;
+
+                    // After rescanning, persist Sapling note data that might have changed, e.g. nullifiers.
+                    // Do not flush the wallet here for performance reasons.
+                    CWalletDB walletdb(strWalletFile, "r+", false);
+                    for (auto hash : myTxHashes) {
+                        CWalletTx wtx = mapWallet[hash];
+                        if (!wtx.mapSaplingNoteData.empty()) {
+                            if (!wtx.WriteToDisk(&walletdb)) {
+                                LogPrintf("Rescanning... WriteToDisk failed to update Sapling note data for: %s\n", hash.ToString());
+                            }
+                        }
+                    }
+
+                    ShowProgress(_("Rescanning..."), 100); // hide progress dialog in GUI
+                    break;
+                }
             }
-        }
 
-        // After rescanning, persist Sapling note data that might have changed, e.g. nullifiers.
-        // Do not flush the wallet here for performance reasons.
-        CWalletDB walletdb(strWalletFile, "r+", false);
-        for (auto hash : myTxHashes) {
-            CWalletTx wtx = mapWallet[hash];
-            if (!wtx.mapSaplingNoteData.empty()) {
-                if (!wtx.WriteToDisk(&walletdb)) {
-                    LogPrintf("Rescanning... WriteToDisk failed to update Sapling note data for: %s\n", hash.ToString());
+            CBlockPrefetcher prefetcher(vIndex);
+
+            for (size_t nWindow = 0; nWindow < vIndex.size(); nWindow += RESCAN_DECRYPTION_BLOCKS)
+            {
+                size_t nWindowEnd = std::min(nWindow + RESCAN_DECRYPTION_BLOCKS, vIndex.size());
+
+                std::vector<CBlock> vBlocks(nWindowEnd - nWindow);
+                std::vector<const CTransaction*> vtx;
+                for (size_t i = nWindow; i < nWindowEnd; i++) {
+                    CBlock& block = vBlocks[i - nWindow];
+                    prefetcher.Take(i, block);
+                    for (const CTransaction& tx : block.vtx) {
+                        vtx.push_back(&tx);
+                    }
+                }
+
+                LOCK2(cs_main, cs_wallet);
+
+                // If the chain changed while the locks were released, start
+                // over from the last block we applied.
+                if (!chainActive.Contains(vIndex[nWindowEnd - 1]) || !chainActive.Contains(pindexWalletTip)) {
+                    break;
+                }
+
+                // The wallet's viewing keys don't change while we hold cs_wallet,
+                // so the notes of the whole window can be found up front.
+                auto vSaplingNotes = FindMySaplingNotes(vtx);
+
+                size_t nTx = 0;
+                for (size_t i = nWindow; i < nWindowEnd; i++) {
+                    pindex = vIndex[i];
+                    CBlock& block = vBlocks[i - nWindow];
+
+                    if (pindex->nHeight % 100 == 0 && dProgressTip - dProgressStart > 0.0)
+                        ShowProgress(_("Rescanning..."), std::max(1, std::min(99, (int)((Checkpoints::GuessVerificationProgress(chainParams.Checkpoints(), pindex, false) - dProgressStart) / (dProgressTip - dProgressStart) * 100))));
+
+                    BOOST_FOREACH(CTransaction& tx, block.vtx)
+                    {
+                        if (AddToWalletIfInvolvingMe(tx, &block, fUpdate, &vSaplingNotes[nTx++])) {
+                            myTxHashes.push_back(tx.GetHash());
+                            ret++;
+                        }
+                    }
+
+                    SproutMerkleTree sproutTree;
+                    SaplingMerkleTree saplingTree;
+                    // This should never fail: we should always be able to get the tree
+                    // state on the path to the tip of our chain
+                    assert(pcoinsTip->GetSproutAnchorAt(pindex->hashSproutAnchor, sproutTree));
+                    if (pindex->pprev) {
+                        if (NetworkUpgradeActive(pindex->pprev->nHeight, Params().GetConsensus(), Consensus::UPGRADE_SAPLING)) {
+                            assert(pcoinsTip->GetSaplingAnchorAt(pindex->pprev->hashFinalSaplingRoot, saplingTree));
+                        }
+                    }
+                    // Increment note witness caches
+                    IncrementNoteWitnesses(pindex, &block, sproutTree, saplingTree);
+                    UpdateSaplingNullifierNoteMapForBlock(&block);
+
+                    pindexScanned = pindex;
+                    if (pindex->nHeight > pindexWalletTip->nHeight) {
+                        pindexWalletTip = pindex;
+                    }
+
+                    if (GetTime() >= nNow + 60) {
+                        nNow = GetTime();
+                        LogPrintf("Still rescanning. At block %d. Progress=%f\n", pindex->nHeight, Checkpoints::GuessVerificationProgress(chainParams.Checkpoints(), pindex));
+                    }
                 }
             }
         }
-
-        ShowProgress(_("Rescanning..."), 100); // hide progress dialog in GUI
+    } catch (...) {
+        LOCK(cs_wallet);
+        fRescanning = false;
+        throw;
     }
     return ret;
 }
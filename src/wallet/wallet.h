@@ -65,6 +65,22 @@ static const unsigned int WITNESS_CACHE_SIZE = MAX_REORG_LENGTH + 1;
 //! Size of HD seed in bytes
 static const size_t HD_WALLET_SEED_LENGTH = 32;
 
+//! Minimum number of (output, incoming viewing key) pairs in a transaction
+//  for Sapling trial decryption to be spread across worker threads
+static const size_t MIN_PARALLEL_TRIAL_DECRYPTIONS = 64;
+
+//! Number of incoming viewing keys tried by each trial decryption work unit
+static const size_t TRIAL_DECRYPTION_KEYS_PER_CHECK = 32;
+
+//! Number of blocks read from disk ahead of the wallet during a rescan
+static const size_t RESCAN_PREFETCH_BLOCKS = 16;
+
+//! Number of blocks whose Sapling outputs are trial-decrypted together during a rescan
+static const size_t RESCAN_DECRYPTION_BLOCKS = 8;
+
+/** Run an instance of the Sapling trial decryption thread */
+void ThreadSaplingTrialDecryption();
+
 class CBlockIndex;
 class CCoinControl;
 class COutput;
@@ -780,6 +796,11 @@ protected:
      * pindex is the old tip being disconnected.
      */
     void DecrementNoteWitnesses(const CBlockIndex* pindex);
+    /**
+     * pindex is a block disconnected during a rescan, above the blocks the
+     * rescan has reached. Only the notes witnessed at its height are rewound.
+     */
+    void RewindNoteWitnesses(const CBlockIndex* pindex);
 
     template <typename WalletDB>
     void SetBestChainINTERNAL(WalletDB& walletdb, const CBlockLocator& loc) {
@@ -831,6 +852,9 @@ protected:
     /* the hd chain data model (chain counters) */
     CHDChain hdChain;
 
+    /* set while ScanForWalletTransactions runs; ChainTip then leaves the witness caches to it */
+    bool fRescanning;
+
 public:
     /*
      * Main wallet lock.
@@ -841,6 +865,12 @@ public:
      */
     mutable CCriticalSection cs_wallet;
 
+    /*
+     * Held for the whole of ScanForWalletTransactions, which takes cs_main
+     * and cs_wallet for a few blocks at a time. Taken before cs_main.
+     */
+    CCriticalSection cs_rescan;
+
     bool fFileBacked;
     std::string strWalletFile;
 
@@ -885,6 +915,7 @@ public:
         nTimeFirstKey = 0;
         fBroadcastTransactions = false;
         nWitnessCacheSize = 0;
+        fRescanning = false;
     }
 
     /**
@@ -1103,7 +1134,12 @@ public:
     void UpdateSaplingNullifierNoteMapForBlock(const CBlock* pblock);
     bool AddToWallet(const CWalletTx& wtxIn, bool fFromLoadWallet, CWalletDB* pwalletdb);
     void SyncTransaction(const CTransaction& tx, const CBlock* pblock);
-    bool AddToWalletIfInvolvingMe(const CTransaction& tx, const CBlock* pblock, bool fUpdate);
+    /**
+     * If pSaplingNotes is not NULL, it must hold the result of
+     * FindMySaplingNotes(tx) for the wallet's current keys.
+     */
+    bool AddToWalletIfInvolvingMe(const CTransaction& tx, const CBlock* pblock, bool fUpdate,
+                                  const std::pair<mapSaplingNoteData_t, SaplingIncomingViewingKeyMap>* pSaplingNotes = NULL);
     void EraseFromWallet(const uint256 &hash);
     void WitnessNoteCommitment(
          std::vector<uint256> commitments,
@@ -1149,6 +1185,7 @@ public:
         uint8_t n) const;
     mapSproutNoteData_t FindMySproutNotes(const CTransaction& tx) const;
     std::pair<mapSaplingNoteData_t, SaplingIncomingViewingKeyMap> FindMySaplingNotes(const CTransaction& tx) const;
+    std::vector<std::pair<mapSaplingNoteData_t, SaplingIncomingViewingKeyMap>> FindMySaplingNotes(const std::vector<const CTransaction*>& vtx) const;
     bool IsSproutNullifierFromMe(const uint256& nullifier) const;
     bool IsSaplingNullifierFromMe(const uint256& nullifier) const;
 
@@ -165,7 +165,8 @@ public:
         uint64_t vpub_new,
         const uint256& rt,
         bool computeProof,
-        uint256 *out_esk // Payment disclosure
+        uint256 *out_esk, // Payment disclosure
+        uint252 *out_phi
     ) {
         if (vpub_old > MAX_MONEY) {
             throw std::invalid_argument("nonsensical vpub_old value");
@@ -223,6 +224,9 @@ public:
 
         // Sample phi
         uint252 phi = random_uint252();
+        if (out_phi != nullptr) {
+            *out_phi = phi;
+        }
 
         // Compute notes for outputs
         for (size_t i = 0; i < NumOutputs; i++) {
@@ -281,11 +285,27 @@ public:
             out_macs[i] = PRF_pk(inputs[i].key, i, h_sig);
         }
 
-        if (makeGrothProof) {
-            if (!computeProof) {
+        if (!computeProof) {
+            if (makeGrothProof) {
                 return GrothProof();
             }
+            return PHGRProof();
+        }
 
+        return prove_notes(makeGrothProof, inputs, out_notes, phi, h_sig, vpub_old, vpub_new, rt);
+    }
+
+    SproutProof prove_notes(
+        bool makeGrothProof,
+        const std::array<JSInput, NumInputs>& inputs,
+        const std::array<SproutNote, NumOutputs>& notes,
+        const uint252& phi,
+        const uint256& h_sig,
+        uint64_t vpub_old,
+        uint64_t vpub_new,
+        const uint256& rt
+    ) {
+        if (makeGrothProof) {
             GrothProof proof;
 
             CDataStream ss1(SER_NETWORK, PROTOCOL_VERSION);
@@ -315,13 +335,13 @@ public:
                 inputs[1].note.r.begin(),
                 auth2.data(),
 
-                out_notes[0].a_pk.begin(),
-                out_notes[0].value(),
-                out_notes[0].r.begin(),
+                notes[0].a_pk.begin(),
+                notes[0].value(),
+                notes[0].r.begin(),
 
-                out_notes[1].a_pk.begin(),
-                out_notes[1].value(),
-                out_notes[1].r.begin(),
+                notes[1].a_pk.begin(),
+                notes[1].value(),
+                notes[1].r.begin(),
 
                 vpub_old,
                 vpub_new
@@ -330,10 +350,6 @@ public:
             return proof;
         }
 
-        if (!computeProof) {
-            return PHGRProof();
-        }
-
         protoboard<FieldT> pb;
         {
             joinsplit_gadget<FieldT, NumInputs, NumOutputs> g(pb);
@@ -343,14 +359,14 @@ public:
                 rt,
                 h_sig,
                 inputs,
-                out_notes,
+                notes,
                 vpub_old,
                 vpub_new
             );
         }
 
         // The constraint system must be satisfied or there is an unimplemented
-        // or incorrect sanity check above. Or the constraint system is broken!
+        // or incorrect sanity check in prove(). Or the constraint system is broken!
         assert(pb.is_satisfied());
 
         // TODO: These are copies, which is not strictly necessary.
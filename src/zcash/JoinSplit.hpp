@@ -89,7 +89,22 @@ public:
         // For paymentdisclosure, we need to retrieve the esk.
         // Reference as non-const parameter with default value leads to compile error.
         // So use pointer for simplicity.
-        uint256 *out_esk = nullptr
+        uint256 *out_esk = nullptr,
+        // To create the proof later with prove_notes(), we need to retrieve phi.
+        uint252 *out_phi = nullptr
+    ) = 0;
+
+    // Compute only the SNARK proof, for notes that were created by an earlier
+    // call to prove() with computeProof = false
+    virtual SproutProof prove_notes(
+        bool makeGrothProof,
+        const std::array<JSInput, NumInputs>& inputs,
+        const std::array<SproutNote, NumOutputs>& notes,
+        const uint252& phi,
+        const uint256& h_sig,
+        uint64_t vpub_old,
+        uint64_t vpub_new,
+        const uint256& rt
     ) = 0;
 
     virtual bool verify(